@@ -0,0 +1,78 @@
+// Frustum culling and LOD selection of all objects. Visible objects are appended to the instance list of the
+// indirect draw of their geometry and LOD, so each geometry is drawn with one instanced draw per LOD.
+struct CullUniforms {
+	planes: array<vec4f, 6>,
+	eye: vec4f,
+	commandCount: u32,
+	lodScale: f32 // 0 disables LOD selection
+};
+@group(0) @binding(0) var<uniform> uCullUniforms: CullUniforms;
+
+// World space bounding box of each object slot, extent.w is the largest scale of the object
+struct Bounds {
+	center: vec4f,
+	extent: vec4f
+};
+@group(0) @binding(1) var<storage, read> uBounds: array<Bounds>;
+
+// One per object. The draws of its geometry are consecutive, from the finest LOD.
+struct DrawCommand {
+	slot: u32,
+	firstDraw: u32,
+	lodCount: u32,
+	padding: u32
+};
+@group(0) @binding(2) var<storage, read> uCommands: array<DrawCommand>;
+
+// Same layout as drawIndexedIndirect arguments, instanceCount is reset to zero before the pass.
+// firstInstance is the start of the range of the draw in the instance list.
+struct DrawIndexedIndirect {
+	indexCount: u32,
+	instanceCount: atomic<u32>,
+	firstIndex: u32,
+	baseVertex: i32,
+	firstInstance: u32
+};
+@group(0) @binding(3) var<storage, read_write> uDraws: array<DrawIndexedIndirect>;
+
+// Error of the LOD drawn by each draw
+@group(0) @binding(4) var<storage, read> uLodErrors: array<f32>;
+
+// Object slots of the instances of all draws, read by the vertex shader
+@group(0) @binding(5) var<storage, read_write> uInstanceSlots: array<u32>;
+
+@compute @workgroup_size(64)
+fn cs_main(@builtin(global_invocation_id) id: vec3u) {
+	let i = id.x;
+	if (i >= uCullUniforms.commandCount) {
+		return;
+	}
+
+	let command = uCommands[i];
+	let bounds = uBounds[command.slot];
+	for (var p = 0u; p < 6u; p++) {
+		let plane = uCullUniforms.planes[p];
+		let d = dot(plane.xyz, bounds.center.xyz) + plane.w;
+		let r = dot(abs(plane.xyz), bounds.extent.xyz);
+		if (d + r < 0.0) {
+			return;
+		}
+	}
+
+	// Coarsest level whose error, projected at the closest point of the bounding box, stays under the threshold
+	var lod = 0u;
+	if (uCullUniforms.lodScale > 0.0 && command.lodCount > 1u) {
+		let distance = max(length(bounds.center.xyz - uCullUniforms.eye.xyz) - length(bounds.extent.xyz), 1e-4);
+		let scale = bounds.extent.w * uCullUniforms.lodScale / distance;
+		for (var l = 1u; l < command.lodCount; l++) {
+			if (uLodErrors[command.firstDraw + l] * scale > 1.0) {
+				break;
+			}
+			lod = l;
+		}
+	}
+
+	let draw = command.firstDraw + lod;
+	let instance = atomicAdd(&uDraws[draw].instanceCount, 1u);
+	uInstanceSlots[uDraws[draw].firstInstance + instance] = command.slot;
+}
@@ -8,9 +8,11 @@ struct SceneUniforms {
 struct ModelUniforms {
 	modelMatrix: mat4x4f
 };
-@group(1) @binding(0) var<uniform> uModelUniforms: ModelUniforms;
+// One entry per instance: all objects share one buffer (indexed with firstInstance), each mesh has its own
+@group(1) @binding(0) var<storage, read> uModelUniforms: array<ModelUniforms>;
 
 struct VertexIn {
+    @builtin(instance_index) instanceIndex: u32,
     @location(0) position: vec3f,
     @location(1) normal: vec3f,
 };
@@ -20,11 +22,23 @@ struct VertexOut {
     @location(0) normal: vec3f,
 };
 
+// Draws of the GPU culling pass: instance i of a draw is the i-th visible object of its geometry and LOD
+@group(2) @binding(0) var<storage, read> uInstanceSlots: array<u32>;
+
 @vertex
 fn vs_main(in: VertexIn) -> VertexOut {
+    return transformVertex(in, uModelUniforms[in.instanceIndex].modelMatrix);
+}
+
+@vertex
+fn vs_culled(in: VertexIn) -> VertexOut {
+    return transformVertex(in, uModelUniforms[uInstanceSlots[in.instanceIndex]].modelMatrix);
+}
+
+fn transformVertex(in: VertexIn, modelMatrix: mat4x4f) -> VertexOut {
 	var out: VertexOut;
-    out.position = uSceneUniforms.projMatrix * uSceneUniforms.viewMatrix * uModelUniforms.modelMatrix * vec4f(in.position, 1.0f);
-    out.normal = (uModelUniforms.modelMatrix * vec4f(in.normal, 0.0f)).xyz;
+    out.position = uSceneUniforms.projMatrix * uSceneUniforms.viewMatrix * modelMatrix * vec4f(in.position, 1.0f);
+    out.normal = (modelMatrix * vec4f(in.normal, 0.0f)).xyz;
     return out;
 }
 
@@ -0,0 +1,62 @@
+// Variant of simple.wgsl for the compact vertex format: positions are 16 bits in the bounding box of the mesh,
+// normals are octahedral encoded. The dequantization of positions is folded in the model matrix.
+
+// Uniform structs
+struct SceneUniforms {
+	projMatrix: mat4x4f,
+	viewMatrix: mat4x4f
+};
+@group(0) @binding(0) var<uniform> uSceneUniforms: SceneUniforms;
+
+struct ModelUniforms {
+	modelMatrix: mat4x4f
+};
+@group(1) @binding(0) var<storage, read> uModelUniforms: array<ModelUniforms>;
+
+struct VertexIn {
+    @builtin(instance_index) instanceIndex: u32,
+    @location(0) position: vec4f, // unorm16x4, w unused
+    @location(1) normal: vec2f,   // snorm16x2, octahedral
+};
+
+struct VertexOut {
+    @builtin(position) position: vec4f,
+    @location(0) normal: vec3f,
+};
+
+fn decodeOctahedral(e: vec2f) -> vec3f {
+    var n = vec3f(e.xy, 1.0f - abs(e.x) - abs(e.y));
+    let t = max(-n.z, 0.0f);
+    n.x += select(t, -t, n.x >= 0.0f);
+    n.y += select(t, -t, n.y >= 0.0f);
+    return normalize(n);
+}
+
+// Draws of the GPU culling pass: instance i of a draw is the i-th visible object of its geometry and LOD
+@group(2) @binding(0) var<storage, read> uInstanceSlots: array<u32>;
+
+@vertex
+fn vs_main(in: VertexIn) -> VertexOut {
+    return transformVertex(in, uModelUniforms[in.instanceIndex].modelMatrix);
+}
+
+@vertex
+fn vs_culled(in: VertexIn) -> VertexOut {
+    return transformVertex(in, uModelUniforms[uInstanceSlots[in.instanceIndex]].modelMatrix);
+}
+
+fn transformVertex(in: VertexIn, modelMatrix: mat4x4f) -> VertexOut {
+	var out: VertexOut;
+    out.position = uSceneUniforms.projMatrix * uSceneUniforms.viewMatrix * modelMatrix * vec4f(in.position.xyz, 1.0f);
+
+    // Normals are transformed by the cofactor matrix, which undoes the non-uniform scale of the dequantization
+    let m = mat3x3f(modelMatrix[0].xyz, modelMatrix[1].xyz, modelMatrix[2].xyz);
+    let cofactor = mat3x3f(cross(m[1], m[2]), cross(m[2], m[0]), cross(m[0], m[1]));
+    out.normal = normalize(cofactor * decodeOctahedral(in.normal));
+    return out;
+}
+
+@fragment
+fn fs_main(in: VertexOut) -> @location(0) vec4f {
+    return vec4f(0.2f * (vec3f(3.0f) + 2.0f * in.normal.xyz), 1.0f);
+}
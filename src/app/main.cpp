@@ -26,13 +26,13 @@ void ExampleSphere() {
 void ExampleManySpheres() {
 	tinyrender::init("tinyrenderwgpu", 1280, 720);
 	tinyrender::getOptions().eye = glm::vec3(0.f, 1.f, -70.0f);
+	const uint32_t meshId = tinyrender::addSphereMesh(1.0f, 16);
 	for (int i = 0; i < 100; i++) {
 		const float x = float(rand() % 50) - 25.0f;
 		const float y = float(rand() % 50) - 25.0f;
 		const float z = float(rand() % 50) - 25.0f;
 		const glm::vec3 s = glm::vec3(1.0f) * (0.35f + float(rand()) / float(RAND_MAX));
-		const uint32_t id = tinyrender::addSphere(1.0f, 16);
-		tinyrender::updateObject(id, glm::vec3(x, y, z), glm::vec3(0.0f), s);
+		tinyrender::addInstance(meshId, glm::vec3(x, y, z), glm::vec3(0.0f), s);
 	}
 	while (!tinyrender::shouldQuit()) {
 		tinyrender::update();
@@ -45,14 +45,14 @@ void ExampleManySpheres() {
 void ExampleRotatedBoxes() {
 	tinyrender::init("tinyrenderwgpu", 1280, 720);
 	tinyrender::getOptions().eye = glm::vec3(0.f, 1.f, -70.0f);
+	const uint32_t meshId = tinyrender::addBoxMesh(1.0f);
 	for (int i = 0; i < 100; i++) {
 		const float x = float(rand() % 50) - 25.0f;
 		const float y = float(rand() % 50) - 25.0f;
 		const float z = float(rand() % 50) - 25.0f;
 		const glm::vec3 s = glm::vec3(1.0f) * (0.35f + float(rand()) / float(RAND_MAX));
 		const glm::vec3 r = glm::vec3(float(rand() % 180), float(rand() % 180), float(rand() % 180));
-		const uint32_t id = tinyrender::addBox(1.0f);
-		tinyrender::updateObject(id, glm::vec3(x, y, z), r, s);
+		tinyrender::addInstance(meshId, glm::vec3(x, y, z), r, s);
 	}
 	while (!tinyrender::shouldQuit()) {
 		tinyrender::update();
@@ -62,11 +62,46 @@ void ExampleRotatedBoxes() {
 	tinyrender::terminate();
 }
 
+void ExamplePicking() {
+	tinyrender::init("tinyrenderwgpu", 1280, 720);
+	tinyrender::getOptions().eye = glm::vec3(0.f, 1.f, -70.0f);
+	tinyrender::getOptions().picking = true;
+	for (int i = 0; i < 100; i++) {
+		const float x = float(rand() % 50) - 25.0f;
+		const float y = float(rand() % 50) - 25.0f;
+		const float z = float(rand() % 50) - 25.0f;
+		const uint32_t id = tinyrender::addSphere(1.0f, 16);
+		tinyrender::updateObject(id, glm::vec3(x, y, z), glm::vec3(0.0f), glm::vec3(1.0f));
+	}
+	const uint32_t markerMesh = tinyrender::addBoxMesh(0.2f);
+	const uint32_t marker = tinyrender::addInstance(markerMesh, glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(1.0f));
+	while (!tinyrender::shouldQuit()) {
+		tinyrender::update();
+		const tinyrender::PickResult result = tinyrender::pick(tinyrender::getMousePosition());
+		if (result.hit)
+			tinyrender::updateInstance(marker, result.position, glm::vec3(0.0f), glm::vec3(1.0f));
+		tinyrender::render();
+		tinyrender::swap();
+	}
+	tinyrender::terminate();
+}
+
+void ExampleHeadless() {
+	tinyrender::getOptions().headless = true;
+	tinyrender::init("tinyrenderwgpu", 512, 512);
+	tinyrender::getOptions().eye = glm::vec3(0.f, 1.f, -10.0f);
+	tinyrender::addSphere(1.0f, 32);
+	tinyrender::Image image = tinyrender::renderToImage();
+	tinyrender::saveImage(image, "sphere.png");
+	tinyrender::terminate();
+}
 
 int main(int /*argc*/, const char** /*argv*/) {
 	//ExampleEmptyWindow();
 	//ExampleSphere();
 	//ExampleManySpheres();
 	ExampleRotatedBoxes();
+	//ExamplePicking();
+	//ExampleHeadless();
 	return 0;
 }
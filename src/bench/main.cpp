@@ -0,0 +1,310 @@
+#include <tinyrender.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Stress scenes for tinyrender, rendered headless by default.
+// Usage: TinyRenderBench [--scenes spheres,boxes,planes,churn,updates,uploads,batch] [--counts 100,1000,...]
+//                        [--frames 200] [--output results.json] [--window]
+// Frame times are CPU times: render() submits the frame and does not wait for the GPU to finish it.
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchSettings {
+	std::vector<std::string> scenes = { "spheres", "boxes", "planes", "churn", "updates", "uploads", "batch" };
+	std::vector<uint32_t> counts = { 100, 1000, 10000, 100000, 1000000 };
+	int frames = 200;
+	std::string output = "bench_results.json";
+	bool window = false;
+};
+
+struct Percentiles {
+	double p50 = 0.0, p95 = 0.0, p99 = 0.0, max = 0.0;
+};
+
+struct BenchResult {
+	std::string scene;
+	uint32_t objects = 0;
+	int frames = 0;
+	double addObjectsPerSecond = 0.0;
+	Percentiles encodeMs;
+	Percentiles submitMs;
+	Percentiles cpuFrameMs; // update, render and swap, without GPU completion
+};
+
+static double ElapsedMs(Clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static Percentiles ComputePercentiles(std::vector<double> samples) {
+	Percentiles p;
+	if (samples.empty()) {
+		return p;
+	}
+	std::sort(samples.begin(), samples.end());
+	auto at = [&](double q) { return samples[std::min(samples.size() - 1, size_t(q * double(samples.size())))]; };
+	p.p50 = at(0.50);
+	p.p95 = at(0.95);
+	p.p99 = at(0.99);
+	p.max = samples.back();
+	return p;
+}
+
+static std::vector<std::string> SplitList(const char* list) {
+	std::vector<std::string> items;
+	std::stringstream stream(list);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		if (!item.empty()) {
+			items.push_back(item);
+		}
+	}
+	return items;
+}
+
+// Whole number in [1, max], anything else (signs, trailing characters, overflow) is rejected
+static bool ParseCount(const char* text, unsigned long long max, unsigned long long& value) {
+	char* end = nullptr;
+	value = strtoull(text, &end, 10);
+	return end != text && *end == '\0' && text[0] != '-' && value >= 1 && value <= max;
+}
+
+static bool ParseArguments(int argc, const char** argv, BenchSettings& settings) {
+	for (int i = 1; i < argc; i++) {
+		const bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "--scenes") == 0 && hasValue) {
+			settings.scenes = SplitList(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--counts") == 0 && hasValue) {
+			settings.counts.clear();
+			for (const std::string& count : SplitList(argv[++i])) {
+				unsigned long long value;
+				if (!ParseCount(count.c_str(), UINT32_MAX, value)) {
+					std::cerr << "Invalid object count " << count << std::endl;
+					return false;
+				}
+				settings.counts.push_back(uint32_t(value));
+			}
+		}
+		else if (strcmp(argv[i], "--frames") == 0 && hasValue) {
+			unsigned long long value;
+			if (!ParseCount(argv[++i], INT32_MAX, value)) {
+				std::cerr << "Invalid frame count " << argv[i] << std::endl;
+				return false;
+			}
+			settings.frames = int(value);
+		}
+		else if (strcmp(argv[i], "--output") == 0 && hasValue) {
+			settings.output = argv[++i];
+		}
+		else if (strcmp(argv[i], "--window") == 0) {
+			settings.window = true;
+		}
+		else {
+			std::cerr << "Unknown argument " << argv[i] << std::endl;
+			return false;
+		}
+	}
+	for (const std::string& scene : settings.scenes) {
+		if (scene != "spheres" && scene != "boxes" && scene != "planes" && scene != "churn" && scene != "updates" &&
+			scene != "uploads" && scene != "batch") {
+			std::cerr << "Unknown scene " << scene << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Random position in a cube whose volume grows with the object count, to keep density constant
+static glm::vec3 RandomPosition(uint32_t count) {
+	const float halfSize = 2.0f * std::cbrt(float(count));
+	auto random = [&]() { return (float(rand()) / float(RAND_MAX) * 2.0f - 1.0f) * halfSize; };
+	return glm::vec3(random(), random(), random());
+}
+
+static glm::vec3 RandomRotation() {
+	return glm::vec3(float(rand() % 180), float(rand() % 180), float(rand() % 180));
+}
+
+// Octahedron with jittered vertices: every descriptor is distinct, so none is served by the geometry cache
+static tinyrender::ObjectDescriptor DistinctDescriptor(uint32_t count) {
+	tinyrender::ObjectDescriptor desc;
+	auto jitter = [&]() { return 0.5f + 0.25f * float(rand()) / float(RAND_MAX); };
+	desc.vertices = {
+		{ jitter(), 0, 0 }, { -jitter(), 0, 0 }, { 0, jitter(), 0 }, { 0, -jitter(), 0 }, { 0, 0, jitter() }, { 0, 0, -jitter() }
+	};
+	for (const glm::vec3& v : desc.vertices) {
+		desc.normals.push_back(glm::normalize(v));
+	}
+	desc.triangles = { 0, 2, 4, 2, 1, 4, 1, 3, 4, 3, 0, 4, 2, 0, 5, 1, 2, 5, 3, 1, 5, 0, 3, 5 };
+	desc.translation = RandomPosition(count);
+	return desc;
+}
+
+static uint32_t AddSceneObject(const std::string& scene, uint32_t count) {
+	uint32_t id;
+	glm::vec3 r = glm::vec3(0.0f);
+	if (scene == "boxes") {
+		id = tinyrender::addBox(0.5f);
+		r = RandomRotation();
+	}
+	else if (scene == "planes") {
+		id = tinyrender::addPlane(4.0f, 64);
+		r = RandomRotation();
+	}
+	else {
+		id = tinyrender::addSphere(0.5f, 16);
+	}
+	tinyrender::updateObject(id, RandomPosition(count), r, glm::vec3(1.0f));
+	return id;
+}
+
+static BenchResult RunScene(const std::string& scene, uint32_t count, int frames) {
+	BenchResult result;
+	result.scene = scene;
+	result.objects = count;
+	result.frames = frames;
+	srand(1234);
+
+	// Camera sees the whole scene from outside
+	const float halfSize = 2.0f * std::cbrt(float(count));
+	tinyrender::getOptions().eye = glm::vec3(0.0f, -3.0f * halfSize, halfSize);
+	tinyrender::getOptions().at = glm::vec3(0.0f);
+	tinyrender::getOptions().zFar = 10.0f * halfSize;
+
+	// Upload scenes time distinct descriptors going through addObject one by one or through addObjects,
+	// the other scenes time cached primitives placed with updateObject
+	std::vector<uint32_t> ids;
+	std::vector<tinyrender::ObjectDescriptor> descriptors;
+	if (scene == "uploads" || scene == "batch") {
+		descriptors.reserve(count);
+		for (uint32_t i = 0; i < count; i++) {
+			descriptors.push_back(DistinctDescriptor(count));
+		}
+	}
+	ids.reserve(count);
+	const Clock::time_point addStart = Clock::now();
+	if (scene == "uploads") {
+		for (const tinyrender::ObjectDescriptor& desc : descriptors) {
+			ids.push_back(tinyrender::addObject(desc));
+		}
+	}
+	else if (scene == "batch") {
+		ids = tinyrender::addObjects(descriptors);
+	}
+	else {
+		for (uint32_t i = 0; i < count; i++) {
+			ids.push_back(AddSceneObject(scene, count));
+		}
+	}
+	result.addObjectsPerSecond = double(count) / std::max(1e-6, ElapsedMs(addStart) / 1000.0);
+	descriptors = {};
+
+	std::vector<double> encodeMs, submitMs, cpuFrameMs;
+	std::vector<glm::vec3> positions, rotations, scales;
+	for (int frame = 0; frame < frames; frame++) {
+		const Clock::time_point frameStart = Clock::now();
+		if (scene == "churn") {
+			// Remove and add back 1% of the objects, most recent first
+			const uint32_t churn = std::max(1u, count / 100);
+			for (uint32_t i = 0; i < churn; i++) {
+				tinyrender::removeObject(ids.back());
+				ids.pop_back();
+			}
+			for (uint32_t i = 0; i < churn; i++) {
+				ids.push_back(AddSceneObject(scene, count));
+			}
+		}
+		else if (scene == "updates") {
+			const float t = float(frame) * 0.05f;
+			positions.resize(ids.size());
+			rotations.assign(ids.size(), glm::vec3(0.0f, 0.0f, 10.0f * t));
+			scales.assign(ids.size(), glm::vec3(1.0f));
+			for (size_t i = 0; i < ids.size(); i++) {
+				const float phase = float(i) * 0.37f;
+				positions[i] = glm::vec3(std::cos(t + phase), std::sin(t + phase), std::sin(0.5f * t + phase)) * halfSize;
+			}
+			tinyrender::updateObjects(ids, positions, rotations, scales);
+		}
+
+		tinyrender::update();
+		tinyrender::render();
+		tinyrender::swap();
+		cpuFrameMs.push_back(ElapsedMs(frameStart));
+		encodeMs.push_back(tinyrender::getFrameStats().encodeMs);
+		submitMs.push_back(tinyrender::getFrameStats().submitMs);
+	}
+	result.encodeMs = ComputePercentiles(encodeMs);
+	result.submitMs = ComputePercentiles(submitMs);
+	result.cpuFrameMs = ComputePercentiles(cpuFrameMs);
+
+	// Leave an empty scene for the next run
+	while (!ids.empty()) {
+		tinyrender::removeObject(ids.back());
+		ids.pop_back();
+	}
+	return result;
+}
+
+static void WritePercentiles(std::ostream& out, const char* name, const Percentiles& p) {
+	out << "\"" << name << "\": { \"p50\": " << p.p50 << ", \"p95\": " << p.p95 << ", \"p99\": " << p.p99 << ", \"max\": " << p.max << " }";
+}
+
+static void WriteResults(std::ostream& out, const std::vector<BenchResult>& results) {
+	out << "{\n\t\"frameTiming\": \"cpu\",\n\t\"results\": [\n";
+	for (size_t i = 0; i < results.size(); i++) {
+		const BenchResult& r = results[i];
+		out << "\t\t{ \"scene\": \"" << r.scene << "\", \"objects\": " << r.objects << ", \"frames\": " << r.frames
+			<< ", \"addObjectsPerSecond\": " << r.addObjectsPerSecond << ",\n\t\t  ";
+		WritePercentiles(out, "encodeMs", r.encodeMs);
+		out << ",\n\t\t  ";
+		WritePercentiles(out, "submitMs", r.submitMs);
+		out << ",\n\t\t  ";
+		WritePercentiles(out, "cpuFrameMs", r.cpuFrameMs);
+		out << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "\t]\n}\n";
+}
+
+int main(int argc, const char** argv) {
+	BenchSettings settings;
+	if (!ParseArguments(argc, argv, settings)) {
+		return 1;
+	}
+
+	tinyrender::Options& options = tinyrender::getOptions();
+	options.headless = !settings.window;
+	options.uncapped = true;
+	if (!tinyrender::init("TinyRenderBench", 1280, 720)) {
+		return 1;
+	}
+
+	std::vector<BenchResult> results;
+	for (const std::string& scene : settings.scenes) {
+		for (uint32_t count : settings.counts) {
+			std::cout << "Bench " << scene << " x " << count << std::endl;
+			results.push_back(RunScene(scene, count, settings.frames));
+			const BenchResult& r = results.back();
+			std::cout << "  add " << r.addObjectsPerSecond << " objects/s, cpu frame p50 " << r.cpuFrameMs.p50
+				<< " ms, encode p50 " << r.encodeMs.p50 << " ms" << std::endl;
+		}
+	}
+	tinyrender::terminate();
+
+	std::ofstream file(settings.output);
+	if (!file.is_open()) {
+		std::cerr << "Error: could not write " << settings.output << std::endl;
+		return 1;
+	}
+	WriteResults(file, results);
+	std::cout << "Results written to " << settings.output << std::endl;
+	return 0;
+}
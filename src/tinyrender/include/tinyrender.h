@@ -23,16 +23,34 @@
  * be compatible with both desktop and web applications.
  * 
  * Note: functions marked as internal are not meant to be used outside the renderer. Use at your own risk.
- * Note: the renderer is not meant to be fast or efficient.
+ * Note: the renderer stays simple to use, but is meant to scale to large scenes: most of the features below
+ * are about drawing many objects with few draw calls and little CPU time.
  * 
  * Library is currently very WIP. All of this is inspired by (https://github.com/aparis69/tinyrender), 
  * my previous attempt at doing a tinyrender lib, using OpenGL.
  *
  * Functionalities
  *   -The up direction is (0, 0, 1)
- *   -Internal representation: an object is a triangle mesh, indexed on 16 bits.
+ *   -Internal representation: an object is a triangle mesh, indexed on 16 bits when possible, 32 bits otherwise.
  *   -Scene API: objects can be added, deleted, and modified at runtime. 
- *	  Each object can be translated/rotated/scaled.
+ *	  Each object can be translated/rotated/scaled, individually or in batches, and attached to a parent object.
+ *   -Instancing API: a mesh is uploaded once with addMesh, then drawn many times using addInstance.
+ *	  All instances of a mesh are rendered with a single instanced draw call.
+ *   -Geometry is cached: objects and meshes with identical content (or primitive parameters) share GPU buffers.
+ *   -Geometry memory: vertex and index data are sub-allocated in a few large GPU buffers, compacted when fragmented.
+ *   -GPU-driven rendering (optional): objects are culled in a compute pass that writes indirect draw calls.
+ *   -Headless mode: rendering without window to an offscreen target, frames are read back with renderToImage.
+ *   -Profiler: CPU phases and GPU timestamps are shown in a profiler panel, and can be exported as a Chrome trace.
+ *   -Picking: objects are stored in a BVH, and pick() returns the exact triangle hit under the mouse.
+ *   -Draws are recorded in render bundles, encoded in parallel on a pool of worker threads.
+ *   -Batch API: addObjects packs and uploads many objects at once, using all worker threads.
+ *   -Zero-copy uploads: beginObject/endObject let the caller write vertices directly in a mapped GPU buffer.
+ *   -Quantized vertices (optional, per object): half the vertex memory and bandwidth, for large scanned meshes.
+ *   -Mesh optimization (optional): vertex cache (Tipsify), overdraw and vertex fetch reordering at upload.
+ *   -Levels of detail (optional): simplified meshes are generated at upload and selected from the projected error.
+ *   -Mesh files: loadMesh reads OBJ, PLY and STL files.
+ *   -Shaders: pipelines are created in the background, cached, and rebuilt when a shader file changes.
+ *   -Mesh cache: loaded meshes are saved as GPU ready .trmesh files, memory mapped and uploaded as is on the next runs.
  *
  * Controls
  *	 -Rotation around focus point: left button + move for rotation
@@ -53,6 +71,7 @@
 #include <glfw3webgpu/glfw3webgpu.h>
 #include <glm/glm.hpp>
 
+#include <string>
 #include <vector>
 
 namespace tinyrender {
@@ -66,7 +85,60 @@ namespace tinyrender {
 		std::vector<glm::vec3> vertices;
 		std::vector<glm::vec3> normals;
 		std::vector<glm::vec3> colors;
-		std::vector<uint16_t> triangles;
+		std::vector<uint32_t> triangles;
+
+		// Compact vertex format (12 bytes instead of 24): positions on 16 bits in the bounding box, octahedral normals
+		bool quantized = false;
+	};
+
+	// Interleaved vertex layout of the GPU buffers
+	struct VertexAttributes {
+		glm::vec3 position;
+		glm::vec3 normal;
+	};
+
+	// Object data written in place by the caller between beginObject and endObject.
+	// The memory is the mapped staging buffer itself, it is no longer valid after endObject. It is write-only:
+	// the caller also sets the local bounding box of the vertices. With picking enabled, the memory is a CPU
+	// buffer instead, kept as the picking copy, and the bounds are computed from it.
+	struct ObjectUpload {
+		VertexAttributes* vertices = nullptr;
+		uint32_t* triangles = nullptr;
+		uint32_t vertexCount = 0;
+		uint32_t indexCount = 0;
+		glm::vec3 boundsMin = glm::vec3(0);
+		glm::vec3 boundsMax = glm::vec3(0);
+		uint32_t id = 0; // internal
+	};
+
+	// Result of a picking query
+	struct PickResult {
+		bool hit = false;
+		uint32_t objectId = 0;
+		uint32_t triangle = 0;      // index of the hit triangle in the object descriptor
+		glm::vec3 position = {};    // world space hit point
+		float distance = 0.0f;      // distance from the near plane along the ray
+	};
+
+	// CPU copy of a rendered frame, 8 bits RGBA, rows from top to bottom
+	struct Image {
+		int width = 0, height = 0;
+		std::vector<uint8_t> pixels;
+	};
+
+	// How frames are presented: Fifo waits for vsync, Mailbox and Immediate do not
+	enum class PresentMode {
+		Fifo,
+		Mailbox,
+		Immediate
+	};
+
+	// Statistics of the last rendered frame
+	struct FrameStats {
+		uint32_t visibleObjects = 0;
+		uint32_t culledObjects = 0;
+		float encodeMs = 0.0f; // CPU time to encode the object and mesh draws (or record and replay their bundles)
+		float submitMs = 0.0f; // CPU time spent in queue submit
 	};
 
 	// Public settings struct
@@ -79,6 +151,46 @@ namespace tinyrender {
 
 		// Mouse 
 		float mouseSensitivity = 0.01f;
+
+		// Render offscreen without window, surface or GUI. Must be set before init.
+		bool headless = false;
+
+		// Frame pacing. Unsupported present modes fall back to Fifo.
+		PresentMode presentMode = PresentMode::Fifo;
+		float targetFps = 0.0f; // 0 for no limit other than the present mode
+		bool uncapped = false;  // benchmark mode: no vsync and no frame limit
+		uint32_t framesInFlight = 2; // frames the CPU may record ahead of the GPU. Must be set before init.
+
+		// Rendering
+		bool frustumCulling = true;
+		bool gpuCulling = false; // cull in a compute shader and draw objects with indirect calls
+		// Record draws once and replay them while the scene does not change. Without GPU culling, bundles draw
+		// every object at full detail: CPU frustum culling and levels of detail only apply to draws encoded each frame.
+		bool renderBundles = true;
+		uint32_t threads = 0; // worker threads for bundle encoding, 0 for one per core. Must be set before init.
+
+		// Shaders: with hotReloadShaders, shader files of the resources directory are checked twice a second and pipelines
+		// are rebuilt when one changes (for development). Compiled pipelines are also kept on disk when the backend
+		// supports it (Dawn), empty path for the temporary directory. Must be set before init.
+		bool hotReloadShaders = false;
+		std::string pipelineCachePath;
+
+		// Keep a CPU copy of geometry for picking. Must be set before adding objects.
+		bool picking = false;
+
+		// Reorder triangles and vertices of new geometries for the GPU vertex caches and overdraw.
+		// Slower uploads, the ACMR before and after is printed for each mesh.
+		bool optimizeMeshes = false;
+
+		// Levels of detail: new geometries get simplified versions (quadric error metric), and each object
+		// is drawn with the coarsest one whose error stays under lodErrorPixels on screen. Must be set before adding objects.
+		bool lods = false;
+		float lodErrorPixels = 1.0f;
+
+		// loadMesh keeps the GPU ready geometry of each mesh file in a .trmesh file of meshCachePath (empty path for
+		// the temporary directory), and loads it from there while the mesh file is unchanged
+		bool meshCache = true;
+		std::string meshCachePath;
 	};
 
 	// Windowing
@@ -93,11 +205,60 @@ namespace tinyrender {
 	void terminate();
 	glm::vec2 getMousePosition();
 	Options& getOptions();
+	const FrameStats& getFrameStats();
+
+	// Profiling: CPU phases of the last frames, and GPU passes when timestamp queries are supported.
+	// Exported as Chrome trace JSON (chrome://tracing or ui.perfetto.dev).
+	bool exportChromeTrace(const std::string& path);
+
+	// Offscreen rendering: renders a frame and reads it back, saveImage writes .png or .ppm files
+	Image renderToImage();
+	bool saveImage(const Image& image, const std::string& path);
 
-	// Object management
+	// Picking: closest object under a screen position (in pixels, e.g. from getMousePosition)
+	PickResult pick(const glm::vec2& screenPos);
+
+	// Object management. Ids are stable handles: removing an object does not change other ids, and using the id
+	// of a removed object is reported as an error and ignored. At most 4194303 (2^22 - 1) objects can be alive at
+	// once: past that, adding objects reports an error and returns UINT32_MAX ids.
 	uint32_t addObject(
 		const ObjectDescriptor& objDesc
 	);
+	uint32_t addObject(
+		ObjectDescriptor&& objDesc
+	);
+	uint32_t addObject(
+		const VertexAttributes* vertices, uint32_t vertexCount,
+		const uint32_t* triangles, uint32_t indexCount,
+		const glm::vec3& t = glm::vec3(0), const glm::vec3& r = glm::vec3(0), const glm::vec3& s = glm::vec3(1)
+	);
+	ObjectUpload beginObject(
+		uint32_t vertexCount, uint32_t indexCount
+	);
+	uint32_t endObject(const ObjectUpload& upload,
+		const glm::vec3& t = glm::vec3(0),
+		const glm::vec3& r = glm::vec3(0),
+		const glm::vec3& s = glm::vec3(1)
+	);
+	// Batch creation, writes or returns the id of each object in order. Ids are not consecutive, as they
+	// reuse the ids of removed objects.
+	void addObjects(
+		const ObjectDescriptor* objDescs, uint32_t count, uint32_t* ids
+	);
+	std::vector<uint32_t> addObjects(
+		const std::vector<ObjectDescriptor>& objDescs
+	);
+	// Mesh files: OBJ, PLY (ASCII or binary) and STL (ASCII or binary), memory mapped and parsed in parallel.
+	// The first version adds the mesh as an object and returns its id, or UINT32_MAX on error. It goes through
+	// the .trmesh cache (see Options::meshCache), and also accepts .trmesh files directly.
+	// The second version only parses the file.
+	uint32_t loadMesh(
+		const std::string& path
+	);
+	bool loadMesh(
+		const std::string& path,
+		ObjectDescriptor& objDesc
+	);
 	void removeObject(
 		uint32_t id
 	);
@@ -106,10 +267,52 @@ namespace tinyrender {
 		const glm::vec3& r, 
 		const glm::vec3& s
 	);
+	// Batched updates, t, r and s hold one transform per id. Model matrices are composed at the next frame.
+	void updateObjects(const uint32_t* ids, uint32_t count,
+		const glm::vec3* t,
+		const glm::vec3* r,
+		const glm::vec3* s
+	);
+	void updateObjects(const std::vector<uint32_t>& ids,
+		const std::vector<glm::vec3>& t,
+		const std::vector<glm::vec3>& r,
+		const std::vector<glm::vec3>& s
+	);
+	// Hierarchy: the transform of the object becomes relative to its parent, UINT32_MAX detaches it.
+	// Children of a removed object become roots, with their local transform.
+	void setParent(
+		uint32_t id, uint32_t parentId
+	);
+
+	// Mesh and instance management
+	uint32_t addMesh(
+		const ObjectDescriptor& meshDesc
+	);
+	void removeMesh(
+		uint32_t meshId
+	);
+	uint32_t addInstance(uint32_t meshId,
+		const glm::vec3& t,
+		const glm::vec3& r,
+		const glm::vec3& s
+	);
+	void removeInstance(
+		uint32_t instanceId
+	);
+	void updateInstance(uint32_t instanceId,
+		const glm::vec3& t,
+		const glm::vec3& r,
+		const glm::vec3& s
+	);
 
 	// Primitives
 	uint32_t addSphere(float r, int n);
 	uint32_t addPlane(float size, int n);
 	uint32_t addBox(float r);
 
+	// Primitive meshes, to be used with addInstance
+	uint32_t addSphereMesh(float r, int n);
+	uint32_t addPlaneMesh(float size, int n);
+	uint32_t addBoxMesh(float r);
+
 } // namespace tinyrender
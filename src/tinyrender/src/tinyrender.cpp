@@ -2,6 +2,9 @@
 
 #define WEBGPU_CPP_IMPLEMENTATION
 #include <webgpu/webgpu.hpp>
+#if defined(WEBGPU_BACKEND_WGPU)
+#include <webgpu/wgpu.h>
+#endif
 
 #include <webgpu-utils/webgpu-utils.h>
 
@@ -13,9 +16,39 @@
 #include <imgui/backends/imgui_impl_glfw.h>
 #include <imgui/backends/imgui_impl_wgpu.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TINYRENDER_SSE 1
+#include <xmmintrin.h>
+#endif
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif !defined(__EMSCRIPTEN__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cfloat>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <iterator>
 #include <fstream>
+#include <functional>
 #include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include <unordered_map>
 
 namespace fs = std::filesystem;
@@ -23,14 +56,17 @@ using namespace wgpu;
 using glm::vec2;
 using glm::vec3;
 using glm::vec4;
+using glm::mat3;
 using glm::mat4;
 
 namespace tinyrender {
 
-	struct VertexAttributes {
-		vec3 position;
-		vec3 normal;
+	// Compact vertex format: position in the bounding box of the geometry, octahedral normal
+	struct QuantizedVertex {
+		uint16_t position[4]; // unorm16x4, w is padding
+		int16_t normal[2];    // snorm16x2
 	};
+	static_assert(sizeof(QuantizedVertex) == 12);
 
 	struct ObjectUniforms {
 		mat4 modelMatrix;
@@ -43,36 +79,482 @@ namespace tinyrender {
 	};
 	static_assert(sizeof(SceneUniforms) % 16 == 0);
 
+	// Sub-allocation inside a GPU arena, offset and size are expressed in arena units
+	struct ArenaAllocation {
+		uint32_t block = 0;
+		uint64_t offset = 0;
+		uint64_t size = 0;
+	};
+
+	struct ArenaBlock {
+		Buffer buffer;
+		uint64_t capacity = 0;
+
+		// Free ranges, indexed both ways: by offset for coalescing, by size for best-fit lookups
+		std::map<uint64_t, uint64_t> freeByOffset;
+		std::multimap<uint64_t, uint64_t> freeBySize;
+	};
+
+	// Large GPU buffers shared by all geometries, sub-allocated with a free list
+	struct GpuArena {
+		const char* label;
+		BufferUsage usage;
+		uint64_t unitSize;
+		uint64_t blockUnits;
+		std::vector<ArenaBlock> blocks;
+		uint64_t usedUnits = 0;
+	};
+
+	// Bounding volume hierarchy over a set of boxes. Children of an inner node are stored
+	// next to each other, after their parent, and leaves reference a range of primitives.
+	struct BvhNode {
+		vec3 boundsMin;
+		uint32_t leftFirst; // left child for inner nodes, first primitive for leaves
+		vec3 boundsMax;
+		uint32_t count;     // number of primitives, 0 for inner nodes
+	};
+
+	struct Bvh {
+		std::vector<BvhNode> nodes;
+		std::vector<uint32_t> parents;
+		std::vector<uint32_t> primitives;
+	};
+
+	// GPU geometry, shared between all objects and meshes with the same content
+	// Level of detail: a range of the geometry index allocation, and its object space error
+	struct GeometryLod {
+		uint32_t firstIndex; // relative to the start of the index allocation
+		uint32_t indexCount;
+		float error;
+	};
+
+	// Sum of squared distances to a set of planes, as a symmetric 4x4 matrix
+	struct Quadric {
+		double a00 = 0, a01 = 0, a02 = 0, a11 = 0, a12 = 0, a22 = 0;
+		double b0 = 0, b1 = 0, b2 = 0, c = 0;
+	};
+
+	// Geometries are shared by key. Descriptor keys also hold a second, independent hash of the data and its sizes,
+	// compared on a map key match so that a hash collision never draws another mesh. Primitive and descriptor
+	// keys live in separate halves of the key space.
+	struct GeometryKey {
+		uint64_t hash = 0; // key in the geometry map
+		uint64_t check = 0;
+		uint32_t vertexCount = 0;
+		uint32_t indexCount = 0;
+	};
+
+	static const uint64_t PrimitiveKeyBit = 1ull << 63;
+
+	struct GeometryInternal {
+		ArenaAllocation vertexAlloc; // in vertices
+		ArenaAllocation indexAlloc;  // in 4 bytes units
+		uint32_t drawCount;
+		IndexFormat indexFormat;
+		vec3 boundsMin, boundsMax; // local space bounding box
+		bool quantized = false;    // stored as QuantizedVertex in the quantized vertex arena
+
+		// Levels of detail, lods[0] is the full mesh. Coarser levels follow it in the same index allocation
+		// and share the vertices. lodTriangles holds them until the geometry is packed.
+		std::vector<GeometryLod> lods;
+		std::vector<uint32_t> lodTriangles;
+
+		// CPU copy used for picking, the triangle BVH is built on the first pick
+		std::vector<vec3> positions;
+		std::vector<uint32_t> triangles;
+		std::vector<uint32_t> triangleOrder; // descriptor index of each triangle, when reordered by the mesh optimizer
+		Bvh triangleBvh;
+
+		GeometryKey key;
+		uint32_t refCount = 0;
+	};
+
 	struct ObjectInternal {
-		Buffer vertexBuffer;
-		Buffer indexBuffer;
-		uint16_t drawCount;
+		GeometryInternal* geometry;
+		uint32_t slot; // index of the object transform in the shared object buffer
+	};
+
+	// Objects are stored in a generational slot map. A handle is an index in the sparse array (low bits) and the
+	// generation of that index (high bits), incremented on removal so that stale handles are detected.
+	// Objects themselves are densely packed and swap-removed, so that per-frame loops are linear scans.
+	struct ObjectStorage {
+		std::vector<ObjectInternal> dense;
+		std::vector<uint32_t> denseHandles; // handle of each dense object
+		std::vector<uint32_t> sparse;       // dense position of each index, UINT32_MAX when free
+		std::vector<uint32_t> generations;
+		std::deque<uint32_t> freeIndices;   // oldest first, so that generations of an index wrap as late as possible
+	};
+	static const uint32_t ObjectIndexBits = 22;
+	static const uint32_t ObjectIndexMask = (1u << ObjectIndexBits) - 1;
+	static const uint32_t ObjectGenerationMask = (1u << (32 - ObjectIndexBits)) - 1;
+	static const uint32_t MinFreeObjectIndices = 1024; // freed indices are reused only beyond this count
+
+	// Transforms of all objects, packed in a single storage buffer indexed with firstInstance
+	struct ObjectTransforms {
+		std::vector<ObjectUniforms> uniforms;
+		std::vector<uint32_t> freeSlots;
+		Buffer buffer;
+		uint32_t capacity = 0;
+		BindGroup bindGroup;
+
+		// Range of slots modified since last upload
+		uint32_t dirtyBegin = UINT32_MAX;
+		uint32_t dirtyEnd = 0;
+
+		// World space bounding boxes per slot, as structure of arrays for SIMD culling
+		std::vector<float> centerX, centerY, centerZ;
+		std::vector<float> extentX, extentY, extentZ;
+		std::vector<uint8_t> visible;
+		std::vector<uint32_t> objectIds;
+		std::vector<float> lodScale; // largest scale of the model matrix, to convert geometry errors to world space
+		std::vector<uint8_t> lod;    // level of detail drawn, selected on the CPU
+
+		// Local transforms per slot, as structure of arrays. Model matrices are composed once per frame,
+		// for the slots in pendingSlots and their descendants.
+		std::vector<float> translationX, translationY, translationZ;
+		std::vector<float> rotationX, rotationY, rotationZ; // degrees
+		std::vector<float> scaleX, scaleY, scaleZ;
+		std::vector<mat4> local; // matrix of the local transform, only recomputed when it changes
+		std::vector<mat4> world; // model matrix without the geometry dequantization, children are relative to it
+		std::vector<const GeometryInternal*> geometries;
+		std::vector<uint8_t> pending; // PendingFlags
+		std::vector<uint32_t> pendingSlots;
+
+		// Hierarchy, as slots. Children of a slot are a linked list, depth is 0 for roots.
+		std::vector<uint32_t> parent, firstChild, nextSibling;
+		std::vector<uint32_t> depth;
+	};
+
+	enum PendingFlags : uint8_t {
+		PendingWorld = 1, // the parent moved or changed
+		PendingLocal = 2  // the local transform changed
+	};
+
+	// BVH over the world bounds of all objects. It is rebuilt when objects are added or removed,
+	// and refitted when objects only move.
+	struct SceneBvh {
+		Bvh bvh;
+		std::vector<uint32_t> slotLeaf;
+		std::vector<uint32_t> refitSlots;
+		bool needsRebuild = true;
+	};
+
+	// Object read by the culling compute shader: its geometry has lodCount consecutive draws, from the finest LOD
+	struct GpuDrawCommand {
+		uint32_t slot;
+		uint32_t firstDraw;
+		uint32_t lodCount;
+		uint32_t padding;
+	};
+
+	// Same layout as drawIndexedIndirect arguments
+	struct GpuIndirectDraw {
+		uint32_t indexCount;
+		uint32_t instanceCount;
+		uint32_t firstIndex;
+		int32_t baseVertex;
+		uint32_t firstInstance; // start of the range of the draw in the instance list
+	};
+
+	// Contiguous range of draws with the same vertex and index buffers
+	struct GpuDrawGroup {
+		const GeometryInternal* geometry;
+		uint32_t first;
+		uint32_t count;
+	};
 
-		ObjectUniforms uniforms;
+	struct CullUniforms {
+		vec4 planes[6];
+		vec4 eye;
+		uint32_t commandCount;
+		float lodScale; // 0 disables LOD selection
+		uint32_t padding[2];
+	};
+	static_assert(sizeof(CullUniforms) % 16 == 0);
+
+	// GPU-driven path: a compute pass culls every object and appends the visible ones to the instance list of the
+	// draw of their geometry and LOD. The CPU records one instanced indirect draw per geometry and LOD.
+	struct GpuCulling {
+		bool supported = false;
+		CullUniforms uploadedUniforms = {};
+		bool multiDrawIndirect = false;
+		ComputePipeline pipeline;
+		PipelineLayout pipelineLayout;
+		BindGroupLayout bindGroupLayout;
+		BindGroup bindGroup;
 		Buffer uniformBuffer;
+		Buffer boundsBuffer;   // world space center and extent per object slot
+		uint32_t boundsCapacity = 0;
+		Buffer commandBuffer;
+		uint32_t commandCapacity = 0;
+		std::vector<GpuDrawCommand> commands;
+		Buffer indirectBuffer; // draws of the frame, reset from drawTemplateBuffer before the cull pass
+		Buffer drawTemplateBuffer;
+		Buffer lodBuffer;      // LOD error of each draw
+		uint32_t drawCapacity = 0;
+		std::vector<GpuIndirectDraw> draws;
+		std::vector<float> lodErrors;
+		std::vector<GpuDrawGroup> groups;
+		Buffer instanceBuffer; // object slot of each instance of each draw
+		uint32_t instanceCapacity = 0;
+		bool commandsDirty = true;
+
+		// Object pipelines reading the object slot from the instance list, bound at group 2
+		RenderPipeline renderPipelines[2]; // float and quantized vertices, owned by the pipeline cache
+		BindGroupLayout instanceBindGroupLayout;
+		PipelineLayout drawPipelineLayout;
+		BindGroup instanceBindGroup;
+	};
+
+	struct MeshInternal {
+		GeometryInternal* geometry;
+
+		// Instance data is densely packed: instance i of the draw reads element i of the storage buffer
+		std::vector<ObjectUniforms> instances;
+		std::vector<uint32_t> instanceIds;
+		Buffer instanceBuffer;
+		uint32_t instanceCapacity = 0;
 		BindGroup bindGroup;
+		bool dirty = false;
+	};
+
+	// Recorded object and mesh draws, invalidated when the draw list or the bound resources change
+	struct DrawBundle {
+		std::vector<RenderBundle> bundles; // object draws split in chunks encoded in parallel, then mesh draws
+		bool dirty = true;
+		bool gpuCulling = false;
+	};
+
+	struct InstanceInternal {
+		uint32_t meshId;
+		uint32_t index;
+	};
+
+	// Upload memory of one frame in flight. The buffer is mapped while the CPU fills it, then unmapped and
+	// copied from by the frame's encoder, and mapped again once the GPU is done with the frame.
+	struct StagingFrame {
+		Buffer buffer;
+		uint64_t capacity = 0;
+		uint64_t offset = 0;
+		uint64_t requested = 0; // bytes asked for in the last use, including overflowing uploads
+		uint8_t* mapped = nullptr;
+		bool ready = false;     // mapped and not used by the GPU
+	};
+
+	struct StagingRing {
+		std::vector<StagingFrame> frames;
+		uint32_t current = 0;
+		CommandEncoder encoder;
+		bool recording = false;
+	};
+
+	// Staging buffer mapped at creation: geometry data is written in place, then copied to the arenas on the GPU
+	struct MappedUpload {
+		Buffer buffer;
+		void* vertexData = nullptr;   // VertexAttributes or QuantizedVertex
+		uint32_t* indexData = nullptr;
+		uint64_t vertexCount = 0;
+		uint64_t vertexStride = 0;
+		uint64_t indexCapacity = 0;   // in 4 bytes units
+
+		// Written by the caller of beginObject instead of the mapping when a picking copy is kept,
+		// so that the mapped memory is only ever written
+		std::vector<VertexAttributes> vertices;
+		std::vector<uint32_t> triangles;
+	};
+
+	// Persistent worker threads, the calling thread also takes part in parallel loops
+	struct WorkerPool {
+		std::vector<std::thread> threads;
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::condition_variable done;
+		const std::function<void(uint32_t)>* task = nullptr; // owned by the caller of _internalParallelFor
+		uint32_t taskCount = 0;
+		uint32_t nextTask = 0;
+		uint32_t remainingTasks = 0;
+		uint32_t activeWorkers = 0;
+		uint64_t generation = 0;
+		bool quit = false;
+	};
+
+	// Pipelines that can be rebuilt at runtime. The renderer draws with the current pipeline of each slot,
+	// a new one replaces it once created.
+	enum PipelineId : uint32_t {
+		PipelineRender,
+		PipelineQuantized,
+		PipelineCulling,
+		PipelineRenderCulled,
+		PipelineQuantizedCulled,
+		PipelineCount
+	};
+	static const char* PipelineShaders[PipelineCount] = { "simple.wgsl", "simple_quantized.wgsl", "cull.wgsl", "simple.wgsl", "simple_quantized.wgsl" };
+
+	// State that is not in the shader source, hashed with it to get the pipeline key
+	struct PipelineState {
+		uint32_t id;
+		WGPUTextureFormat colorFormat;
+		WGPUTextureFormat depthFormat;
+	};
+
+	struct PipelineSlot {
+		uint64_t key = 0;         // of the current pipeline, 0 until the first one is created
+		uint64_t pendingKey = 0;  // of the pipeline being created
+		bool requestAgain = false; // the shader changed while a pipeline was being created
+	};
+
+	// Shader loaded from the resources directory. The module is rebuilt only when the source changes.
+	struct CachedShader {
+		fs::file_time_type writeTime;
+		uint64_t hash = 0;
+		ShaderModule module;
+	};
+
+	// Pipelines by hash of shader source and state: switching back to a previous version of a shader is free
+	struct PipelineCache {
+		std::unordered_map<std::string, CachedShader> shaders;
+		std::unordered_map<uint64_t, RenderPipeline> renderPipelines;
+		std::unordered_map<uint64_t, ComputePipeline> computePipelines;
+		PipelineSlot slots[PipelineCount];
+		uint32_t pendingCount = 0;
+		std::chrono::steady_clock::time_point lastWatch;
+
+		// Backend pipeline data persisted on disk, Dawn only
+		fs::path directory;
+		std::string isolationKey;
+		std::mutex diskMutex;
+	};
+
+	struct OffscreenTarget {
+		Texture colorTexture;
+		TextureView colorView;
+		Buffer readbackBuffer;
+		uint32_t width = 0, height = 0;
+		uint32_t bytesPerRow = 0;
+	};
+
+	using Clock = std::chrono::steady_clock;
+
+	// Profiled phases of a frame, the last ones are measured on the GPU with timestamp queries
+	enum ProfilePhase : uint32_t {
+		ProfileEvents,
+		ProfileAcquire,
+		ProfileUpload,
+		ProfileCulling,
+		ProfileEncoding,
+		ProfileGui,
+		ProfileSubmit,
+		ProfilePresent,
+		ProfilePacing,
+		ProfileGpuCulling,
+		ProfileGpuRender,
+		ProfilePhaseCount
+	};
+	static const char* ProfilePhaseNames[ProfilePhaseCount] = {
+		"Events", "Acquire", "Upload", "Culling", "Encoding", "ImGui", "Submit", "Present", "Pacing", "GPU culling", "GPU render"
+	};
+
+	struct ProfileEvent {
+		ProfilePhase phase;
+		double startUs;    // since profiler start
+		double durationUs;
+	};
+
+	struct ProfileFrame {
+		uint64_t number = 0;
+		std::vector<ProfileEvent> events;
+		double totalUs[ProfilePhaseCount] = {};
+	};
+
+	// Staging buffer receiving the resolved timestamps of one frame, mapped asynchronously
+	struct GpuTimestampReadback {
+		Buffer buffer;
+		bool busy = false;
+		bool hasCulling = false;
+		uint64_t frame = 0;
+		double submitUs = 0.0;
+	};
+
+	struct Profiler {
+		Clock::time_point origin = Clock::now();
+		ProfileFrame current;
+		std::deque<ProfileFrame> history; // last HistorySize frames, oldest first
+		uint64_t frameNumber = 0;
+		bool rendered = false; // the current frame was rendered, and is ended by swap() or the next frame
+
+		// GPU timestamps: render pass begin/end, then culling pass begin/end
+		bool timestamps = false;
+		QuerySet querySet;
+		Buffer resolveBuffer;
+		GpuTimestampReadback readbacks[3];
+		bool cullingWritten = false;
 	};
 
 	struct Scene {
-		GLFWwindow* window;
+		GLFWwindow* window = nullptr;
 		int width, height;
 		Device device;
 		Queue queue;
 		Surface surface;
-		RenderPipeline renderPipeline;
+		SurfaceConfiguration surfaceConfig;
+		std::vector<WGPUPresentMode> supportedPresentModes;
+		WGPUPresentMode configuredPresentMode = WGPUPresentMode_Fifo;
+		Clock::time_point frameDeadline;
+		OffscreenTarget offscreen;
+		RenderPipeline renderPipeline;    // current pipelines, owned by the pipeline cache
+		RenderPipeline quantizedPipeline;
+		uint32_t geometryCounts[2] = {};  // float and quantized geometries: a pipeline is only needed when used
+		PipelineLayout pipelineLayout;
+		PipelineCache pipelineCache;
 		Options options;
 
 		glm::vec2 mouseLastPosition = glm::vec2(0);
 		int currentMouseButton = -1;
 
 		SceneUniforms uniforms;
+		SceneUniforms uploadedUniforms;
+		bool uniformsUploaded = false;
 		Buffer uniformBuffer;
 		BindGroup bindGroup;
 		std::vector<BindGroupLayout> bindGroupLayouts;
+
+		ObjectTransforms objectTransforms;
+		SceneBvh sceneBvh;
+		GpuCulling gpuCulling;
+		DrawBundle drawBundle;
+		FrameStats stats;
+		Profiler profiler;
+		bool showProfiler = false;
+
+		SupportedLimits limits;
+		GpuArena vertexArena;
+		GpuArena quantizedVertexArena;
+		GpuArena indexArena;
+		std::vector<Buffer> pendingDestroyBuffers; // destroyed after the next submit
+		StagingRing staging;
+		WorkerPool workers;
+		std::unordered_map<uint32_t, MappedUpload> pendingUploads; // started by beginObject, finished by endObject
+		uint32_t nextUploadId = 0;
+		uint64_t nextUploadKey = 0;
+		bool threadSafeEncoding = false; // the backend allows encoding bundles from several threads
+	};
+
+	// Currently bound arena blocks, to skip redundant buffer bindings between draws
+	struct GeometryBindings {
+		bool quantized = false; // the draws start with the float pipeline
+		bool gpuCulled = false; // object slots are read from the instance list of the GPU culling
+		uint32_t vertexBlock = UINT32_MAX;
+		uint32_t indexBlock = UINT32_MAX;
+		IndexFormat indexFormat = IndexFormat::Undefined;
 	};
 
 	static Scene scene;
-	static std::unordered_map<uint32_t, ObjectInternal> objects;
+	static std::unordered_map<uint64_t, GeometryInternal> geometries;
+	static ObjectStorage objects;
+	static std::unordered_map<uint32_t, MeshInternal> meshes;
+	static std::unordered_map<uint32_t, InstanceInternal> instances;
+	static uint32_t nextMeshId = 0;
+	static uint32_t nextInstanceId = 0;
 	static Texture depthTexture;
 	static TextureView depthTextureView;
 
@@ -84,6 +566,16 @@ namespace tinyrender {
 		return ret;
 	}
 
+	// Maps quantized positions in [0, 1] to the local bounding box. Flat axes keep a unit scale to stay invertible.
+	static mat4 _internalDequantizeMatrix(const GeometryInternal& geometry) {
+		if (!geometry.quantized) {
+			return mat4(1.0f);
+		}
+		const vec3 extent = geometry.boundsMax - geometry.boundsMin;
+		const vec3 scale = glm::mix(extent, vec3(1.0f), glm::equal(extent, vec3(0.0f)));
+		return glm::scale(glm::translate(mat4(1.0f), geometry.boundsMin), scale);
+	}
+
 	static void _internalApplyCameraMove(float x, float y, float z) {
 		if (x != 0.0f) {
 			Options& opt = scene.options;
@@ -115,6 +607,58 @@ namespace tinyrender {
 		}
 	}
 
+	// Present mode requested by the options, falling back to Fifo which is always supported
+	static WGPUPresentMode _internalRequestedPresentMode() {
+		std::vector<WGPUPresentMode> candidates;
+		if (scene.options.uncapped) {
+			candidates = { WGPUPresentMode_Immediate, WGPUPresentMode_Mailbox };
+		}
+		else if (scene.options.presentMode == PresentMode::Mailbox) {
+			candidates = { WGPUPresentMode_Mailbox };
+		}
+		else if (scene.options.presentMode == PresentMode::Immediate) {
+			candidates = { WGPUPresentMode_Immediate, WGPUPresentMode_Mailbox };
+		}
+		const auto& supported = scene.supportedPresentModes;
+		for (WGPUPresentMode mode : candidates) {
+			if (std::find(supported.begin(), supported.end(), mode) != supported.end()) {
+				return mode;
+			}
+		}
+		return WGPUPresentMode_Fifo;
+	}
+
+	static void _internalConfigureSurface() {
+		scene.configuredPresentMode = _internalRequestedPresentMode();
+		scene.surfaceConfig.presentMode = scene.configuredPresentMode;
+		scene.surface.configure(scene.surfaceConfig);
+	}
+
+	// Waits until the next frame deadline when a target frame rate is set. The OS sleep is only
+	// accurate to a millisecond or so, the end of the wait is spent spinning.
+	static void _internalPaceFrame() {
+		if (scene.options.uncapped || scene.options.targetFps <= 0.0f) {
+			scene.frameDeadline = Clock::time_point();
+			return;
+		}
+		const auto frameTime = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / scene.options.targetFps));
+		const auto now = Clock::now();
+		if (scene.frameDeadline == Clock::time_point() || now - scene.frameDeadline > frameTime) {
+			// First paced frame, or too late: restart from now instead of trying to catch up
+			scene.frameDeadline = now + frameTime;
+			return;
+		}
+
+		const auto spinTime = std::chrono::milliseconds(2);
+		if (scene.frameDeadline - now > spinTime) {
+			std::this_thread::sleep_for(scene.frameDeadline - now - spinTime);
+		}
+		while (Clock::now() < scene.frameDeadline) {
+			std::this_thread::yield();
+		}
+		scene.frameDeadline += frameTime;
+	}
+
 	static TextureView _internalNextSurfaceTextureView() {
 		SurfaceTexture surfaceTexture;
 		scene.surface.getCurrentTexture(&surfaceTexture);
@@ -143,34 +687,40 @@ namespace tinyrender {
 		SupportedLimits supportedLimits;
 		adapter.getLimits(&supportedLimits);
 
+		// Request everything the adapter supports: large meshes need big vertex, index and storage buffers,
+		// and requesting a limit never costs more than the adapter is able to provide.
 		RequiredLimits requiredLimits = Default;
-		requiredLimits.limits.maxVertexAttributes = 3;
-		requiredLimits.limits.maxVertexBuffers = 1;
-		requiredLimits.limits.maxBufferSize = 2000 * (sizeof(VertexAttributes));
-		requiredLimits.limits.maxVertexBufferArrayStride = sizeof(VertexAttributes);
-		requiredLimits.limits.minStorageBufferOffsetAlignment = supportedLimits.limits.minStorageBufferOffsetAlignment;
-		requiredLimits.limits.minUniformBufferOffsetAlignment = supportedLimits.limits.minUniformBufferOffsetAlignment;
-		requiredLimits.limits.maxInterStageShaderComponents = 6;
-		requiredLimits.limits.maxBindGroups = 2;
-		requiredLimits.limits.maxUniformBuffersPerShaderStage = 1;
-		requiredLimits.limits.maxUniformBufferBindingSize = 64 * 4 * sizeof(float);
-		requiredLimits.limits.maxTextureDimension1D = 4000;
-		requiredLimits.limits.maxTextureDimension2D = 4000;
-		requiredLimits.limits.maxTextureArrayLayers = 1;
+		requiredLimits.limits = supportedLimits.limits;
 
 		return requiredLimits;
 	}
 
-	static ShaderModule _internalLoadShaderModule(const fs::path& path, Device device) {
-		std::ifstream file(path);
+	static uint64_t _internalHashBytes(uint64_t hash, const void* data, size_t size);
+	static void _internalPollDevice(bool wait);
+	static void _internalRequestPipeline(PipelineId id);
+
+	// Loads a shader the first time it is used, and again when its file was modified.
+	// The module is only rebuilt when the source actually changed.
+	static const CachedShader& _internalAcquireShader(const char* name) {
+		CachedShader& shader = scene.pipelineCache.shaders[name];
+		const fs::path path = fs::path(RESOURCES_DIR) / name;
+		std::error_code error;
+		const fs::file_time_type writeTime = fs::last_write_time(path, error);
+		if (shader.module && (error || writeTime == shader.writeTime)) {
+			return shader;
+		}
+		shader.writeTime = writeTime;
+
+		std::ifstream file(path, std::ios::binary);
 		if (!file.is_open()) {
-			return nullptr;
+			std::cerr << "Error: could not open shader " << path.string() << std::endl;
+			return shader;
+		}
+		const std::string shaderSource((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		const uint64_t hash = _internalHashBytes(0xcbf29ce484222325ull, shaderSource.data(), shaderSource.size());
+		if (shader.module && hash == shader.hash) {
+			return shader;
 		}
-		file.seekg(0, std::ios::end);
-		size_t size = file.tellg();
-		std::string shaderSource(size, ' ');
-		file.seekg(0);
-		file.read(shaderSource.data(), size);
 
 		ShaderModuleWGSLDescriptor shaderCodeDesc;
 		shaderCodeDesc.chain.next = nullptr;
@@ -178,16 +728,177 @@ namespace tinyrender {
 		shaderCodeDesc.code = shaderSource.c_str();
 		ShaderModuleDescriptor shaderDesc;
 		shaderDesc.nextInChain = &shaderCodeDesc.chain;
+		shaderDesc.label = name;
+		if (shader.module) {
+			shader.module.release();
+			std::cout << "Shader reloaded: " << name << std::endl;
+		}
+		shader.module = scene.device.createShaderModule(shaderDesc);
+		shader.hash = hash;
+		return shader;
+	}
 
-		return device.createShaderModule(shaderDesc);
+#if defined(WEBGPU_BACKEND_DAWN)
+	// Dawn blob cache, persisted as one file per entry. Files start with the full key, to detect hash collisions.
+	static fs::path _internalPipelineDataPath(const void* key, size_t keySize) {
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)_internalHashBytes(0xcbf29ce484222325ull, key, keySize));
+		return scene.pipelineCache.directory / name;
 	}
 
-	static void _internalSetupRenderPipeline() {
-		// Load shader module
-		ShaderModule shaderModule = _internalLoadShaderModule(
-			RESOURCES_DIR + std::string("/simple.wgsl"),
-			scene.device
-		);
+	// Returns the size of the value, and copies it when value is not null
+	static size_t _internalLoadPipelineData(const void* key, size_t keySize, void* value, size_t valueSize, void* /*userdata*/) {
+		std::lock_guard<std::mutex> lock(scene.pipelineCache.diskMutex);
+		std::ifstream file(_internalPipelineDataPath(key, keySize), std::ios::binary);
+		const std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		uint64_t storedKeySize = 0;
+		if (data.size() < sizeof(uint64_t)) {
+			return 0;
+		}
+		memcpy(&storedKeySize, data.data(), sizeof(uint64_t));
+		if (storedKeySize != keySize || data.size() < sizeof(uint64_t) + keySize || memcmp(data.data() + sizeof(uint64_t), key, keySize) != 0) {
+			return 0;
+		}
+		const size_t storedSize = data.size() - sizeof(uint64_t) - keySize;
+		if (!value) {
+			return storedSize;
+		}
+		const size_t size = std::min(storedSize, valueSize);
+		memcpy(value, data.data() + sizeof(uint64_t) + keySize, size);
+		return size;
+	}
+
+	static void _internalStorePipelineData(const void* key, size_t keySize, const void* value, size_t valueSize, void* /*userdata*/) {
+		std::lock_guard<std::mutex> lock(scene.pipelineCache.diskMutex);
+		const fs::path path = _internalPipelineDataPath(key, keySize);
+		fs::path tempPath = path;
+		tempPath += ".tmp";
+		{
+			std::ofstream file(tempPath, std::ios::binary);
+			const uint64_t storedKeySize = keySize;
+			file.write(reinterpret_cast<const char*>(&storedKeySize), sizeof(uint64_t));
+			file.write(static_cast<const char*>(key), keySize);
+			file.write(static_cast<const char*>(value), valueSize);
+			if (!file.good()) {
+				return;
+			}
+		}
+		std::error_code error;
+		fs::rename(tempPath, path, error);
+	}
+#endif
+
+	// Makes a cached pipeline the current one of its slot. Recorded bundles still reference the previous one.
+	static void _internalUsePipeline(PipelineId id, uint64_t key) {
+		PipelineCache& cache = scene.pipelineCache;
+		cache.slots[id].key = key;
+		if (id == PipelineCulling) {
+			scene.gpuCulling.pipeline = cache.computePipelines[key];
+		}
+		else if (id == PipelineRenderCulled || id == PipelineQuantizedCulled) {
+			scene.gpuCulling.renderPipelines[id == PipelineQuantizedCulled] = cache.renderPipelines[key];
+		}
+		else {
+			(id == PipelineRender ? scene.renderPipeline : scene.quantizedPipeline) = cache.renderPipelines[key];
+		}
+		scene.drawBundle.dirty = true;
+	}
+
+	// End of a pipeline creation: on failure, the slot keeps its current pipeline
+	static void _internalPipelineCreated(PipelineId id, bool success, const char* message) {
+		PipelineSlot& slot = scene.pipelineCache.slots[id];
+		const uint64_t key = slot.pendingKey;
+		slot.pendingKey = 0;
+		scene.pipelineCache.pendingCount--;
+		if (success) {
+			_internalUsePipeline(id, key);
+		}
+		else {
+			std::cerr << "Error: could not create pipeline from " << PipelineShaders[id] << (message ? std::string(": ") + message : std::string()) << std::endl;
+		}
+		if (slot.requestAgain) {
+			slot.requestAgain = false;
+			_internalRequestPipeline(id);
+		}
+	}
+
+	static void _internalOnRenderPipelineCreated(WGPUCreatePipelineAsyncStatus status, WGPURenderPipeline pipeline, char const* message, void* userdata) {
+		const PipelineId id = PipelineId(reinterpret_cast<uintptr_t>(userdata));
+		const bool success = status == WGPUCreatePipelineAsyncStatus_Success;
+		if (success) {
+			scene.pipelineCache.renderPipelines[scene.pipelineCache.slots[id].pendingKey] = pipeline;
+		}
+		_internalPipelineCreated(id, success, message);
+	}
+
+	static void _internalOnComputePipelineCreated(WGPUCreatePipelineAsyncStatus status, WGPUComputePipeline pipeline, char const* message, void* userdata) {
+		const PipelineId id = PipelineId(reinterpret_cast<uintptr_t>(userdata));
+		const bool success = status == WGPUCreatePipelineAsyncStatus_Success;
+		if (success) {
+			scene.pipelineCache.computePipelines[scene.pipelineCache.slots[id].pendingKey] = pipeline;
+		}
+		_internalPipelineCreated(id, success, message);
+	}
+
+#if defined(WEBGPU_BACKEND_WGPU)
+	// wgpu-native does not implement async pipeline creation. Pipelines are created synchronously, and validation
+	// errors (including shader compilation) are caught with an error scope, popped before wgpu-native returns.
+	static bool _internalPopErrorScope(std::string& message) {
+		struct ScopeResult {
+			bool error = false;
+			std::string message;
+		} result;
+		wgpuDevicePopErrorScope(scene.device, [](WGPUErrorType type, char const* message, void* userdata) {
+			ScopeResult& result = *static_cast<ScopeResult*>(userdata);
+			result.error = type != WGPUErrorType_NoError;
+			result.message = message ? message : "";
+		}, &result);
+		message = result.message;
+		return !result.error;
+	}
+#endif
+
+	static void _internalCreateRenderPipeline(PipelineId id, const RenderPipelineDescriptor& pipelineDesc) {
+		void* userdata = reinterpret_cast<void*>(uintptr_t(id));
+#if defined(WEBGPU_BACKEND_WGPU)
+		scene.device.pushErrorScope(ErrorFilter::Validation);
+		RenderPipeline pipeline = scene.device.createRenderPipeline(pipelineDesc);
+		std::string message;
+		if (_internalPopErrorScope(message)) {
+			_internalOnRenderPipelineCreated(WGPUCreatePipelineAsyncStatus_Success, pipeline, nullptr, userdata);
+		}
+		else {
+			pipeline.release();
+			_internalOnRenderPipelineCreated(WGPUCreatePipelineAsyncStatus_ValidationError, nullptr, message.c_str(), userdata);
+		}
+#else
+		wgpuDeviceCreateRenderPipelineAsync(scene.device, &pipelineDesc, _internalOnRenderPipelineCreated, userdata);
+#endif
+	}
+
+	static void _internalCreateComputePipeline(PipelineId id, const ComputePipelineDescriptor& pipelineDesc) {
+		void* userdata = reinterpret_cast<void*>(uintptr_t(id));
+#if defined(WEBGPU_BACKEND_WGPU)
+		scene.device.pushErrorScope(ErrorFilter::Validation);
+		ComputePipeline pipeline = scene.device.createComputePipeline(pipelineDesc);
+		std::string message;
+		if (_internalPopErrorScope(message)) {
+			_internalOnComputePipelineCreated(WGPUCreatePipelineAsyncStatus_Success, pipeline, nullptr, userdata);
+		}
+		else {
+			pipeline.release();
+			_internalOnComputePipelineCreated(WGPUCreatePipelineAsyncStatus_ValidationError, nullptr, message.c_str(), userdata);
+		}
+#else
+		wgpuDeviceCreateComputePipelineAsync(scene.device, &pipelineDesc, _internalOnComputePipelineCreated, userdata);
+#endif
+	}
+
+	// Object pipelines: interleaved float vertices, or the compact vertex format. Bind groups are shared.
+	// The variants for GPU culling draws also bind the instance list.
+	static void _internalCreateObjectPipeline(PipelineId id, ShaderModule shaderModule) {
+		const bool quantized = id == PipelineQuantized || id == PipelineQuantizedCulled;
+		const bool gpuCulled = id == PipelineRenderCulled || id == PipelineQuantizedCulled;
 
 		// Configure the vertex buffer layout
 		VertexBufferLayout vertexBufferLayout;
@@ -195,27 +906,29 @@ namespace tinyrender {
 
 		// Position attribute
 		attributes[0].shaderLocation = 0;
-		attributes[0].format = VertexFormat::Float32x3;
+		attributes[0].format = quantized ? VertexFormat::Unorm16x4 : VertexFormat::Float32x3;
 		attributes[0].offset = 0;
 
 		// Normal attribute
 		attributes[1].shaderLocation = 1;
-		attributes[1].format = VertexFormat::Float32x3;
-		attributes[1].offset = sizeof(vec3); // offset of normal
+		attributes[1].format = quantized ? VertexFormat::Snorm16x2 : VertexFormat::Float32x3;
+		attributes[1].offset = quantized ? offsetof(QuantizedVertex, normal) : sizeof(vec3); // offset of normal
 
 		vertexBufferLayout.attributeCount = 2;
 		vertexBufferLayout.attributes = attributes.data();
-		vertexBufferLayout.arrayStride = sizeof(VertexAttributes);
+		vertexBufferLayout.arrayStride = quantized ? sizeof(QuantizedVertex) : sizeof(VertexAttributes);
 		vertexBufferLayout.stepMode = VertexStepMode::Vertex;
 
 		// Create the render pipeline desc
 		RenderPipelineDescriptor pipelineDesc;
+		pipelineDesc.label = gpuCulled ? (quantized ? "Quantized culled object pipeline" : "Culled object pipeline") :
+			(quantized ? "Quantized object pipeline" : "Object pipeline");
 
 		// Vertex state
 		pipelineDesc.vertex.bufferCount = 1;
 		pipelineDesc.vertex.buffers = &vertexBufferLayout;
 		pipelineDesc.vertex.module = shaderModule;
-		pipelineDesc.vertex.entryPoint = "vs_main";
+		pipelineDesc.vertex.entryPoint = gpuCulled ? "vs_culled" : "vs_main";
 		pipelineDesc.vertex.constantCount = 0;
 		pipelineDesc.vertex.constants = nullptr;
 
@@ -264,6 +977,76 @@ namespace tinyrender {
 		pipelineDesc.multisample.mask = ~0u;
 		pipelineDesc.multisample.alphaToCoverageEnabled = false;
 
+		pipelineDesc.layout = gpuCulled ? scene.gpuCulling.drawPipelineLayout : scene.pipelineLayout;
+		_internalCreateRenderPipeline(id, pipelineDesc);
+	}
+
+	static void _internalCreateCullingPipeline(ShaderModule shaderModule) {
+		ComputePipelineDescriptor pipelineDesc{};
+		pipelineDesc.label = "Cull pipeline";
+		pipelineDesc.layout = scene.gpuCulling.pipelineLayout;
+		pipelineDesc.compute.module = shaderModule;
+		pipelineDesc.compute.entryPoint = "cs_main";
+		pipelineDesc.compute.constantCount = 0;
+		pipelineDesc.compute.constants = nullptr;
+		_internalCreateComputePipeline(PipelineCulling, pipelineDesc);
+	}
+
+	// Creates the pipeline of a slot for the current source of its shader, unless it is cached or already current.
+	// Only one creation per slot is in flight, a request during it is replayed when it ends.
+	static void _internalRequestPipeline(PipelineId id) {
+		PipelineCache& cache = scene.pipelineCache;
+		PipelineSlot& slot = cache.slots[id];
+		if (slot.pendingKey != 0) {
+			slot.requestAgain = true;
+			return;
+		}
+		const CachedShader& shader = _internalAcquireShader(PipelineShaders[id]);
+		if (!shader.module) {
+			return;
+		}
+		const PipelineState state = { id, TextureFormat::BGRA8Unorm, TextureFormat::Depth24Plus };
+		const uint64_t key = _internalHashBytes(shader.hash, &state, sizeof(state));
+		if (key == slot.key) {
+			return;
+		}
+		const bool cached = id == PipelineCulling ? cache.computePipelines.count(key) > 0 : cache.renderPipelines.count(key) > 0;
+		if (cached) {
+			_internalUsePipeline(id, key);
+			return;
+		}
+		slot.pendingKey = key;
+		cache.pendingCount++;
+		if (id == PipelineCulling) {
+			_internalCreateCullingPipeline(shader.module);
+		}
+		else {
+			_internalCreateObjectPipeline(id, shader.module);
+		}
+	}
+
+	// Hot reload: shader files are checked a few times per second, and only the pipelines using a modified one are rebuilt
+	static void _internalWatchShaders() {
+		PipelineCache& cache = scene.pipelineCache;
+		const Clock::time_point now = Clock::now();
+		if (!scene.options.hotReloadShaders || now - cache.lastWatch < std::chrono::milliseconds(500)) {
+			return;
+		}
+		cache.lastWatch = now;
+		for (uint32_t id = 0; id < PipelineCount; id++) {
+			if (id < PipelineCulling || scene.gpuCulling.supported) {
+				_internalRequestPipeline(PipelineId(id));
+			}
+		}
+	}
+
+	static void _internalWaitForPipelines() {
+		while (scene.pipelineCache.pendingCount > 0) {
+			_internalPollDevice(true);
+		}
+	}
+
+	static void _internalSetupRenderPipeline() {
 		// Layout 
 		scene.bindGroupLayouts = {};
 		BindGroupLayoutDescriptor bindGroupLayoutDesc{};
@@ -277,23 +1060,41 @@ namespace tinyrender {
 		bindGroupLayoutDesc.entries = &bindingLayout;
 		scene.bindGroupLayouts.push_back(scene.device.createBindGroupLayout(bindGroupLayoutDesc));
 
+		// Per-object data is a storage buffer indexed by instance, so that instanced meshes share the layout
 		bindingLayout.binding = 0;
 		bindingLayout.visibility = ShaderStage::Vertex | ShaderStage::Fragment;
-		bindingLayout.buffer.type = BufferBindingType::Uniform;
+		bindingLayout.buffer.type = BufferBindingType::ReadOnlyStorage;
 		bindingLayout.buffer.minBindingSize = sizeof(ObjectUniforms);
 		bindGroupLayoutDesc.entryCount = 1;
 		bindGroupLayoutDesc.entries = &bindingLayout;
 		scene.bindGroupLayouts.push_back(scene.device.createBindGroupLayout(bindGroupLayoutDesc));
 
-		// Actually create the pipeline
 		PipelineLayoutDescriptor layoutDesc{};
 		layoutDesc.bindGroupLayoutCount = scene.bindGroupLayouts.size();
 		layoutDesc.bindGroupLayouts = (WGPUBindGroupLayout*)scene.bindGroupLayouts.data();
-		pipelineDesc.layout = scene.device.createPipelineLayout(layoutDesc);
-		scene.renderPipeline = scene.device.createRenderPipeline(pipelineDesc);
+		scene.pipelineLayout = scene.device.createPipelineLayout(layoutDesc);
+
+		// Pipelines are created in the background where the backend allows it, frames are drawn without objects until then
+		_internalRequestPipeline(PipelineRender);
+		_internalRequestPipeline(PipelineQuantized);
+	}
 
-		// Release shader module, no need anymore
-		shaderModule.release();
+	static void _internalDestroyPipelines() {
+		_internalWaitForPipelines();
+		PipelineCache& cache = scene.pipelineCache;
+		for (auto& it : cache.renderPipelines) {
+			it.second.release();
+		}
+		for (auto& it : cache.computePipelines) {
+			it.second.release();
+		}
+		for (auto& it : cache.shaders) {
+			it.second.module.release();
+		}
+		cache.renderPipelines.clear();
+		cache.computePipelines.clear();
+		cache.shaders.clear();
+		scene.pipelineLayout.release();
 	}
 
 	static void _internalSetupDepthTexture() {
@@ -321,493 +1122,5199 @@ namespace tinyrender {
 		depthTextureView = depthTexture.createView(depthTextureViewDesc);
 	}
 
-	static void _internalSetupSceneData() {
-		// Buffer
+	static void _internalDestroyOffscreenTarget() {
+		OffscreenTarget& target = scene.offscreen;
+		target.colorView.release();
+		target.colorTexture.destroy();
+		target.colorTexture.release();
+		target.colorTexture = nullptr;
+		target.readbackBuffer.destroy();
+		target.readbackBuffer.release();
+	}
+
+	// Color target and staging buffer used for headless rendering and image readback
+	static void _internalSetupOffscreenTarget() {
+		OffscreenTarget& target = scene.offscreen;
+		if (target.colorTexture) {
+			_internalDestroyOffscreenTarget();
+		}
+		target.width = uint32_t(scene.width);
+		target.height = uint32_t(scene.height);
+
+		// Same format as the render pipeline color target
+		TextureDescriptor colorTextureDesc;
+		colorTextureDesc.label = "Offscreen color";
+		colorTextureDesc.dimension = TextureDimension::_2D;
+		colorTextureDesc.format = TextureFormat::BGRA8Unorm;
+		colorTextureDesc.mipLevelCount = 1;
+		colorTextureDesc.sampleCount = 1;
+		colorTextureDesc.size = { target.width, target.height, 1 };
+		colorTextureDesc.usage = TextureUsage::RenderAttachment | TextureUsage::CopySrc;
+		colorTextureDesc.viewFormatCount = 0;
+		colorTextureDesc.viewFormats = nullptr;
+		target.colorTexture = scene.device.createTexture(colorTextureDesc);
+
+		TextureViewDescriptor colorViewDesc;
+		colorViewDesc.label = "Offscreen color view";
+		colorViewDesc.format = TextureFormat::BGRA8Unorm;
+		colorViewDesc.dimension = TextureViewDimension::_2D;
+		colorViewDesc.baseMipLevel = 0;
+		colorViewDesc.mipLevelCount = 1;
+		colorViewDesc.baseArrayLayer = 0;
+		colorViewDesc.arrayLayerCount = 1;
+		colorViewDesc.aspect = TextureAspect::All;
+		target.colorView = target.colorTexture.createView(colorViewDesc);
+
+		// Texture to buffer copies need rows aligned on 256 bytes
+		target.bytesPerRow = (target.width * 4 + 255) & ~255u;
 		BufferDescriptor bufferDesc;
-		bufferDesc.size = sizeof(SceneUniforms);
-		bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Uniform;
+		bufferDesc.label = "Readback buffer";
+		bufferDesc.size = uint64_t(target.bytesPerRow) * target.height;
+		bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::MapRead;
 		bufferDesc.mappedAtCreation = false;
-		scene.uniformBuffer = scene.device.createBuffer(bufferDesc);
-
-		// Binding
-		BindGroupEntry binding{};
-		binding.binding = 0;
-		binding.buffer = scene.uniformBuffer;
-		binding.offset = 0;
-		binding.size = sizeof(SceneUniforms);
-
-		// Associated bind group with its layout
-		BindGroupDescriptor bindGroupDesc;
-		bindGroupDesc.layout = scene.bindGroupLayouts[0];
-		bindGroupDesc.entryCount = 1;
-		bindGroupDesc.entries = &binding;
-		scene.bindGroup = scene.device.createBindGroup(bindGroupDesc);
+		target.readbackBuffer = scene.device.createBuffer(bufferDesc);
 	}
 
-	static void _internalSetupCallbacks() {
-		glfwSetInputMode(scene.window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+	// Processes device callbacks such as buffer mapping. Dawn's tick never blocks: callers waiting in a loop
+	// sleep a little between ticks instead of spinning a core while the GPU is behind.
+	static void _internalPollDevice(bool wait) {
+#if defined(WEBGPU_BACKEND_WGPU)
+		wgpuDevicePoll(scene.device, wait, nullptr);
+#else
+		scene.device.tick();
+		if (wait) {
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+#endif
+	}
 
-		glfwSetWindowSizeCallback(scene.window, [](
-			GLFWwindow* /*window*/, 
-			int /*w*/, 
-			int /*h*/
-			) {
-				// TODO: find proper way
+	// Claims and runs the tasks of one generation, task and count were read under the lock with it.
+	// Tasks are only claimed while the generation is current, so a late thread never runs tasks of the next one.
+	static void _internalRunWorkerTasks(uint64_t generation, const std::function<void(uint32_t)>& task, uint32_t count) {
+		WorkerPool& pool = scene.workers;
+		std::unique_lock<std::mutex> lock(pool.mutex);
+		while (pool.generation == generation && pool.nextTask < count) {
+			const uint32_t i = pool.nextTask++;
+			lock.unlock();
+			task(i);
+			lock.lock();
+			if (--pool.remainingTasks == 0) {
+				pool.done.notify_all();
 			}
-		);
+		}
+	}
 
-		glfwSetMouseButtonCallback(scene.window, [](
-			GLFWwindow* /*window*/, 			
-			int button, 
-			int action,
-			int /*mods*/
-			) {
-				if (action == GLFW_PRESS) {
-					scene.currentMouseButton = button;
-				}
-				else {
-					scene.currentMouseButton = -1;
+	static void _internalWorkerLoop() {
+		WorkerPool& pool = scene.workers;
+		uint64_t generation = 0;
+		while (true) {
+			const std::function<void(uint32_t)>* task;
+			uint32_t count;
+			{
+				std::unique_lock<std::mutex> lock(pool.mutex);
+				pool.wake.wait(lock, [&]() { return pool.quit || pool.generation != generation; });
+				if (pool.quit) {
+					return;
 				}
+				generation = pool.generation;
+				task = pool.task;
+				count = pool.taskCount;
+				pool.activeWorkers++;
 			}
-		);
-
-		glfwSetKeyCallback(scene.window, [](
-			GLFWwindow* /*window*/, 
-			int /*key*/, 
-			int /*scancode*/, 
-			int /*action*/, 
-			int /*mods*/
-			) {
-
+			if (task) {
+				_internalRunWorkerTasks(generation, *task, count);
 			}
-		);
-
-		glfwSetScrollCallback(scene.window, [](
-			GLFWwindow* /*window*/,
-			double /*x*/,
-			double y
-			) {
-				_internalApplyCameraMove(0.0f, 0.0f, (float)y);
+			{
+				std::lock_guard<std::mutex> lock(pool.mutex);
+				pool.activeWorkers--;
+				pool.done.notify_all();
 			}
-		);
+		}
 	}
 
-	static void _internalSetupImgui() {
-		IMGUI_CHECKVERSION();
-		ImGui::CreateContext();
+	// Runs task(0) ... task(count - 1) on the worker threads and the calling thread, returns when all are done
+	static void _internalParallelFor(uint32_t count, const std::function<void(uint32_t)>& task) {
+		WorkerPool& pool = scene.workers;
+		if (pool.threads.empty() || count <= 1) {
+			for (uint32_t i = 0; i < count; i++) {
+				task(i);
+			}
+			return;
+		}
+		uint64_t generation;
+		{
+			std::lock_guard<std::mutex> lock(pool.mutex);
+			pool.task = &task;
+			pool.taskCount = count;
+			pool.nextTask = 0;
+			pool.remainingTasks = count;
+			generation = ++pool.generation;
+		}
+		pool.wake.notify_all();
+		_internalRunWorkerTasks(generation, task, count);
 
-		ImGui_ImplGlfw_InitForOther(scene.window, true);
-		ImGui_ImplWGPU_InitInfo info;
-		info.Device = scene.device;
-		info.NumFramesInFlight = 3;
-		info.DepthStencilFormat = depthTexture.getFormat();
-		info.RenderTargetFormat = TextureFormat::BGRA8Unorm;
-		info.PipelineMultisampleState.count = 1;
-		info.PipelineMultisampleState.mask = ~0u;
-		info.PipelineMultisampleState.alphaToCoverageEnabled = false;
-		ImGui_ImplWGPU_Init(&info);
+		// Also wait for every worker that entered this generation to leave it, as they hold a pointer to task
+		std::unique_lock<std::mutex> lock(pool.mutex);
+		pool.done.wait(lock, [&]() { return pool.remainingTasks == 0 && pool.activeWorkers == 0; });
+		pool.task = nullptr;
+	}
 
-		// Adapt font size to screen DPI
-		glm::vec2 contentScale;
-		glfwGetWindowContentScale(scene.window, &contentScale.x, &contentScale.y);
-		glm::ivec2 framebufferSize;
-		glfwGetFramebufferSize(scene.window, &framebufferSize.x, &framebufferSize.y);
-		glm::ivec2 windowSize;
-		glfwGetWindowSize(scene.window, &windowSize.x, &windowSize.y);
-		glm::vec2 dpiScale = glm::vec2(framebufferSize) / glm::vec2(windowSize);
-		glm::vec2 imguiScale = contentScale / dpiScale;
-		ImGui::GetIO().FontGlobalScale = std::min(imguiScale.x, imguiScale.y);
+	static uint32_t _internalWorkerCount() {
+		return uint32_t(scene.workers.threads.size()) + 1;
 	}
 
-	static uint32_t _internalCreateObject(const ObjectDescriptor& objDesc) {
-		ObjectInternal newObj;
+	static void _internalSetupWorkers() {
+		uint32_t threadCount = scene.options.threads;
+		if (threadCount == 0) {
+			threadCount = std::max(1u, std::thread::hardware_concurrency());
+		}
+		for (uint32_t i = 1; i < threadCount; i++) {
+			scene.workers.threads.emplace_back(_internalWorkerLoop);
+		}
+	}
 
-		// Compute the flattened buffer with interleaved position & normal
-		std::vector<vec3> flattenedData(objDesc.vertices.size() * 2);
-		for (int i = 0; i < objDesc.vertices.size(); i++) {
-			flattenedData[(i * 2) + 0] = objDesc.vertices[i];
-			flattenedData[(i * 2) + 1] = objDesc.normals[i];
+	static void _internalDestroyWorkers() {
+		WorkerPool& pool = scene.workers;
+		{
+			std::lock_guard<std::mutex> lock(pool.mutex);
+			pool.quit = true;
 		}
+		pool.wake.notify_all();
+		for (std::thread& thread : pool.threads) {
+			thread.join();
+		}
+		pool.threads.clear();
+	}
 
-		// Vertex buffer (position + normal)
+	static void _internalCreateStagingBuffer(StagingFrame& frame, uint64_t capacity) {
 		BufferDescriptor bufferDesc;
-		bufferDesc.size = flattenedData.size() * sizeof(vec3);
-		bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Vertex;
-		bufferDesc.mappedAtCreation = false;
-		newObj.vertexBuffer = scene.device.createBuffer(bufferDesc);
-		scene.queue.writeBuffer(newObj.vertexBuffer, 0, flattenedData.data(), bufferDesc.size);
-
-		// Triangle buffer
-		newObj.drawCount = static_cast<uint16_t>(objDesc.triangles.size());
-		bufferDesc.size = objDesc.triangles.size() * sizeof(uint16_t);
-		bufferDesc.size = (bufferDesc.size + 3) & ~3; // round up to the next multiple of 4
-		bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Index;
-		newObj.indexBuffer = scene.device.createBuffer(bufferDesc);
-		scene.queue.writeBuffer(newObj.indexBuffer, 0, objDesc.triangles.data(), bufferDesc.size);
-
-		// Uniform buffer (with model matrix)
-		newObj.uniforms.modelMatrix = _internalComputeModelMatrix(
-			objDesc.translation, 
-			objDesc.rotation, 
-			objDesc.scale
-		);
-		bufferDesc.size = sizeof(ObjectUniforms);
-		bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Uniform;
+		bufferDesc.label = "Staging buffer";
+		bufferDesc.size = capacity;
+		bufferDesc.usage = BufferUsage::MapWrite | BufferUsage::CopySrc;
+		bufferDesc.mappedAtCreation = true;
+		frame.buffer = scene.device.createBuffer(bufferDesc);
+		frame.capacity = capacity;
+		frame.mapped = (uint8_t*)frame.buffer.getMappedRange(0, capacity);
+		frame.ready = true;
+	}
+
+	static void _internalSetupStaging() {
+		const uint64_t InitialCapacity = 4 * 1024 * 1024;
+		scene.staging.frames.resize(std::max(1u, scene.options.framesInFlight));
+		for (StagingFrame& frame : scene.staging.frames) {
+			_internalCreateStagingBuffer(frame, InitialCapacity);
+		}
+	}
+
+	static void _internalDestroyStaging() {
+		for (StagingFrame& frame : scene.staging.frames) {
+			frame.buffer.destroy();
+			frame.buffer.release();
+		}
+		scene.staging.frames.clear();
+	}
+
+	static void _internalOnStagingMapped(WGPUBufferMapAsyncStatus status, void* userdata) {
+		StagingFrame& frame = *(StagingFrame*)userdata;
+		if (status == WGPUBufferMapAsyncStatus_Success) {
+			frame.mapped = (uint8_t*)frame.buffer.getMappedRange(0, frame.capacity);
+		}
+		frame.ready = true;
+	}
+
+	// The GPU finished the frame: its staging buffer can be mapped again for a later frame
+	static void _internalOnFrameWorkDone(WGPUQueueWorkDoneStatus /*status*/, void* userdata) {
+		StagingFrame& frame = *(StagingFrame*)userdata;
+		wgpuBufferMapAsync(frame.buffer, WGPUMapMode_Write, 0, frame.capacity, _internalOnStagingMapped, userdata);
+	}
+
+	// Waits for the staging buffer of the oldest frame in flight, and grows it if the last frame overflowed
+	static void _internalBeginStagingFrame(CommandEncoder encoder) {
+		StagingRing& staging = scene.staging;
+		StagingFrame& frame = staging.frames[staging.current];
+		while (!frame.ready) {
+			_internalPollDevice(true);
+		}
+		if (!frame.mapped || frame.requested > frame.capacity) {
+			frame.buffer.destroy();
+			frame.buffer.release();
+			_internalCreateStagingBuffer(frame, std::max(frame.capacity, frame.requested + frame.requested / 2));
+		}
+		frame.offset = 0;
+		frame.requested = 0;
+		staging.encoder = encoder;
+		staging.recording = true;
+	}
+
+	static void _internalEndStagingFrame() {
+		StagingRing& staging = scene.staging;
+		StagingFrame& frame = staging.frames[staging.current];
+		frame.buffer.unmap();
+		frame.mapped = nullptr;
+		frame.ready = false;
+		staging.recording = false;
+	}
+
+	static void _internalStagingFrameSubmitted() {
+		StagingRing& staging = scene.staging;
+		wgpuQueueOnSubmittedWorkDone(scene.queue, _internalOnFrameWorkDone, &staging.frames[staging.current]);
+		staging.current = (staging.current + 1) % uint32_t(staging.frames.size());
+	}
+
+	// Per-frame upload: copied in the staging buffer and transferred by the frame's encoder.
+	// Uploads that do not fit this frame go through the queue, and the buffer grows for the next use.
+	static void _internalStageWrite(Buffer dst, uint64_t dstOffset, const void* data, uint64_t size) {
+		StagingRing& staging = scene.staging;
+		if (!staging.recording) {
+			scene.queue.writeBuffer(dst, dstOffset, data, size);
+			return;
+		}
+		StagingFrame& frame = staging.frames[staging.current];
+		const uint64_t alignedSize = (size + 15) & ~uint64_t(15);
+		frame.requested += alignedSize;
+		if (frame.offset + size > frame.capacity) {
+			scene.queue.writeBuffer(dst, dstOffset, data, size);
+			return;
+		}
+		memcpy(frame.mapped + frame.offset, data, size);
+		staging.encoder.copyBufferToBuffer(frame.buffer, frame.offset, dst, dstOffset, size);
+		frame.offset += alignedSize;
+	}
+
+	static double _internalProfilerTimeUs(Clock::time_point t) {
+		return std::chrono::duration<double, std::micro>(t - scene.profiler.origin).count();
+	}
+
+	static void _internalRecordPhase(ProfilePhase phase, double startUs, double durationUs) {
+		ProfileFrame& frame = scene.profiler.current;
+		frame.events.push_back({ phase, startUs, durationUs });
+		frame.totalUs[phase] += durationUs;
+	}
+
+	// Measures the CPU time of a phase from construction to the end of the scope
+	struct ProfileScope {
+		ProfilePhase phase;
+		Clock::time_point start = Clock::now();
+
+		explicit ProfileScope(ProfilePhase p) : phase(p) {}
+		~ProfileScope() {
+			const Clock::time_point end = Clock::now();
+			_internalRecordPhase(phase, _internalProfilerTimeUs(start), std::chrono::duration<double, std::micro>(end - start).count());
+		}
+	};
+
+	static void _internalEndProfileFrame() {
+		const size_t HistorySize = 300;
+		Profiler& profiler = scene.profiler;
+		profiler.current.number = profiler.frameNumber++;
+		profiler.history.push_back(std::move(profiler.current));
+		profiler.current = ProfileFrame();
+		profiler.rendered = false;
+		if (profiler.history.size() > HistorySize) {
+			profiler.history.pop_front();
+		}
+	}
+
+	// Loops that never call swap(), such as headless rendering, end a frame when the next one starts
+	static void _internalRotateProfileFrame() {
+		if (scene.profiler.rendered) {
+			_internalEndProfileFrame();
+		}
+	}
+
+	static void _internalSetupGpuTimestamps() {
+		Profiler& profiler = scene.profiler;
+		QuerySetDescriptor querySetDesc;
+		querySetDesc.label = "Timestamps";
+		querySetDesc.type = QueryType::Timestamp;
+		querySetDesc.count = 4;
+		profiler.querySet = scene.device.createQuerySet(querySetDesc);
+
+		BufferDescriptor bufferDesc;
+		bufferDesc.label = "Timestamp resolve";
+		bufferDesc.size = 4 * sizeof(uint64_t);
+		bufferDesc.usage = BufferUsage::QueryResolve | BufferUsage::CopySrc;
 		bufferDesc.mappedAtCreation = false;
-		newObj.uniformBuffer = scene.device.createBuffer(bufferDesc);
-		scene.queue.writeBuffer(newObj.uniformBuffer, 0, &newObj.uniforms.modelMatrix, bufferDesc.size);
+		profiler.resolveBuffer = scene.device.createBuffer(bufferDesc);
 
-		// Create a binding
-		BindGroupLayoutEntry bindingLayout = Default;
-		bindingLayout.binding = 0;
-		bindingLayout.visibility = ShaderStage::Vertex | ShaderStage::Fragment;
-		bindingLayout.buffer.type = BufferBindingType::Uniform;
-		bindingLayout.buffer.minBindingSize = sizeof(ObjectUniforms);
+		bufferDesc.label = "Timestamp readback";
+		bufferDesc.usage = BufferUsage::MapRead | BufferUsage::CopyDst;
+		for (GpuTimestampReadback& readback : profiler.readbacks) {
+			readback.buffer = scene.device.createBuffer(bufferDesc);
+		}
+	}
 
-		// Create a bind group layout
-		BindGroupLayoutDescriptor bindGroupLayoutDesc{};
-		bindGroupLayoutDesc.entryCount = 1;
-		bindGroupLayoutDesc.entries = &bindingLayout;
-		BindGroupLayout bindGroupLayout = scene.device.createBindGroupLayout(bindGroupLayoutDesc);
+	static void _internalDestroyGpuTimestamps() {
+		Profiler& profiler = scene.profiler;
+		profiler.querySet.destroy();
+		profiler.querySet.release();
+		profiler.resolveBuffer.destroy();
+		profiler.resolveBuffer.release();
+		for (GpuTimestampReadback& readback : profiler.readbacks) {
+			readback.buffer.destroy();
+			readback.buffer.release();
+		}
+	}
+
+	// Timestamps are in nanoseconds, GPU phases are placed on the CPU timeline at the submit of their frame
+	static void _internalOnTimestampsMapped(WGPUBufferMapAsyncStatus status, void* userdata) {
+		GpuTimestampReadback& readback = *(GpuTimestampReadback*)userdata;
+		readback.busy = false;
+		if (status != WGPUBufferMapAsyncStatus_Success) {
+			return;
+		}
+		uint64_t timestamps[4];
+		memcpy(timestamps, readback.buffer.getConstMappedRange(0, sizeof(timestamps)), sizeof(timestamps));
+		readback.buffer.unmap();
+
+		for (ProfileFrame& frame : scene.profiler.history) {
+			if (frame.number != readback.frame) {
+				continue;
+			}
+			const uint64_t origin = readback.hasCulling ? std::min(timestamps[0], timestamps[2]) : timestamps[0];
+			auto addGpuPhase = [&](ProfilePhase phase, uint64_t begin, uint64_t end) {
+				if (end < begin) {
+					return;
+				}
+				const double durationUs = double(end - begin) / 1000.0;
+				frame.events.push_back({ phase, readback.submitUs + double(begin - origin) / 1000.0, durationUs });
+				frame.totalUs[phase] += durationUs;
+			};
+			addGpuPhase(ProfileGpuRender, timestamps[0], timestamps[1]);
+			if (readback.hasCulling) {
+				addGpuPhase(ProfileGpuCulling, timestamps[2], timestamps[3]);
+			}
+			break;
+		}
+	}
+
+	static ComputePassTimestampWrites* _internalCullingTimestampWrites() {
+		static ComputePassTimestampWrites writes;
+		if (!scene.profiler.timestamps) {
+			return nullptr;
+		}
+		writes.querySet = scene.profiler.querySet;
+		writes.beginningOfPassWriteIndex = 2;
+		writes.endOfPassWriteIndex = 3;
+		scene.profiler.cullingWritten = true;
+		return &writes;
+	}
+
+	// Copies the timestamps of the frame to a free staging buffer, frames are skipped if none is available
+	static GpuTimestampReadback* _internalResolveTimestamps(CommandEncoder encoder) {
+		Profiler& profiler = scene.profiler;
+		for (GpuTimestampReadback& readback : profiler.readbacks) {
+			if (readback.busy) {
+				continue;
+			}
+			const uint32_t count = profiler.cullingWritten ? 4 : 2;
+			encoder.resolveQuerySet(profiler.querySet, 0, count, profiler.resolveBuffer, 0);
+			encoder.copyBufferToBuffer(profiler.resolveBuffer, 0, readback.buffer, 0, count * sizeof(uint64_t));
+			readback.hasCulling = profiler.cullingWritten;
+			return &readback;
+		}
+		return nullptr;
+	}
+
+	static bool _internalWriteChromeTrace(const std::string& path) {
+		std::ofstream file(path);
+		if (!file.is_open()) {
+			return false;
+		}
+		file << "{\"traceEvents\":[\n";
+		bool first = true;
+		for (const ProfileFrame& frame : scene.profiler.history) {
+			for (const ProfileEvent& event : frame.events) {
+				const bool gpu = event.phase >= ProfileGpuCulling;
+				file << (first ? "" : ",\n")
+					<< "{\"name\":\"" << ProfilePhaseNames[event.phase] << "\",\"cat\":\"" << (gpu ? "gpu" : "cpu")
+					<< "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << (gpu ? 2 : 1)
+					<< ",\"ts\":" << event.startUs << ",\"dur\":" << event.durationUs
+					<< ",\"args\":{\"frame\":" << frame.number << "}}";
+				first = false;
+			}
+		}
+		file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+		return bool(file);
+	}
+
+	static void _internalResizeObjectTransforms(uint32_t capacity) {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		if (transforms.buffer) {
+			transforms.buffer.destroy();
+			transforms.buffer.release();
+			transforms.bindGroup.release();
+		}
+		transforms.capacity = capacity;
+
+		BufferDescriptor bufferDesc;
+		bufferDesc.size = capacity * sizeof(ObjectUniforms);
+		bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Storage;
+		bufferDesc.mappedAtCreation = false;
+		transforms.buffer = scene.device.createBuffer(bufferDesc);
 
 		BindGroupEntry binding{};
 		binding.binding = 0;
-		binding.buffer = newObj.uniformBuffer;
+		binding.buffer = transforms.buffer;
 		binding.offset = 0;
-		binding.size = sizeof(ObjectUniforms);
+		binding.size = bufferDesc.size;
 
-		// A bind group contains one or multiple bindings
 		BindGroupDescriptor bindGroupDesc;
-		bindGroupDesc.layout = bindGroupLayout;
-		bindGroupDesc.entryCount = bindGroupLayoutDesc.entryCount;
+		bindGroupDesc.layout = scene.bindGroupLayouts[1];
+		bindGroupDesc.entryCount = 1;
 		bindGroupDesc.entries = &binding;
-		newObj.bindGroup = scene.device.createBindGroup(bindGroupDesc);
+		transforms.bindGroup = scene.device.createBindGroup(bindGroupDesc);
+		scene.drawBundle.dirty = true;
 
-		// Return index in vector
-		uint32_t id = uint32_t(objects.size());
-		objects.insert({ id, newObj });
-		return id;
+		// The new buffer is empty, everything has to be uploaded again
+		transforms.dirtyBegin = 0;
+		transforms.dirtyEnd = uint32_t(transforms.uniforms.size());
 	}
 
-	static void _internalRenderGui() {
-		ImGui::Begin("tinyrenderwgpu");
-		{
-			ImGui::Text("Dt= %.1f ms", ImGui::GetIO().DeltaTime * 1000.0f);
-			ImGui::Text("FPS= %.1f", ImGui::GetIO().Framerate);
+	static void _internalMarkObjectDirty(uint32_t slot) {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		transforms.dirtyBegin = std::min(transforms.dirtyBegin, slot);
+		transforms.dirtyEnd = std::max(transforms.dirtyEnd, slot + 1);
+	}
+
+	// Sets the model matrix of a slot and transforms the local bounding box of its geometry to world space.
+	// Only writes the slot, so distinct slots can be written in parallel.
+	static void _internalWriteObjectTransform(uint32_t slot, const GeometryInternal& geometry, const mat4& modelMatrix) {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		transforms.uniforms[slot].modelMatrix = modelMatrix * _internalDequantizeMatrix(geometry);
+
+		const vec3 center = 0.5f * (geometry.boundsMin + geometry.boundsMax);
+		const vec3 extent = 0.5f * (geometry.boundsMax - geometry.boundsMin);
+		const vec3 worldCenter = vec3(modelMatrix * vec4(center, 1.0f));
+		const mat3 absMatrix = mat3(glm::abs(modelMatrix[0]), glm::abs(modelMatrix[1]), glm::abs(modelMatrix[2]));
+		const vec3 worldExtent = absMatrix * extent;
+		transforms.centerX[slot] = worldCenter.x;
+		transforms.centerY[slot] = worldCenter.y;
+		transforms.centerZ[slot] = worldCenter.z;
+		transforms.extentX[slot] = worldExtent.x;
+		transforms.extentY[slot] = worldExtent.y;
+		transforms.extentZ[slot] = worldExtent.z;
+		transforms.lodScale[slot] = std::max(glm::length(vec3(modelMatrix[0])), std::max(glm::length(vec3(modelMatrix[1])), glm::length(vec3(modelMatrix[2]))));
+	}
+
+	// Rotation and scale columns of the local matrices of four slots, computed as structure of arrays.
+	// Same convention as _internalComputeModelMatrix: translate * eulerAngleXYZ * scale.
+	static void _internalComposeLocalMatrices(const uint32_t slots[4], mat4 out[4]) {
+		const ObjectTransforms& transforms = scene.objectTransforms;
+		float c1[4], s1[4], c2[4], s2[4], c3[4], s3[4];
+		for (int k = 0; k < 4; k++) {
+			const uint32_t slot = slots[k];
+			c1[k] = std::cos(-glm::radians(transforms.rotationX[slot]));
+			s1[k] = std::sin(-glm::radians(transforms.rotationX[slot]));
+			c2[k] = std::cos(-glm::radians(transforms.rotationY[slot]));
+			s2[k] = std::sin(-glm::radians(transforms.rotationY[slot]));
+			c3[k] = std::cos(-glm::radians(transforms.rotationZ[slot]));
+			s3[k] = std::sin(-glm::radians(transforms.rotationZ[slot]));
 		}
-		ImGui::End();
+#ifdef TINYRENDER_SSE
+		auto gather = [&](const std::vector<float>& v) {
+			return _mm_setr_ps(v[slots[0]], v[slots[1]], v[slots[2]], v[slots[3]]);
+		};
+		const __m128 C1 = _mm_loadu_ps(c1), S1 = _mm_loadu_ps(s1);
+		const __m128 C2 = _mm_loadu_ps(c2), S2 = _mm_loadu_ps(s2);
+		const __m128 C3 = _mm_loadu_ps(c3), S3 = _mm_loadu_ps(s3);
+		const __m128 SX = gather(transforms.scaleX), SY = gather(transforms.scaleY), SZ = gather(transforms.scaleZ);
+		const __m128 S1S2 = _mm_mul_ps(S1, S2), C1S2 = _mm_mul_ps(C1, S2);
+
+		// Element r of column c for the four slots, then transposed to one matrix per slot
+		__m128 columns[4][4];
+		columns[0][0] = _mm_mul_ps(_mm_mul_ps(C2, C3), SX);
+		columns[0][1] = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(S1S2, C3), _mm_mul_ps(C1, S3)), SX);
+		columns[0][2] = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(S1, S3), _mm_mul_ps(C1S2, C3)), SX);
+		columns[0][3] = _mm_setzero_ps();
+		columns[1][0] = _mm_mul_ps(_mm_mul_ps(C2, S3), SY);
+		columns[1][1] = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(C1, C3), _mm_mul_ps(S1S2, S3)), SY);
+		columns[1][2] = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(C1S2, S3), _mm_mul_ps(S1, C3)), SY);
+		columns[1][3] = _mm_setzero_ps();
+		columns[2][0] = _mm_mul_ps(_mm_sub_ps(_mm_setzero_ps(), S2), SZ);
+		columns[2][1] = _mm_mul_ps(_mm_mul_ps(S1, C2), SZ);
+		columns[2][2] = _mm_mul_ps(_mm_mul_ps(C1, C2), SZ);
+		columns[2][3] = _mm_setzero_ps();
+		columns[3][0] = gather(transforms.translationX);
+		columns[3][1] = gather(transforms.translationY);
+		columns[3][2] = gather(transforms.translationZ);
+		columns[3][3] = _mm_set1_ps(1.0f);
+		for (int c = 0; c < 4; c++) {
+			_MM_TRANSPOSE4_PS(columns[c][0], columns[c][1], columns[c][2], columns[c][3]);
+			for (int k = 0; k < 4; k++) {
+				_mm_storeu_ps(&out[k][c].x, columns[c][k]);
+			}
+		}
+#else
+		for (int k = 0; k < 4; k++) {
+			const uint32_t slot = slots[k];
+			const vec3 s = vec3(transforms.scaleX[slot], transforms.scaleY[slot], transforms.scaleZ[slot]);
+			out[k][0] = vec4(c2[k] * c3[k], s1[k] * s2[k] * c3[k] - c1[k] * s3[k], s1[k] * s3[k] + c1[k] * s2[k] * c3[k], 0.0f) * s.x;
+			out[k][1] = vec4(c2[k] * s3[k], c1[k] * c3[k] + s1[k] * s2[k] * s3[k], c1[k] * s2[k] * s3[k] - s1[k] * c3[k], 0.0f) * s.y;
+			out[k][2] = vec4(-s2[k], s1[k] * c2[k], c1[k] * c2[k], 0.0f) * s.z;
+			out[k][3] = vec4(transforms.translationX[slot], transforms.translationY[slot], transforms.translationZ[slot], 1.0f);
+		}
+#endif
 	}
 
+	static mat4 _internalMultiplyMatrices(const mat4& a, const mat4& b) {
+#ifdef TINYRENDER_SSE
+		const __m128 a0 = _mm_loadu_ps(&a[0].x), a1 = _mm_loadu_ps(&a[1].x), a2 = _mm_loadu_ps(&a[2].x), a3 = _mm_loadu_ps(&a[3].x);
+		mat4 result;
+		for (int c = 0; c < 4; c++) {
+			const __m128 column = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(a0, _mm_set1_ps(b[c].x)), _mm_mul_ps(a1, _mm_set1_ps(b[c].y))),
+				_mm_add_ps(_mm_mul_ps(a2, _mm_set1_ps(b[c].z)), _mm_mul_ps(a3, _mm_set1_ps(b[c].w))));
+			_mm_storeu_ps(&result[c].x, column);
+		}
+		return result;
+#else
+		return a * b;
+#endif
+	}
 
-	bool init(const char* windowName, int width, int height) {
-		scene.width = width;
-		scene.height = height;
-		std::cout << "Initialization" << std::endl;
+	static void _internalUpdateLocalMatrices(const uint32_t slots[4]) {
+		mat4 local[4];
+		_internalComposeLocalMatrices(slots, local);
+		for (uint32_t k = 0; k < 4; k++) {
+			scene.objectTransforms.local[slots[k]] = local[k];
+		}
+	}
 
-		// GLFW
-		if (!glfwInit()) {
-			std::cerr << "Error: could not initialize GLFW" << std::endl;
-			return false;
+	// Composes the model matrices of a set of slots whose parents are up to date. Local matrices are only
+	// recomputed for the slots whose local transform changed, four at a time: descendants of a moved slot
+	// reuse theirs and only multiply by the parent. The last group is padded with its last slot.
+	static void _internalComposeTransforms(const uint32_t* slots, uint32_t count) {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		uint32_t group[4];
+		uint32_t groupSize = 0;
+		for (uint32_t i = 0; i < count; i++) {
+			if (transforms.pending[slots[i]] & PendingLocal) {
+				group[groupSize++] = slots[i];
+				if (groupSize == 4) {
+					_internalUpdateLocalMatrices(group);
+					groupSize = 0;
+				}
+			}
+		}
+		if (groupSize > 0) {
+			for (uint32_t k = groupSize; k < 4; k++) {
+				group[k] = group[groupSize - 1];
+			}
+			_internalUpdateLocalMatrices(group);
 		}
-		std::cout << "--- GLFW" << std::endl;
 
-		// Window
-		scene.window = glfwCreateWindow(width, height, windowName, nullptr, nullptr);
-		if (!scene.window) {
-			std::cerr << "Error: could not open window" << std::endl;
-			glfwTerminate();
-			return false;
+		for (uint32_t i = 0; i < count; i++) {
+			const uint32_t slot = slots[i];
+			const uint32_t parent = transforms.parent[slot];
+			transforms.world[slot] = parent == UINT32_MAX ? transforms.local[slot] : _internalMultiplyMatrices(transforms.world[parent], transforms.local[slot]);
+			_internalWriteObjectTransform(slot, *transforms.geometries[slot], transforms.world[slot]);
 		}
-		std::cout << "--- window" << std::endl;
+	}
 
-		// Instance
-		Instance instance = wgpuCreateInstance(nullptr);
+	static void _internalQueueTransform(uint32_t slot, PendingFlags flags) {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		if (!transforms.pending[slot]) {
+			transforms.pendingSlots.push_back(slot);
+		}
+		transforms.pending[slot] |= flags;
+	}
 
-		// Adapter
-		scene.surface = glfwGetWGPUSurface(instance, scene.window);
-		RequestAdapterOptions adapterOpts = {};
-		adapterOpts.nextInChain = nullptr;
-		adapterOpts.compatibleSurface = scene.surface;
-		adapterOpts.powerPreference = WGPUPowerPreference_HighPerformance;
-		Adapter adapter = requestAdapterSync(instance, &adapterOpts);
-		std::cout << "--- adapter" << std::endl;
-		AdapterProperties properties = {};
-		properties.nextInChain = nullptr;
-		wgpuAdapterGetProperties(adapter, &properties);
-		if (properties.name) {
-			std::cout << "--- adapter name: " << properties.name << std::endl;
+	// Local transforms are only stored here, model matrices are composed when the transforms are resolved
+	static void _internalSetLocalTransform(uint32_t slot, const vec3& t, const vec3& r, const vec3& s) {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		transforms.translationX[slot] = t.x;
+		transforms.translationY[slot] = t.y;
+		transforms.translationZ[slot] = t.z;
+		transforms.rotationX[slot] = r.x;
+		transforms.rotationY[slot] = r.y;
+		transforms.rotationZ[slot] = r.z;
+		transforms.scaleX[slot] = s.x;
+		transforms.scaleY[slot] = s.y;
+		transforms.scaleZ[slot] = s.z;
+		_internalQueueTransform(slot, PendingLocal);
+	}
+
+	// The BVH is only updated on demand: once more moves than objects are queued, rebuild instead
+	static void _internalQueueBvhRefit(uint32_t slot) {
+		SceneBvh& sceneBvh = scene.sceneBvh;
+		if (!sceneBvh.needsRebuild) {
+			sceneBvh.refitSlots.push_back(slot);
+			if (sceneBvh.refitSlots.size() > scene.objectTransforms.uniforms.size()) {
+				sceneBvh.needsRebuild = true;
+				sceneBvh.refitSlots.clear();
+			}
 		}
-		wgpuInstanceRelease(instance);
+	}
 
-		// Device
-		DeviceDescriptor deviceDesc = {};
-		deviceDesc.nextInChain = nullptr;
-		deviceDesc.label = "TinyRenderDevice";
-		deviceDesc.requiredFeatureCount = 0;
-		auto limits = _internalSetupWpuLimits(adapter);
-		deviceDesc.requiredLimits = &limits;
-		deviceDesc.defaultQueue.nextInChain = nullptr;
-		deviceDesc.defaultQueue.label = "Default queue";
-		deviceDesc.deviceLostCallbackInfo.callback = [](
-			WGPUDevice const* /*device*/,
-			WGPUDeviceLostReason reason,
-			char const* message,
-			void* /*userdata*/
-			) {
-				std::cout << "Device lost: reason " << reason;
-				if (message) {
-					std::cout << " (" << message << ")";
-				}
-				std::cout << std::endl;
-			};
-		scene.device = requestDeviceSync(adapter, &deviceDesc);
-		std::cout << "-- device" << std::endl;
+	// Composes the model matrices of the slots modified since the last call, and of all their descendants.
+	// Parents are composed before their children: one hierarchy level at a time, the slots of a level in parallel.
+	static void _internalResolveTransforms() {
+		const uint32_t SlotsPerTask = 256;
+		ObjectTransforms& transforms = scene.objectTransforms;
+		std::vector<uint32_t>& pendingSlots = transforms.pendingSlots;
+		if (pendingSlots.empty()) {
+			return;
+		}
 
-		// Device error callback
-		auto onDeviceError = [](
-			WGPUErrorType type,
-			char const* message,
-			void* /* pUserData */
-			) {
-				std::cout << "Uncaptured device error: type " << type;
-				if (message) {
-					std::cout << " (" << message << ")";
-				}
-				std::cout << std::endl;
-			};
-		wgpuDeviceSetUncapturedErrorCallback(scene.device, onDeviceError, nullptr);
+		// Lazy propagation: descendants of modified slots are only collected here, once per frame
+		for (size_t i = 0; i < pendingSlots.size(); i++) {
+			for (uint32_t child = transforms.firstChild[pendingSlots[i]]; child != UINT32_MAX; child = transforms.nextSibling[child]) {
+				_internalQueueTransform(child, PendingWorld);
+			}
+		}
 
-		// Queue
-		scene.queue = wgpuDeviceGetQueue(scene.device);
+		// Counting sort of the live slots by depth in the hierarchy
+		std::vector<uint32_t> levelStart(1, 0);
+		for (uint32_t slot : pendingSlots) {
+			if (transforms.objectIds[slot] == UINT32_MAX) {
+				transforms.pending[slot] = 0;
+				continue;
+			}
+			const uint32_t depth = transforms.depth[slot];
+			if (depth + 2 > levelStart.size()) {
+				levelStart.resize(depth + 2, 0);
+			}
+			levelStart[depth + 1]++;
+		}
+		for (size_t level = 1; level < levelStart.size(); level++) {
+			levelStart[level] += levelStart[level - 1];
+		}
+		std::vector<uint32_t> sorted(levelStart.back());
+		std::vector<uint32_t> next(levelStart.begin(), levelStart.end() - 1);
+		for (uint32_t slot : pendingSlots) {
+			if (transforms.objectIds[slot] != UINT32_MAX) {
+				sorted[next[transforms.depth[slot]]++] = slot;
+			}
+		}
+		pendingSlots.clear();
+
+		for (size_t level = 0; level + 1 < levelStart.size(); level++) {
+			const uint32_t begin = levelStart[level];
+			const uint32_t count = levelStart[level + 1] - begin;
+			_internalParallelFor((count + SlotsPerTask - 1) / SlotsPerTask, [&](uint32_t task) {
+				const uint32_t first = task * SlotsPerTask;
+				_internalComposeTransforms(sorted.data() + begin + first, std::min(SlotsPerTask, count - first));
+			});
+		}
+		for (uint32_t slot : sorted) {
+			transforms.pending[slot] = 0;
+			_internalMarkObjectDirty(slot);
+			_internalQueueBvhRefit(slot);
+		}
+	}
 
-		// Release the adapter only after it has been fully utilized
-		adapter.release();
+	// Depths of a slot and its descendants, after it moved in the hierarchy
+	static void _internalUpdateSubtreeDepth(uint32_t slot) {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		const uint32_t parent = transforms.parent[slot];
+		transforms.depth[slot] = parent == UINT32_MAX ? 0 : transforms.depth[parent] + 1;
+		std::vector<uint32_t> stack = { slot };
+		while (!stack.empty()) {
+			const uint32_t current = stack.back();
+			stack.pop_back();
+			for (uint32_t child = transforms.firstChild[current]; child != UINT32_MAX; child = transforms.nextSibling[child]) {
+				transforms.depth[child] = transforms.depth[current] + 1;
+				stack.push_back(child);
+			}
+		}
+	}
 
-		// Surface
-		SurfaceConfiguration config = {};
-		config.width = scene.width;
-		config.height = scene.height;
-		config.usage = TextureUsage::RenderAttachment;
-		wgpu::SurfaceCapabilities capabilities;
-		scene.surface.getCapabilities(adapter, &capabilities);
-		config.format = capabilities.formats[0];
-		config.viewFormatCount = 0;
-		config.viewFormats = nullptr;
-		config.device = scene.device;
-		config.presentMode = PresentMode::Fifo;
-		config.alphaMode = CompositeAlphaMode::Auto;
-		scene.surface.configure(config);
-		std::cout << "-- surface" << std::endl;
+	// Removes a slot from the children of its parent
+	static void _internalDetachSlot(uint32_t slot) {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		const uint32_t parent = transforms.parent[slot];
+		if (parent == UINT32_MAX) {
+			return;
+		}
+		uint32_t* link = &transforms.firstChild[parent];
+		while (*link != slot) {
+			link = &transforms.nextSibling[*link];
+		}
+		*link = transforms.nextSibling[slot];
+		transforms.parent[slot] = UINT32_MAX;
+		transforms.nextSibling[slot] = UINT32_MAX;
+		_internalUpdateSubtreeDepth(slot);
+	}
 
-		_internalSetupRenderPipeline();
-		std::cout << "-- render pipeline" << std::endl;
+	static void _internalAttachSlot(uint32_t slot, uint32_t parent) {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		transforms.parent[slot] = parent;
+		transforms.nextSibling[slot] = transforms.firstChild[parent];
+		transforms.firstChild[parent] = slot;
+		_internalUpdateSubtreeDepth(slot);
+	}
+
+	// Removed objects leave the hierarchy, their children become roots and keep their local transform
+	static void _internalReleaseSlotHierarchy(uint32_t slot) {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		_internalDetachSlot(slot);
+		while (transforms.firstChild[slot] != UINT32_MAX) {
+			const uint32_t child = transforms.firstChild[slot];
+			_internalDetachSlot(child);
+			_internalQueueTransform(child, PendingWorld);
+		}
+	}
+
+	// Planes (inward facing, not normalized) of the frustum defined by a view-projection matrix
+	static void _internalExtractFrustumPlanes(const mat4& m, vec4 planes[6]) {
+		const vec4 row0 = vec4(m[0][0], m[1][0], m[2][0], m[3][0]);
+		const vec4 row1 = vec4(m[0][1], m[1][1], m[2][1], m[3][1]);
+		const vec4 row2 = vec4(m[0][2], m[1][2], m[2][2], m[3][2]);
+		const vec4 row3 = vec4(m[0][3], m[1][3], m[2][3], m[3][3]);
+		planes[0] = row3 + row0;
+		planes[1] = row3 - row0;
+		planes[2] = row3 + row1;
+		planes[3] = row3 - row1;
+		planes[4] = row3 + row2;
+		planes[5] = row3 - row2;
+	}
+
+	static void _internalBvhUpdateBounds(Bvh& bvh, uint32_t nodeIndex, const std::vector<vec3>& boxMin, const std::vector<vec3>& boxMax) {
+		BvhNode& node = bvh.nodes[nodeIndex];
+		if (node.count > 0) {
+			node.boundsMin = vec3(FLT_MAX);
+			node.boundsMax = vec3(-FLT_MAX);
+			for (uint32_t i = 0; i < node.count; i++) {
+				const uint32_t primitive = bvh.primitives[node.leftFirst + i];
+				node.boundsMin = glm::min(node.boundsMin, boxMin[primitive]);
+				node.boundsMax = glm::max(node.boundsMax, boxMax[primitive]);
+			}
+		}
+		else {
+			const BvhNode& left = bvh.nodes[node.leftFirst];
+			const BvhNode& right = bvh.nodes[node.leftFirst + 1];
+			node.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+			node.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+		}
+	}
+
+	// Top-down build with a median split along the largest axis of the centroid bounds
+	static void _internalBuildBvh(Bvh& bvh, const std::vector<vec3>& boxMin, const std::vector<vec3>& boxMax, std::vector<uint32_t> primitives) {
+		const uint32_t MaxLeafSize = 4;
+		bvh.primitives = std::move(primitives);
+		bvh.nodes.clear();
+		bvh.parents.clear();
+		if (bvh.primitives.empty()) {
+			return;
+		}
+		bvh.nodes.reserve(2 * bvh.primitives.size());
+		bvh.parents.reserve(2 * bvh.primitives.size());
+		bvh.nodes.push_back({ vec3(0), 0, vec3(0), uint32_t(bvh.primitives.size()) });
+		bvh.parents.push_back(UINT32_MAX);
+
+		std::vector<uint32_t> stack = { 0 };
+		while (!stack.empty()) {
+			const uint32_t nodeIndex = stack.back();
+			stack.pop_back();
+			_internalBvhUpdateBounds(bvh, nodeIndex, boxMin, boxMax);
+			const uint32_t first = bvh.nodes[nodeIndex].leftFirst;
+			const uint32_t count = bvh.nodes[nodeIndex].count;
+			if (count <= MaxLeafSize) {
+				continue;
+			}
+
+			vec3 centroidMin = vec3(FLT_MAX), centroidMax = vec3(-FLT_MAX);
+			for (uint32_t i = first; i < first + count; i++) {
+				const vec3 c = boxMin[bvh.primitives[i]] + boxMax[bvh.primitives[i]];
+				centroidMin = glm::min(centroidMin, c);
+				centroidMax = glm::max(centroidMax, c);
+			}
+			const vec3 size = centroidMax - centroidMin;
+			const int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+			const uint32_t half = count / 2;
+			std::nth_element(
+				bvh.primitives.begin() + first,
+				bvh.primitives.begin() + first + half,
+				bvh.primitives.begin() + first + count,
+				[&](uint32_t a, uint32_t b) { return boxMin[a][axis] + boxMax[a][axis] < boxMin[b][axis] + boxMax[b][axis]; }
+			);
+
+			const uint32_t left = uint32_t(bvh.nodes.size());
+			bvh.nodes.push_back({ vec3(0), first, vec3(0), half });
+			bvh.nodes.push_back({ vec3(0), first + half, vec3(0), count - half });
+			bvh.parents.push_back(nodeIndex);
+			bvh.parents.push_back(nodeIndex);
+			bvh.nodes[nodeIndex].leftFirst = left;
+			bvh.nodes[nodeIndex].count = 0;
+			stack.push_back(left);
+			stack.push_back(left + 1);
+		}
+
+		// Inner node bounds were computed before their children existed: refit bottom-up,
+		// children always come after their parent in the node array.
+		for (size_t i = bvh.nodes.size(); i-- > 0;) {
+			_internalBvhUpdateBounds(bvh, uint32_t(i), boxMin, boxMax);
+		}
+	}
+
+	static bool _internalRayBoxIntersect(const vec3& origin, const vec3& invDir, const vec3& boxMin, const vec3& boxMax, float tMax) {
+		const vec3 t0 = (boxMin - origin) * invDir;
+		const vec3 t1 = (boxMax - origin) * invDir;
+		const vec3 tNear = glm::min(t0, t1);
+		const vec3 tFar = glm::max(t0, t1);
+		const float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+		const float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, tMax));
+		return enter <= exit;
+	}
+
+	// Moller-Trumbore, returns the ray parameter of the hit or a negative value
+	static float _internalRayTriangleIntersect(const vec3& origin, const vec3& dir, const vec3& a, const vec3& b, const vec3& c) {
+		const vec3 e1 = b - a;
+		const vec3 e2 = c - a;
+		const vec3 p = glm::cross(dir, e2);
+		const float det = glm::dot(e1, p);
+		if (std::abs(det) < 1e-12f) {
+			return -1.0f;
+		}
+		const float invDet = 1.0f / det;
+		const vec3 s = origin - a;
+		const float u = glm::dot(s, p) * invDet;
+		if (u < 0.0f || u > 1.0f) {
+			return -1.0f;
+		}
+		const vec3 q = glm::cross(s, e1);
+		const float v = glm::dot(dir, q) * invDet;
+		if (v < 0.0f || u + v > 1.0f) {
+			return -1.0f;
+		}
+		return glm::dot(e2, q) * invDet;
+	}
+
+	static void _internalBuildTriangleBvh(GeometryInternal& geometry) {
+		const uint32_t triangleCount = uint32_t(geometry.triangles.size() / 3);
+		std::vector<vec3> boxMin(triangleCount), boxMax(triangleCount);
+		std::vector<uint32_t> primitives(triangleCount);
+		for (uint32_t i = 0; i < triangleCount; i++) {
+			const vec3& a = geometry.positions[geometry.triangles[3 * i + 0]];
+			const vec3& b = geometry.positions[geometry.triangles[3 * i + 1]];
+			const vec3& c = geometry.positions[geometry.triangles[3 * i + 2]];
+			boxMin[i] = glm::min(a, glm::min(b, c));
+			boxMax[i] = glm::max(a, glm::max(b, c));
+			primitives[i] = i;
+		}
+		_internalBuildBvh(geometry.triangleBvh, boxMin, boxMax, std::move(primitives));
+	}
+
+	// Closest hit of a local space ray with a geometry, tMax is updated on hit
+	static bool _internalRayGeometryIntersect(GeometryInternal& geometry, const vec3& origin, const vec3& dir, float& tMax, uint32_t& hitTriangle) {
+		if (geometry.triangleBvh.nodes.empty()) {
+			if (geometry.triangles.empty()) {
+				return false;
+			}
+			_internalBuildTriangleBvh(geometry);
+		}
+
+		const Bvh& bvh = geometry.triangleBvh;
+		const vec3 invDir = 1.0f / dir;
+		bool hit = false;
+		uint32_t stack[64];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+		while (stackSize > 0) {
+			const BvhNode& node = bvh.nodes[stack[--stackSize]];
+			if (!_internalRayBoxIntersect(origin, invDir, node.boundsMin, node.boundsMax, tMax)) {
+				continue;
+			}
+			if (node.count == 0) {
+				stack[stackSize++] = node.leftFirst;
+				stack[stackSize++] = node.leftFirst + 1;
+				continue;
+			}
+			for (uint32_t i = 0; i < node.count; i++) {
+				const uint32_t triangle = bvh.primitives[node.leftFirst + i];
+				const float t = _internalRayTriangleIntersect(origin, dir,
+					geometry.positions[geometry.triangles[3 * triangle + 0]],
+					geometry.positions[geometry.triangles[3 * triangle + 1]],
+					geometry.positions[geometry.triangles[3 * triangle + 2]]
+				);
+				if (t >= 0.0f && t < tMax) {
+					tMax = t;
+					hitTriangle = triangle;
+					hit = true;
+				}
+			}
+		}
+		return hit;
+	}
+
+	static void _internalSlotBounds(uint32_t slot, vec3& boxMin, vec3& boxMax) {
+		const ObjectTransforms& transforms = scene.objectTransforms;
+		const vec3 center = vec3(transforms.centerX[slot], transforms.centerY[slot], transforms.centerZ[slot]);
+		const vec3 extent = vec3(transforms.extentX[slot], transforms.extentY[slot], transforms.extentZ[slot]);
+		boxMin = center - extent;
+		boxMax = center + extent;
+	}
+
+	// Refit of a scene BVH node, leaves read the bounds of their slots straight from the world bounds arrays
+	static void _internalSceneBvhRefitNode(Bvh& bvh, uint32_t nodeIndex) {
+		BvhNode& node = bvh.nodes[nodeIndex];
+		if (node.count == 0) {
+			const BvhNode& left = bvh.nodes[node.leftFirst];
+			const BvhNode& right = bvh.nodes[node.leftFirst + 1];
+			node.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+			node.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+			return;
+		}
+		node.boundsMin = vec3(FLT_MAX);
+		node.boundsMax = vec3(-FLT_MAX);
+		for (uint32_t i = 0; i < node.count; i++) {
+			vec3 boxMin, boxMax;
+			_internalSlotBounds(bvh.primitives[node.leftFirst + i], boxMin, boxMax);
+			node.boundsMin = glm::min(node.boundsMin, boxMin);
+			node.boundsMax = glm::max(node.boundsMax, boxMax);
+		}
+	}
+
+	// Rebuilds the scene BVH after objects were added or removed, otherwise refits the nodes above moved objects
+	static void _internalUpdateSceneBvh() {
+		SceneBvh& sceneBvh = scene.sceneBvh;
+		const size_t slotCount = scene.objectTransforms.uniforms.size();
+		if (sceneBvh.needsRebuild) {
+			std::vector<vec3> boxMin(slotCount), boxMax(slotCount);
+			for (uint32_t slot = 0; slot < slotCount; slot++) {
+				_internalSlotBounds(slot, boxMin[slot], boxMax[slot]);
+			}
+			std::vector<uint32_t> liveSlots;
+			liveSlots.reserve(objects.dense.size());
+			for (const ObjectInternal& obj : objects.dense) {
+				liveSlots.push_back(obj.slot);
+			}
+			_internalBuildBvh(sceneBvh.bvh, boxMin, boxMax, std::move(liveSlots));
+
+			sceneBvh.slotLeaf.assign(slotCount, UINT32_MAX);
+			for (uint32_t i = 0; i < sceneBvh.bvh.nodes.size(); i++) {
+				const BvhNode& node = sceneBvh.bvh.nodes[i];
+				for (uint32_t j = 0; j < node.count; j++) {
+					sceneBvh.slotLeaf[sceneBvh.bvh.primitives[node.leftFirst + j]] = i;
+				}
+			}
+			sceneBvh.needsRebuild = false;
+			sceneBvh.refitSlots.clear();
+			return;
+		}
+		if (sceneBvh.refitSlots.empty()) {
+			return;
+		}
+
+		// Many moved objects: refitting the whole tree is cheaper than walking up from each leaf
+		Bvh& bvh = sceneBvh.bvh;
+		if (sceneBvh.refitSlots.size() > bvh.nodes.size() / 8) {
+			for (size_t i = bvh.nodes.size(); i-- > 0;) {
+				_internalSceneBvhRefitNode(bvh, uint32_t(i));
+			}
+		}
+		else {
+			for (uint32_t slot : sceneBvh.refitSlots) {
+				for (uint32_t node = sceneBvh.slotLeaf[slot]; node != UINT32_MAX; node = bvh.parents[node]) {
+					_internalSceneBvhRefitNode(bvh, node);
+				}
+			}
+		}
+		sceneBvh.refitSlots.clear();
+	}
+
+	// Frustum/box classification: -1 outside, 0 intersecting, 1 fully inside
+	static int _internalClassifyBox(const vec4 planes[6], const vec3& boxMin, const vec3& boxMax) {
+		const vec3 center = 0.5f * (boxMin + boxMax);
+		const vec3 extent = 0.5f * (boxMax - boxMin);
+		int result = 1;
+		for (int p = 0; p < 6; p++) {
+			const float d = glm::dot(vec3(planes[p]), center) + planes[p].w;
+			const float r = glm::dot(glm::abs(vec3(planes[p])), extent);
+			if (d + r < 0.0f) {
+				return -1;
+			}
+			if (d - r < 0.0f) {
+				result = 0;
+			}
+		}
+		return result;
+	}
+
+	static void _internalCullObjectsHierarchical(const vec4 planes[6]) {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		std::fill(transforms.visible.begin(), transforms.visible.end(), uint8_t(0));
+
+		const Bvh& bvh = scene.sceneBvh.bvh;
+		if (bvh.nodes.empty()) {
+			return;
+		}
+		std::vector<uint32_t> stack = { 0 };
+		while (!stack.empty()) {
+			const BvhNode& node = bvh.nodes[stack.back()];
+			stack.pop_back();
+			const int classification = _internalClassifyBox(planes, node.boundsMin, node.boundsMax);
+			if (classification < 0) {
+				continue;
+			}
+			if (node.count == 0 && classification == 0) {
+				stack.push_back(node.leftFirst);
+				stack.push_back(node.leftFirst + 1);
+				continue;
+			}
+			if (node.count > 0 && classification == 0) {
+				for (uint32_t i = 0; i < node.count; i++) {
+					const uint32_t slot = bvh.primitives[node.leftFirst + i];
+					vec3 boxMin, boxMax;
+					_internalSlotBounds(slot, boxMin, boxMax);
+					transforms.visible[slot] = _internalClassifyBox(planes, boxMin, boxMax) >= 0 ? 1 : 0;
+				}
+				continue;
+			}
+
+			// Fully inside: everything below is visible without further tests
+			std::vector<uint32_t> subtree = { uint32_t(&node - bvh.nodes.data()) };
+			while (!subtree.empty()) {
+				const BvhNode& inner = bvh.nodes[subtree.back()];
+				subtree.pop_back();
+				if (inner.count == 0) {
+					subtree.push_back(inner.leftFirst);
+					subtree.push_back(inner.leftFirst + 1);
+					continue;
+				}
+				for (uint32_t i = 0; i < inner.count; i++) {
+					transforms.visible[bvh.primitives[inner.leftFirst + i]] = 1;
+				}
+			}
+		}
+	}
+
+	// Computes the visibility of every object slot against the frustum planes, four boxes at a time when SSE is available
+	static void _internalCullObjectsLinear(const vec4 planes[6]) {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		const size_t count = transforms.uniforms.size();
+		size_t i = 0;
+#ifdef TINYRENDER_SSE
+		const __m128 zero = _mm_setzero_ps();
+		for (; i + 4 <= count; i += 4) {
+			const __m128 cx = _mm_loadu_ps(&transforms.centerX[i]);
+			const __m128 cy = _mm_loadu_ps(&transforms.centerY[i]);
+			const __m128 cz = _mm_loadu_ps(&transforms.centerZ[i]);
+			const __m128 ex = _mm_loadu_ps(&transforms.extentX[i]);
+			const __m128 ey = _mm_loadu_ps(&transforms.extentY[i]);
+			const __m128 ez = _mm_loadu_ps(&transforms.extentZ[i]);
+			__m128 outside = zero;
+			for (int p = 0; p < 6; p++) {
+				const vec4& plane = planes[p];
+				__m128 d = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), cx), _mm_mul_ps(_mm_set1_ps(plane.y), cy));
+				d = _mm_add_ps(d, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.z), cz), _mm_set1_ps(plane.w)));
+				__m128 r = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(std::abs(plane.x)), ex), _mm_mul_ps(_mm_set1_ps(std::abs(plane.y)), ey));
+				r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(std::abs(plane.z)), ez));
+				outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(d, r), zero));
+			}
+			const int mask = _mm_movemask_ps(outside);
+			for (int k = 0; k < 4; k++) {
+				transforms.visible[i + k] = (mask & (1 << k)) ? 0 : 1;
+			}
+		}
+#endif
+		for (; i < count; i++) {
+			bool inside = true;
+			for (int p = 0; p < 6 && inside; p++) {
+				const vec4& plane = planes[p];
+				const float d = plane.x * transforms.centerX[i] + plane.y * transforms.centerY[i] + plane.z * transforms.centerZ[i] + plane.w;
+				const float r = std::abs(plane.x) * transforms.extentX[i] + std::abs(plane.y) * transforms.extentY[i] + std::abs(plane.z) * transforms.extentZ[i];
+				inside = d + r >= 0.0f;
+			}
+			transforms.visible[i] = inside ? 1 : 0;
+		}
+	}
+
+	// Below a few thousand objects a linear SIMD pass beats the hierarchy traversal
+	static void _internalCullObjects(const vec4 planes[6]) {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		transforms.visible.resize(transforms.uniforms.size());
+		if (!scene.options.frustumCulling) {
+			std::fill(transforms.visible.begin(), transforms.visible.end(), uint8_t(1));
+		}
+		else if (objects.dense.size() < 4096) {
+			_internalCullObjectsLinear(planes);
+		}
+		else {
+			_internalUpdateSceneBvh();
+			_internalCullObjectsHierarchical(planes);
+		}
+	}
+
+	static void _internalUploadObjectTransforms() {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		if (transforms.dirtyBegin >= transforms.dirtyEnd) {
+			return;
+		}
+		if (transforms.uniforms.size() > transforms.capacity) {
+			_internalResizeObjectTransforms(std::max(uint32_t(transforms.uniforms.size()), 2 * transforms.capacity));
+		}
+
+		// Single contiguous write covering all modified slots
+		_internalStageWrite(
+			transforms.buffer,
+			transforms.dirtyBegin * sizeof(ObjectUniforms),
+			transforms.uniforms.data() + transforms.dirtyBegin,
+			(transforms.dirtyEnd - transforms.dirtyBegin) * sizeof(ObjectUniforms)
+		);
+
+		// World bounds for GPU culling, packed as (center, extent) pairs
+		if (scene.gpuCulling.boundsBuffer) {
+			std::vector<vec4> bounds(2 * (transforms.dirtyEnd - transforms.dirtyBegin));
+			for (uint32_t slot = transforms.dirtyBegin; slot < transforms.dirtyEnd; slot++) {
+				const uint32_t i = 2 * (slot - transforms.dirtyBegin);
+				bounds[i + 0] = vec4(transforms.centerX[slot], transforms.centerY[slot], transforms.centerZ[slot], 0.0f);
+				bounds[i + 1] = vec4(transforms.extentX[slot], transforms.extentY[slot], transforms.extentZ[slot], transforms.lodScale[slot]);
+			}
+			_internalStageWrite(
+				scene.gpuCulling.boundsBuffer,
+				transforms.dirtyBegin * 2 * sizeof(vec4),
+				bounds.data(),
+				bounds.size() * sizeof(vec4)
+			);
+		}
+		transforms.dirtyBegin = UINT32_MAX;
+		transforms.dirtyEnd = 0;
+	}
+
+	static void _internalSetupSceneData() {
+		// Buffer
+		BufferDescriptor bufferDesc;
+		bufferDesc.size = sizeof(SceneUniforms);
+		bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Uniform;
+		bufferDesc.mappedAtCreation = false;
+		scene.uniformBuffer = scene.device.createBuffer(bufferDesc);
+
+		// Binding
+		BindGroupEntry binding{};
+		binding.binding = 0;
+		binding.buffer = scene.uniformBuffer;
+		binding.offset = 0;
+		binding.size = sizeof(SceneUniforms);
+
+		// Associated bind group with its layout
+		BindGroupDescriptor bindGroupDesc;
+		bindGroupDesc.layout = scene.bindGroupLayouts[0];
+		bindGroupDesc.entryCount = 1;
+		bindGroupDesc.entries = &binding;
+		scene.bindGroup = scene.device.createBindGroup(bindGroupDesc);
+
+		// Shared object transform buffer
+		_internalResizeObjectTransforms(1024);
+	}
+
+	static void _internalSetupCallbacks() {
+		glfwSetInputMode(scene.window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+
+		glfwSetWindowSizeCallback(scene.window, [](
+			GLFWwindow* /*window*/, 
+			int /*w*/, 
+			int /*h*/
+			) {
+				// TODO: find proper way
+			}
+		);
+
+		glfwSetMouseButtonCallback(scene.window, [](
+			GLFWwindow* /*window*/, 			
+			int button, 
+			int action,
+			int /*mods*/
+			) {
+				if (action == GLFW_PRESS) {
+					scene.currentMouseButton = button;
+				}
+				else {
+					scene.currentMouseButton = -1;
+				}
+			}
+		);
+
+		glfwSetKeyCallback(scene.window, [](
+			GLFWwindow* /*window*/, 
+			int /*key*/, 
+			int /*scancode*/, 
+			int /*action*/, 
+			int /*mods*/
+			) {
+
+			}
+		);
+
+		glfwSetScrollCallback(scene.window, [](
+			GLFWwindow* /*window*/,
+			double /*x*/,
+			double y
+			) {
+				_internalApplyCameraMove(0.0f, 0.0f, (float)y);
+			}
+		);
+	}
+
+	static void _internalSetupImgui() {
+		IMGUI_CHECKVERSION();
+		ImGui::CreateContext();
+
+		ImGui_ImplGlfw_InitForOther(scene.window, true);
+		ImGui_ImplWGPU_InitInfo info;
+		info.Device = scene.device;
+		info.NumFramesInFlight = 3;
+		info.DepthStencilFormat = depthTexture.getFormat();
+		info.RenderTargetFormat = TextureFormat::BGRA8Unorm;
+		info.PipelineMultisampleState.count = 1;
+		info.PipelineMultisampleState.mask = ~0u;
+		info.PipelineMultisampleState.alphaToCoverageEnabled = false;
+		ImGui_ImplWGPU_Init(&info);
+
+		// Adapt font size to screen DPI
+		glm::vec2 contentScale;
+		glfwGetWindowContentScale(scene.window, &contentScale.x, &contentScale.y);
+		glm::ivec2 framebufferSize;
+		glfwGetFramebufferSize(scene.window, &framebufferSize.x, &framebufferSize.y);
+		glm::ivec2 windowSize;
+		glfwGetWindowSize(scene.window, &windowSize.x, &windowSize.y);
+		glm::vec2 dpiScale = glm::vec2(framebufferSize) / glm::vec2(windowSize);
+		glm::vec2 imguiScale = contentScale / dpiScale;
+		ImGui::GetIO().FontGlobalScale = std::min(imguiScale.x, imguiScale.y);
+	}
+
+	static uint64_t _internalHashBytes(uint64_t hash, const void* data, size_t size) {
+		// FNV-1a
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		for (size_t i = 0; i < size; i++) {
+			hash ^= bytes[i];
+			hash *= 0x100000001b3ull;
+		}
+		return hash;
+	}
+
+	template<typename T>
+	static uint64_t _internalHashVector(uint64_t hash, const std::vector<T>& v) {
+		const uint64_t size = v.size();
+		hash = _internalHashBytes(hash, &size, sizeof(size));
+		return _internalHashBytes(hash, v.data(), v.size() * sizeof(T));
+	}
+
+	// Check hash of descriptor keys: multiply and xor-shift over 4 bytes words, unrelated to FNV-1a
+	static uint64_t _internalHashWords(uint64_t hash, const void* data, size_t size) {
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		for (size_t i = 0; i < size; i += 4) {
+			uint32_t word = 0;
+			memcpy(&word, bytes + i, std::min<size_t>(4, size - i));
+			hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+			hash ^= hash >> 32;
+		}
+		return hash;
+	}
+
+	static GeometryKey _internalHashDescriptor(const ObjectDescriptor& objDesc) {
+		GeometryKey key;
+		key.hash = 0xcbf29ce484222325ull;
+		key.hash = _internalHashVector(key.hash, objDesc.vertices);
+		key.hash = _internalHashVector(key.hash, objDesc.normals);
+		key.hash = _internalHashVector(key.hash, objDesc.triangles);
+		key.hash = _internalHashBytes(key.hash, &objDesc.quantized, sizeof(objDesc.quantized)) & ~PrimitiveKeyBit;
+		key.check = uint64_t(objDesc.normals.size()) << 1 | uint64_t(objDesc.quantized);
+		key.check = _internalHashWords(key.check, objDesc.vertices.data(), objDesc.vertices.size() * sizeof(vec3));
+		key.check = _internalHashWords(key.check, objDesc.normals.data(), objDesc.normals.size() * sizeof(vec3));
+		key.check = _internalHashWords(key.check, objDesc.triangles.data(), objDesc.triangles.size() * sizeof(uint32_t));
+		key.vertexCount = uint32_t(objDesc.vertices.size());
+		key.indexCount = uint32_t(objDesc.triangles.size());
+		return key;
+	}
+
+	// Primitives are checked like descriptors, with the second hash over their parameters
+	static GeometryKey _internalHashPrimitive(const char* name, float size, int n) {
+		GeometryKey key;
+		key.hash = 0xcbf29ce484222325ull;
+		key.hash = _internalHashBytes(key.hash, name, strlen(name));
+		key.hash = _internalHashBytes(key.hash, &size, sizeof(size));
+		key.hash = _internalHashBytes(key.hash, &n, sizeof(n)) | PrimitiveKeyBit;
+		key.check = _internalHashWords(0, name, strlen(name));
+		key.check = _internalHashWords(key.check, &size, sizeof(size));
+		key.check = _internalHashWords(key.check, &n, sizeof(n));
+		return key;
+	}
+
+	// Uploaded geometry is never shared: its check is a counter, and its counts a value no primitive uses
+	static GeometryKey _internalUploadKey(uint64_t upload) {
+		GeometryKey key;
+		key.hash = _internalHashBytes(0xcbf29ce484222325ull, &upload, sizeof(upload)) | PrimitiveKeyBit;
+		key.check = upload;
+		key.vertexCount = UINT32_MAX;
+		key.indexCount = UINT32_MAX;
+		return key;
+	}
+
+	static bool _internalSameGeometry(const GeometryKey& a, const GeometryKey& b) {
+		return a.check == b.check && a.vertexCount == b.vertexCount && a.indexCount == b.indexCount;
+	}
+
+	// Next map key after a collision, in the same half of the key space
+	static uint64_t _internalNextGeometryHash(uint64_t hash) {
+		return ((hash + 1) & ~PrimitiveKeyBit) | (hash & PrimitiveKeyBit);
+	}
+
+	static void _internalArenaEraseFreeRange(ArenaBlock& block, std::map<uint64_t, uint64_t>::iterator it) {
+		auto range = block.freeBySize.equal_range(it->second);
+		for (auto bySize = range.first; bySize != range.second; ++bySize) {
+			if (bySize->second == it->first) {
+				block.freeBySize.erase(bySize);
+				break;
+			}
+		}
+		block.freeByOffset.erase(it);
+	}
+
+	static void _internalArenaAddFreeRange(ArenaBlock& block, uint64_t offset, uint64_t size) {
+		// Coalesce with the next free range
+		auto next = block.freeByOffset.find(offset + size);
+		if (next != block.freeByOffset.end()) {
+			size += next->second;
+			_internalArenaEraseFreeRange(block, next);
+		}
+
+		// Coalesce with the previous free range
+		auto prev = block.freeByOffset.lower_bound(offset);
+		if (prev != block.freeByOffset.begin()) {
+			--prev;
+			if (prev->first + prev->second == offset) {
+				offset = prev->first;
+				size += prev->second;
+				_internalArenaEraseFreeRange(block, prev);
+			}
+		}
+
+		block.freeByOffset.insert({ offset, size });
+		block.freeBySize.insert({ size, offset });
+	}
+
+	static void _internalSetupArena(GpuArena& arena, const char* label, BufferUsage usage, uint64_t unitSize) {
+		// 64MB blocks, unless the device does not allow it
+		const uint64_t blockSize = std::min<uint64_t>(64 << 20, scene.limits.limits.maxBufferSize);
+		arena.label = label;
+		arena.usage = usage | BufferUsage::CopyDst | BufferUsage::CopySrc;
+		arena.unitSize = unitSize;
+		arena.blockUnits = blockSize / unitSize;
+		arena.blocks.clear();
+		arena.usedUnits = 0;
+	}
+
+	static void _internalArenaAddBlock(GpuArena& arena, uint64_t minUnits) {
+		ArenaBlock block;
+		block.capacity = std::max(arena.blockUnits, minUnits);
+
+		BufferDescriptor bufferDesc;
+		bufferDesc.label = arena.label;
+		bufferDesc.size = block.capacity * arena.unitSize;
+		bufferDesc.usage = arena.usage;
+		bufferDesc.mappedAtCreation = false;
+		block.buffer = scene.device.createBuffer(bufferDesc);
+
+		_internalArenaAddFreeRange(block, 0, block.capacity);
+		arena.blocks.push_back(block);
+	}
+
+	static ArenaAllocation _internalArenaAllocate(GpuArena& arena, uint64_t units) {
+		units = std::max<uint64_t>(units, 1);
+		for (uint32_t i = 0; i < arena.blocks.size(); i++) {
+			ArenaBlock& block = arena.blocks[i];
+
+			// Best fit: smallest free range large enough
+			auto fit = block.freeBySize.lower_bound(units);
+			if (fit == block.freeBySize.end()) {
+				continue;
+			}
+			const uint64_t offset = fit->second;
+			const uint64_t size = fit->first;
+			_internalArenaEraseFreeRange(block, block.freeByOffset.find(offset));
+			if (size > units) {
+				_internalArenaAddFreeRange(block, offset + units, size - units);
+			}
+			arena.usedUnits += units;
+			return { i, offset, units };
+		}
+
+		// No room left, allocations larger than a block get a dedicated one
+		_internalArenaAddBlock(arena, units);
+		return _internalArenaAllocate(arena, units);
+	}
+
+	static void _internalArenaFree(GpuArena& arena, const ArenaAllocation& allocation) {
+		_internalArenaAddFreeRange(arena.blocks[allocation.block], allocation.offset, allocation.size);
+		arena.usedUnits -= allocation.size;
+	}
+
+	static uint64_t _internalArenaCapacity(const GpuArena& arena) {
+		uint64_t capacity = 0;
+		for (const ArenaBlock& block : arena.blocks) {
+			capacity += block.capacity;
+		}
+		return capacity;
+	}
+
+	static void _internalArenaWrite(GpuArena& arena, const ArenaAllocation& allocation, const void* data, uint64_t size) {
+		scene.queue.writeBuffer(arena.blocks[allocation.block].buffer, allocation.offset * arena.unitSize, data, size);
+	}
+
+	static GpuArena& _internalVertexArena(bool quantized) {
+		return quantized ? scene.quantizedVertexArena : scene.vertexArena;
+	}
+
+	static void _internalDestroyArena(GpuArena& arena) {
+		for (ArenaBlock& block : arena.blocks) {
+			block.buffer.destroy();
+			block.buffer.release();
+		}
+		arena.blocks.clear();
+		arena.usedUnits = 0;
+	}
+
+	// Compaction is only worth it when it gives back at least one block
+	static bool _internalArenaNeedsCompaction(const GpuArena& arena) {
+		return arena.blocks.size() > 1 && arena.usedUnits < _internalArenaCapacity(arena) / 2;
+	}
+
+	static ArenaAllocation _internalArenaMove(GpuArena& dst, GpuArena& src, const ArenaAllocation& allocation, CommandEncoder encoder) {
+		ArenaAllocation moved = _internalArenaAllocate(dst, allocation.size);
+		encoder.copyBufferToBuffer(
+			src.blocks[allocation.block].buffer, allocation.offset * src.unitSize,
+			dst.blocks[moved.block].buffer, moved.offset * dst.unitSize,
+			allocation.size * src.unitSize
+		);
+		return moved;
+	}
+
+	// Defragments both arenas by packing all live geometries into fresh blocks with GPU copies.
+	// The old blocks are still referenced by the copies, so they are destroyed after submit.
+	static void _internalCompactArenas(CommandEncoder encoder) {
+		if (!_internalArenaNeedsCompaction(scene.vertexArena) && !_internalArenaNeedsCompaction(scene.quantizedVertexArena) &&
+			!_internalArenaNeedsCompaction(scene.indexArena)) {
+			return;
+		}
+
+		GpuArena vertexArena = scene.vertexArena;
+		GpuArena quantizedVertexArena = scene.quantizedVertexArena;
+		GpuArena indexArena = scene.indexArena;
+		for (GpuArena* arena : { &vertexArena, &quantizedVertexArena, &indexArena }) {
+			arena->blocks.clear();
+			arena->usedUnits = 0;
+		}
+		for (auto& it : geometries) {
+			GeometryInternal& geometry = it.second;
+			if (geometry.quantized) {
+				geometry.vertexAlloc = _internalArenaMove(quantizedVertexArena, scene.quantizedVertexArena, geometry.vertexAlloc, encoder);
+			}
+			else {
+				geometry.vertexAlloc = _internalArenaMove(vertexArena, scene.vertexArena, geometry.vertexAlloc, encoder);
+			}
+			geometry.indexAlloc = _internalArenaMove(indexArena, scene.indexArena, geometry.indexAlloc, encoder);
+		}
+
+		for (GpuArena* arena : { &scene.vertexArena, &scene.quantizedVertexArena, &scene.indexArena }) {
+			for (ArenaBlock& block : arena->blocks) {
+				scene.pendingDestroyBuffers.push_back(block.buffer);
+			}
+		}
+		scene.vertexArena = vertexArena;
+		scene.quantizedVertexArena = quantizedVertexArena;
+		scene.indexArena = indexArena;
+		scene.gpuCulling.commandsDirty = true;
+		scene.drawBundle.dirty = true;
+	}
+
+	// Only the pipelines of the vertex formats in use are required
+	static bool _internalObjectPipelinesReady(RenderPipeline floatPipeline, RenderPipeline quantizedPipeline) {
+		return (scene.geometryCounts[0] == 0 || floatPipeline) && (scene.geometryCounts[1] == 0 || quantizedPipeline);
+	}
+
+	static RenderPipeline _internalObjectPipeline(bool quantized, bool gpuCulled) {
+		if (gpuCulled) {
+			return scene.gpuCulling.renderPipelines[quantized];
+		}
+		return quantized ? scene.quantizedPipeline : scene.renderPipeline;
+	}
+
+	// Encoder is either a RenderPassEncoder or a RenderBundleEncoder
+	template<typename Encoder>
+	static void _internalBindGeometry(Encoder renderPass, const GeometryInternal& geometry, GeometryBindings& bindings) {
+		if (bindings.quantized != geometry.quantized) {
+			renderPass.setPipeline(_internalObjectPipeline(geometry.quantized, bindings.gpuCulled));
+			bindings.quantized = geometry.quantized;
+			bindings.vertexBlock = UINT32_MAX;
+		}
+		if (bindings.vertexBlock != geometry.vertexAlloc.block) {
+			const GpuArena& arena = _internalVertexArena(geometry.quantized);
+			const ArenaBlock& block = arena.blocks[geometry.vertexAlloc.block];
+			renderPass.setVertexBuffer(0, block.buffer, 0, block.capacity * arena.unitSize);
+			bindings.vertexBlock = geometry.vertexAlloc.block;
+		}
+		if (bindings.indexBlock != geometry.indexAlloc.block || bindings.indexFormat != geometry.indexFormat) {
+			const ArenaBlock& block = scene.indexArena.blocks[geometry.indexAlloc.block];
+			renderPass.setIndexBuffer(block.buffer, geometry.indexFormat, 0, block.capacity * scene.indexArena.unitSize);
+			bindings.indexBlock = geometry.indexAlloc.block;
+			bindings.indexFormat = geometry.indexFormat;
+		}
+	}
+
+	static uint32_t _internalFirstIndex(const GeometryInternal& geometry) {
+		// Index allocations are in 4 bytes units, i.e. two 16 bits indices or one 32 bits index
+		return uint32_t(geometry.indexFormat == IndexFormat::Uint16 ? geometry.indexAlloc.offset * 2 : geometry.indexAlloc.offset);
+	}
+
+	static void _internalSetupGpuCulling() {
+		GpuCulling& culling = scene.gpuCulling;
+		BufferDescriptor bufferDesc;
+		bufferDesc.label = "Cull uniforms";
+		bufferDesc.size = sizeof(CullUniforms);
+		bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Uniform;
+		bufferDesc.mappedAtCreation = false;
+		culling.uniformBuffer = scene.device.createBuffer(bufferDesc);
+
+		// Uniforms, object bounds, draw commands, indirect draw arguments, LOD errors and instance list
+		std::vector<BindGroupLayoutEntry> entries(6, BindGroupLayoutEntry(Default));
+		for (uint32_t i = 0; i < 6; i++) {
+			entries[i].binding = i;
+			entries[i].visibility = ShaderStage::Compute;
+			entries[i].buffer.type = BufferBindingType::ReadOnlyStorage;
+		}
+		entries[0].buffer.type = BufferBindingType::Uniform;
+		entries[0].buffer.minBindingSize = sizeof(CullUniforms);
+		entries[3].buffer.type = BufferBindingType::Storage;
+		entries[5].buffer.type = BufferBindingType::Storage;
+		BindGroupLayoutDescriptor bindGroupLayoutDesc{};
+		bindGroupLayoutDesc.entryCount = entries.size();
+		bindGroupLayoutDesc.entries = entries.data();
+		culling.bindGroupLayout = scene.device.createBindGroupLayout(bindGroupLayoutDesc);
+
+		PipelineLayoutDescriptor layoutDesc{};
+		layoutDesc.bindGroupLayoutCount = 1;
+		layoutDesc.bindGroupLayouts = (WGPUBindGroupLayout*)&culling.bindGroupLayout;
+		culling.pipelineLayout = scene.device.createPipelineLayout(layoutDesc);
+
+		// Draws read the instance list at group 2, after the scene and object bind groups
+		BindGroupLayoutEntry instanceEntry = Default;
+		instanceEntry.binding = 0;
+		instanceEntry.visibility = ShaderStage::Vertex;
+		instanceEntry.buffer.type = BufferBindingType::ReadOnlyStorage;
+		bindGroupLayoutDesc.entryCount = 1;
+		bindGroupLayoutDesc.entries = &instanceEntry;
+		culling.instanceBindGroupLayout = scene.device.createBindGroupLayout(bindGroupLayoutDesc);
+
+		std::vector<BindGroupLayout> drawBindGroupLayouts = scene.bindGroupLayouts;
+		drawBindGroupLayouts.push_back(culling.instanceBindGroupLayout);
+		layoutDesc.bindGroupLayoutCount = drawBindGroupLayouts.size();
+		layoutDesc.bindGroupLayouts = (WGPUBindGroupLayout*)drawBindGroupLayouts.data();
+		culling.drawPipelineLayout = scene.device.createPipelineLayout(layoutDesc);
+
+		_internalRequestPipeline(PipelineCulling);
+		_internalRequestPipeline(PipelineRenderCulled);
+		_internalRequestPipeline(PipelineQuantizedCulled);
+	}
+
+	static void _internalDestroyGpuCulling() {
+		GpuCulling& culling = scene.gpuCulling;
+		for (Buffer* buffer : { &culling.uniformBuffer, &culling.boundsBuffer, &culling.commandBuffer, &culling.indirectBuffer,
+			&culling.drawTemplateBuffer, &culling.lodBuffer, &culling.instanceBuffer }) {
+			if (*buffer) {
+				buffer->destroy();
+				buffer->release();
+			}
+		}
+		for (BindGroup* bindGroup : { &culling.bindGroup, &culling.instanceBindGroup }) {
+			if (*bindGroup) {
+				bindGroup->release();
+			}
+		}
+		culling.pipelineLayout.release();
+		culling.bindGroupLayout.release();
+		culling.drawPipelineLayout.release();
+		culling.instanceBindGroupLayout.release();
+	}
+
+	static Buffer _internalReplaceBuffer(Buffer buffer, const char* label, BufferUsage usage, uint64_t size) {
+		if (buffer) {
+			buffer.destroy();
+			buffer.release();
+		}
+		BufferDescriptor bufferDesc;
+		bufferDesc.label = label;
+		bufferDesc.size = size;
+		bufferDesc.usage = usage;
+		bufferDesc.mappedAtCreation = false;
+		return scene.device.createBuffer(bufferDesc);
+	}
+
+	// Objects are sorted by geometry, and geometries by vertex/index buffers so that each group of draws is a single multi draw.
+	// Each geometry gets one draw per LOD, whose range of the instance list can hold all objects of the geometry.
+	static void _internalRebuildGpuDrawCommands() {
+		GpuCulling& culling = scene.gpuCulling;
+		std::vector<const ObjectInternal*> sorted;
+		sorted.reserve(objects.dense.size());
+		for (const ObjectInternal& obj : objects.dense) {
+			sorted.push_back(&obj);
+		}
+		std::sort(sorted.begin(), sorted.end(), [](const ObjectInternal* a, const ObjectInternal* b) {
+			const GeometryInternal& ga = *a->geometry;
+			const GeometryInternal& gb = *b->geometry;
+			if (ga.vertexAlloc.block != gb.vertexAlloc.block) return ga.vertexAlloc.block < gb.vertexAlloc.block;
+			if (ga.indexAlloc.block != gb.indexAlloc.block) return ga.indexAlloc.block < gb.indexAlloc.block;
+			if (ga.indexFormat != gb.indexFormat) return uint32_t(ga.indexFormat) < uint32_t(gb.indexFormat);
+			return std::less<const GeometryInternal*>()(&ga, &gb);
+		});
+
+		culling.commands.clear();
+		culling.draws.clear();
+		culling.lodErrors.clear();
+		culling.groups.clear();
+		uint32_t instanceCount = 0;
+		for (size_t first = 0; first < sorted.size();) {
+			const GeometryInternal& geometry = *sorted[first]->geometry;
+			size_t last = first + 1;
+			while (last < sorted.size() && sorted[last]->geometry == &geometry) {
+				last++;
+			}
+			const uint32_t objectCount = uint32_t(last - first);
+			const uint32_t lodCount = std::max(1u, uint32_t(geometry.lods.size()));
+			const uint32_t firstDraw = uint32_t(culling.draws.size());
+
+			const GeometryInternal* previous = culling.groups.empty() ? nullptr : culling.groups.back().geometry;
+			if (!previous ||
+				previous->vertexAlloc.block != geometry.vertexAlloc.block ||
+				previous->indexAlloc.block != geometry.indexAlloc.block ||
+				previous->indexFormat != geometry.indexFormat) {
+				culling.groups.push_back({ &geometry, firstDraw, 0 });
+			}
+			culling.groups.back().count += lodCount;
+			for (uint32_t lod = 0; lod < lodCount; lod++) {
+				culling.draws.push_back({
+					lod == 0 ? geometry.drawCount : geometry.lods[lod].indexCount,
+					0,
+					_internalFirstIndex(geometry) + (lod == 0 ? 0 : geometry.lods[lod].firstIndex),
+					int32_t(geometry.vertexAlloc.offset),
+					instanceCount
+				});
+				culling.lodErrors.push_back(lod == 0 ? 0.0f : geometry.lods[lod].error);
+				instanceCount += objectCount;
+			}
+			for (size_t i = first; i < last; i++) {
+				culling.commands.push_back({ sorted[i]->slot, firstDraw, lodCount, 0 });
+			}
+			first = last;
+		}
+
+		// Bind groups reference the buffers, they are created again after a reallocation
+		auto invalidateBindGroups = [&]() {
+			for (BindGroup* bindGroup : { &culling.bindGroup, &culling.instanceBindGroup }) {
+				if (*bindGroup) {
+					bindGroup->release();
+					*bindGroup = nullptr;
+				}
+			}
+		};
+		if (culling.commands.size() > culling.commandCapacity) {
+			culling.commandCapacity = std::max(uint32_t(culling.commands.size()), 2 * culling.commandCapacity);
+			culling.commandBuffer = _internalReplaceBuffer(culling.commandBuffer, "Draw commands",
+				BufferUsage::CopyDst | BufferUsage::Storage, culling.commandCapacity * sizeof(GpuDrawCommand));
+			invalidateBindGroups();
+		}
+		if (culling.draws.size() > culling.drawCapacity || !culling.indirectBuffer) {
+			culling.drawCapacity = std::max(std::max(uint32_t(culling.draws.size()), 1u), 2 * culling.drawCapacity);
+			culling.indirectBuffer = _internalReplaceBuffer(culling.indirectBuffer, "Indirect draws",
+				BufferUsage::CopyDst | BufferUsage::Storage | BufferUsage::Indirect, culling.drawCapacity * sizeof(GpuIndirectDraw));
+			culling.drawTemplateBuffer = _internalReplaceBuffer(culling.drawTemplateBuffer, "Indirect draw template",
+				BufferUsage::CopyDst | BufferUsage::CopySrc, culling.drawCapacity * sizeof(GpuIndirectDraw));
+			culling.lodBuffer = _internalReplaceBuffer(culling.lodBuffer, "LOD errors",
+				BufferUsage::CopyDst | BufferUsage::Storage, culling.drawCapacity * sizeof(float));
+			invalidateBindGroups();
+		}
+		if (instanceCount > culling.instanceCapacity || !culling.instanceBuffer) {
+			culling.instanceCapacity = std::max(std::max(instanceCount, 1u), 2 * culling.instanceCapacity);
+			culling.instanceBuffer = _internalReplaceBuffer(culling.instanceBuffer, "Instance list",
+				BufferUsage::Storage, culling.instanceCapacity * sizeof(uint32_t));
+			invalidateBindGroups();
+		}
+		if (!culling.commands.empty()) {
+			_internalStageWrite(culling.commandBuffer, 0, culling.commands.data(), culling.commands.size() * sizeof(GpuDrawCommand));
+			_internalStageWrite(culling.drawTemplateBuffer, 0, culling.draws.data(), culling.draws.size() * sizeof(GpuIndirectDraw));
+			_internalStageWrite(culling.lodBuffer, 0, culling.lodErrors.data(), culling.lodErrors.size() * sizeof(float));
+		}
+		if (!culling.instanceBindGroup) {
+			BindGroupEntry entry;
+			entry.binding = 0;
+			entry.buffer = culling.instanceBuffer;
+			entry.offset = 0;
+			entry.size = culling.instanceCapacity * sizeof(uint32_t);
+			BindGroupDescriptor bindGroupDesc;
+			bindGroupDesc.layout = culling.instanceBindGroupLayout;
+			bindGroupDesc.entryCount = 1;
+			bindGroupDesc.entries = &entry;
+			culling.instanceBindGroup = scene.device.createBindGroup(bindGroupDesc);
+		}
+		culling.commandsDirty = false;
+		scene.drawBundle.dirty = true;
+	}
+
+	// Grows the bounds buffer with the object slots, before transforms and bounds are uploaded
+	static void _internalPrepareGpuCulling() {
+		GpuCulling& culling = scene.gpuCulling;
+		ObjectTransforms& transforms = scene.objectTransforms;
+		const uint32_t slotCount = uint32_t(transforms.uniforms.size());
+		if (slotCount > culling.boundsCapacity) {
+			culling.boundsCapacity = std::max(std::max(slotCount, transforms.capacity), 2 * culling.boundsCapacity);
+			culling.boundsBuffer = _internalReplaceBuffer(culling.boundsBuffer, "Object bounds",
+				BufferUsage::CopyDst | BufferUsage::Storage, culling.boundsCapacity * 2 * sizeof(vec4));
+			if (culling.bindGroup) {
+				culling.bindGroup.release();
+				culling.bindGroup = nullptr;
+			}
+
+			// The new buffer is empty, all bounds are uploaded again with the transforms
+			transforms.dirtyBegin = 0;
+			transforms.dirtyEnd = slotCount;
+		}
+	}
+
+	// Projected size in pixels of one world unit at distance 1, divided by the allowed error. 0 when LODs are disabled.
+	static float _internalLodScale() {
+		if (!scene.options.lods || scene.options.lodErrorPixels <= 0.0f) {
+			return 0.0f;
+		}
+		return scene.uniforms.projMatrix[1][1] * 0.5f * float(scene.height) / scene.options.lodErrorPixels;
+	}
+
+	// Coarsest level whose error, projected at the closest point of the bounding box, stays under the threshold
+	static uint8_t _internalSelectLod(const GeometryInternal& geometry, uint32_t slot, const vec3& eye, float lodScale) {
+		const ObjectTransforms& transforms = scene.objectTransforms;
+		const vec3 center = vec3(transforms.centerX[slot], transforms.centerY[slot], transforms.centerZ[slot]);
+		const vec3 extent = vec3(transforms.extentX[slot], transforms.extentY[slot], transforms.extentZ[slot]);
+		const float distance = std::max(glm::length(center - eye) - glm::length(extent), 1e-4f);
+		const float scale = transforms.lodScale[slot] * lodScale / distance;
+		uint8_t lod = 0;
+		for (size_t i = 1; i < geometry.lods.size() && geometry.lods[i].error * scale <= 1.0f; i++) {
+			lod = uint8_t(i);
+		}
+		return lod;
+	}
+
+	static void _internalSelectLods() {
+		if (!scene.options.lods) {
+			return;
+		}
+		ObjectTransforms& transforms = scene.objectTransforms;
+		const float lodScale = _internalLodScale();
+		for (const ObjectInternal& obj : objects.dense) {
+			const uint32_t slot = obj.slot;
+			const GeometryInternal& geometry = *obj.geometry;
+			transforms.lod[slot] = lodScale > 0.0f && transforms.visible[slot] && geometry.lods.size() > 1 ?
+				_internalSelectLod(geometry, slot, scene.options.eye, lodScale) : 0;
+		}
+	}
+
+	static void _internalCullObjectsGpu(CommandEncoder encoder, const vec4 planes[6]) {
+		GpuCulling& culling = scene.gpuCulling;
+		if (culling.commands.empty()) {
+			return;
+		}
+		if (!culling.bindGroup) {
+			const Buffer buffers[6] = {
+				culling.uniformBuffer, culling.boundsBuffer, culling.commandBuffer, culling.indirectBuffer, culling.lodBuffer, culling.instanceBuffer
+			};
+			const uint64_t sizes[6] = {
+				sizeof(CullUniforms),
+				culling.boundsCapacity * 2 * sizeof(vec4),
+				culling.commandCapacity * sizeof(GpuDrawCommand),
+				culling.drawCapacity * sizeof(GpuIndirectDraw),
+				culling.drawCapacity * sizeof(float),
+				culling.instanceCapacity * sizeof(uint32_t)
+			};
+			std::vector<BindGroupEntry> entries(6);
+			for (uint32_t i = 0; i < 6; i++) {
+				entries[i].binding = i;
+				entries[i].buffer = buffers[i];
+				entries[i].offset = 0;
+				entries[i].size = sizes[i];
+			}
+			BindGroupDescriptor bindGroupDesc;
+			bindGroupDesc.layout = culling.bindGroupLayout;
+			bindGroupDesc.entryCount = entries.size();
+			bindGroupDesc.entries = entries.data();
+			culling.bindGroup = scene.device.createBindGroup(bindGroupDesc);
+		}
+
+		// A plane always in front of everything disables culling without another shader
+		CullUniforms uniforms = {};
+		for (int i = 0; i < 6; i++) {
+			uniforms.planes[i] = scene.options.frustumCulling ? planes[i] : vec4(0.0f, 0.0f, 0.0f, 1.0f);
+		}
+		uniforms.commandCount = uint32_t(culling.commands.size());
+		uniforms.eye = vec4(scene.options.eye, 1.0f);
+		uniforms.lodScale = _internalLodScale();
+		if (memcmp(&uniforms, &culling.uploadedUniforms, sizeof(CullUniforms)) != 0) {
+			_internalStageWrite(culling.uniformBuffer, 0, &uniforms, sizeof(CullUniforms));
+			culling.uploadedUniforms = uniforms;
+		}
+
+		// Draws start the frame with zero instances
+		encoder.copyBufferToBuffer(culling.drawTemplateBuffer, 0, culling.indirectBuffer, 0, culling.draws.size() * sizeof(GpuIndirectDraw));
+
+		ComputePassDescriptor computePassDesc{};
+		computePassDesc.label = "Cull pass";
+		computePassDesc.timestampWrites = _internalCullingTimestampWrites();
+		ComputePassEncoder computePass = encoder.beginComputePass(computePassDesc);
+		computePass.setPipeline(culling.pipeline);
+		computePass.setBindGroup(0, culling.bindGroup, 0, nullptr);
+		computePass.dispatchWorkgroups((uniforms.commandCount + 63) / 64, 1, 1);
+		computePass.end();
+		computePass.release();
+	}
+
+	static bool _internalMultiDrawIndexedIndirect(RenderPassEncoder renderPass, const GpuDrawGroup& group, uint64_t stride) {
+#if defined(WEBGPU_BACKEND_WGPU)
+		if (scene.gpuCulling.multiDrawIndirect) {
+			wgpuRenderPassEncoderMultiDrawIndexedIndirect(renderPass, scene.gpuCulling.indirectBuffer, group.first * stride, group.count);
+			return true;
+		}
+#else
+		(void)renderPass;
+		(void)group;
+		(void)stride;
+#endif
+		return false;
+	}
+
+	// Multi draws are not available in render bundles
+	static bool _internalMultiDrawIndexedIndirect(RenderBundleEncoder, const GpuDrawGroup&, uint64_t) {
+		return false;
+	}
+
+	// Switches object draws to or from the pipelines reading the object slot from the GPU culling instance list
+	template<typename Encoder>
+	static void _internalSetGpuCulledDraws(Encoder renderPass, GeometryBindings& bindings, bool gpuCulled) {
+		bindings.gpuCulled = gpuCulled;
+		if (RenderPipeline pipeline = _internalObjectPipeline(bindings.quantized, gpuCulled)) {
+			renderPass.setPipeline(pipeline);
+		}
+		if (gpuCulled) {
+			renderPass.setBindGroup(2, scene.gpuCulling.instanceBindGroup, 0, nullptr);
+		}
+		bindings.vertexBlock = UINT32_MAX;
+	}
+
+	// Draws every object from the indirect buffer: one multi draw per group when the backend allows it,
+	// otherwise one instanced draw per geometry and LOD
+	template<typename Encoder>
+	static void _internalDrawObjectsGpu(Encoder renderPass, GeometryBindings& bindings) {
+		const GpuCulling& culling = scene.gpuCulling;
+		const uint64_t stride = sizeof(GpuIndirectDraw);
+		_internalSetGpuCulledDraws(renderPass, bindings, true);
+		for (const GpuDrawGroup& group : culling.groups) {
+			_internalBindGeometry(renderPass, *group.geometry, bindings);
+			if (_internalMultiDrawIndexedIndirect(renderPass, group, stride)) {
+				continue;
+			}
+			for (uint32_t i = 0; i < group.count; i++) {
+				renderPass.drawIndexedIndirect(culling.indirectBuffer, (group.first + i) * stride);
+			}
+		}
+		_internalSetGpuCulledDraws(renderPass, bindings, false);
+	}
+
+	// Average cache miss ratio: transformed vertices per triangle with a FIFO post-transform cache
+	static float _internalComputeAcmr(const std::vector<uint32_t>& triangles, uint32_t vertexCount, uint32_t cacheSize) {
+		if (triangles.empty()) {
+			return 0.0f;
+		}
+		std::vector<uint32_t> timestamps(vertexCount, 0);
+		uint32_t time = cacheSize + 1;
+		uint32_t misses = 0;
+		for (uint32_t v : triangles) {
+			if (time - timestamps[v] > cacheSize) {
+				timestamps[v] = time++;
+				misses++;
+			}
+		}
+		return float(misses) / float(triangles.size() / 3);
+	}
+
+	// Tipsify (Sander et al. 2007): triangles are emitted by fanning around vertices still in the cache.
+	// Returns the new triangle order, and the first triangle of each cluster: clusters start where the
+	// cache is effectively flushed, so they can be reordered without hurting the cache much.
+	static std::vector<uint32_t> _internalTipsify(const std::vector<uint32_t>& triangles, uint32_t vertexCount, uint32_t cacheSize, std::vector<uint32_t>& clusters) {
+		const uint32_t triangleCount = uint32_t(triangles.size() / 3);
+
+		// Vertex to triangles adjacency
+		std::vector<uint32_t> liveCount(vertexCount, 0);
+		for (uint32_t v : triangles) {
+			liveCount[v]++;
+		}
+		std::vector<uint32_t> adjacencyOffsets(vertexCount + 1, 0);
+		for (uint32_t v = 0; v < vertexCount; v++) {
+			adjacencyOffsets[v + 1] = adjacencyOffsets[v] + liveCount[v];
+		}
+		std::vector<uint32_t> adjacency(triangles.size());
+		std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+		for (uint32_t t = 0; t < triangleCount; t++) {
+			for (uint32_t k = 0; k < 3; k++) {
+				adjacency[fill[triangles[t * 3 + k]]++] = t;
+			}
+		}
+
+		std::vector<uint32_t> timestamps(vertexCount, 0);
+		std::vector<bool> emitted(triangleCount, false);
+		std::vector<uint32_t> deadEnds;
+		std::vector<uint32_t> candidates;
+		std::vector<uint32_t> order;
+		order.reserve(triangleCount);
+		uint32_t time = cacheSize + 1;
+		uint32_t cursor = 0;
+		bool restart = true;
+
+		// Most recently referenced vertex with live triangles, or the next one in input order
+		auto skipDeadEnd = [&]() -> int64_t {
+			while (!deadEnds.empty()) {
+				const uint32_t v = deadEnds.back();
+				deadEnds.pop_back();
+				if (liveCount[v] > 0) {
+					return v;
+				}
+			}
+			restart = true;
+			for (; cursor < vertexCount; cursor++) {
+				if (liveCount[cursor] > 0) {
+					return cursor;
+				}
+			}
+			return -1;
+		};
+
+		int64_t fanning = skipDeadEnd();
+		while (fanning >= 0) {
+			candidates.clear();
+			for (uint32_t a = adjacencyOffsets[fanning]; a < adjacencyOffsets[fanning + 1]; a++) {
+				const uint32_t t = adjacency[a];
+				if (emitted[t]) {
+					continue;
+				}
+				if (restart) {
+					clusters.push_back(uint32_t(order.size()));
+					restart = false;
+				}
+				for (uint32_t k = 0; k < 3; k++) {
+					const uint32_t v = triangles[t * 3 + k];
+					deadEnds.push_back(v);
+					candidates.push_back(v);
+					liveCount[v]--;
+					if (time - timestamps[v] > cacheSize) {
+						timestamps[v] = time++;
+					}
+				}
+				emitted[t] = true;
+				order.push_back(t);
+			}
+
+			// Next fanning vertex: the oldest candidate that will still be in the cache after its fan
+			fanning = -1;
+			int64_t best = -1;
+			for (uint32_t v : candidates) {
+				if (liveCount[v] == 0) {
+					continue;
+				}
+				int64_t priority = 0;
+				if (time - timestamps[v] + 2 * liveCount[v] <= cacheSize) {
+					priority = time - timestamps[v];
+				}
+				if (priority > best) {
+					best = priority;
+					fanning = v;
+				}
+			}
+			if (fanning < 0) {
+				fanning = skipDeadEnd();
+			}
+		}
+		return order;
+	}
+
+	// Reorders triangles for the post-transform cache, then clusters for overdraw, then vertices for fetch locality.
+	// Returns the original index of each triangle.
+	static std::vector<uint32_t> _internalOptimizeMesh(ObjectDescriptor& objDesc, float& acmrBefore, float& acmrAfter) {
+		const uint32_t CacheSize = 16;
+		const uint32_t MinClusterTriangles = 64;
+		const uint32_t vertexCount = uint32_t(objDesc.vertices.size());
+		const uint32_t triangleCount = uint32_t(objDesc.triangles.size() / 3);
+		acmrBefore = _internalComputeAcmr(objDesc.triangles, vertexCount, CacheSize);
+
+		// 1. Vertex cache order
+		std::vector<uint32_t> clusterStarts;
+		std::vector<uint32_t> order = _internalTipsify(objDesc.triangles, vertexCount, CacheSize, clusterStarts);
+
+		// Soft cluster boundaries, where none of the vertices of a triangle is in the cache anymore
+		{
+			std::vector<uint32_t> timestamps(vertexCount, 0);
+			std::vector<uint32_t> boundaries;
+			uint32_t time = CacheSize + 1;
+			uint32_t clusterStart = 0;
+			size_t hard = 0;
+			for (uint32_t i = 0; i < triangleCount; i++) {
+				uint32_t misses = 0;
+				for (uint32_t k = 0; k < 3; k++) {
+					const uint32_t v = objDesc.triangles[order[i] * 3 + k];
+					if (time - timestamps[v] > CacheSize) {
+						timestamps[v] = time++;
+						misses++;
+					}
+				}
+				const bool isHard = hard < clusterStarts.size() && clusterStarts[hard] == i;
+				hard += isHard ? 1 : 0;
+				if (isHard || (misses == 3 && i - clusterStart >= MinClusterTriangles)) {
+					boundaries.push_back(i);
+					clusterStart = i;
+				}
+			}
+			clusterStarts = boundaries;
+		}
+		clusterStarts.push_back(triangleCount);
+
+		// 2. Overdraw: clusters facing away from the mesh center are drawn first, they are more likely to occlude the others
+		auto triangleData = [&](uint32_t t, vec3& centroid, vec3& areaNormal) {
+			const vec3& a = objDesc.vertices[objDesc.triangles[t * 3 + 0]];
+			const vec3& b = objDesc.vertices[objDesc.triangles[t * 3 + 1]];
+			const vec3& c = objDesc.vertices[objDesc.triangles[t * 3 + 2]];
+			centroid = (a + b + c) / 3.0f;
+			areaNormal = glm::cross(b - a, c - a);
+		};
+		vec3 meshCenter = vec3(0.0f);
+		float meshArea = 0.0f;
+		for (uint32_t t = 0; t < triangleCount; t++) {
+			vec3 centroid, areaNormal;
+			triangleData(t, centroid, areaNormal);
+			const float area = glm::length(areaNormal);
+			meshCenter += centroid * area;
+			meshArea += area;
+		}
+		meshCenter = meshArea > 0.0f ? meshCenter / meshArea : vec3(0.0f);
+
+		const uint32_t clusterCount = uint32_t(clusterStarts.size()) - 1;
+		std::vector<float> clusterSortKeys(clusterCount);
+		for (uint32_t c = 0; c < clusterCount; c++) {
+			vec3 center = vec3(0.0f), normal = vec3(0.0f);
+			float area = 0.0f;
+			for (uint32_t i = clusterStarts[c]; i < clusterStarts[c + 1]; i++) {
+				vec3 centroid, areaNormal;
+				triangleData(order[i], centroid, areaNormal);
+				const float triangleArea = glm::length(areaNormal);
+				center += centroid * triangleArea;
+				normal += areaNormal;
+				area += triangleArea;
+			}
+			center = area > 0.0f ? center / area : center;
+			const float normalLength = glm::length(normal);
+			clusterSortKeys[c] = normalLength > 0.0f ? glm::dot(center - meshCenter, normal / normalLength) : 0.0f;
+		}
+		std::vector<uint32_t> clusterOrder(clusterCount);
+		for (uint32_t c = 0; c < clusterCount; c++) {
+			clusterOrder[c] = c;
+		}
+		std::stable_sort(clusterOrder.begin(), clusterOrder.end(), [&](uint32_t a, uint32_t b) { return clusterSortKeys[a] > clusterSortKeys[b]; });
+
+		std::vector<uint32_t> triangleOrder;
+		triangleOrder.reserve(triangleCount);
+		for (uint32_t c : clusterOrder) {
+			triangleOrder.insert(triangleOrder.end(), order.begin() + clusterStarts[c], order.begin() + clusterStarts[c + 1]);
+		}
+
+		// 3. Vertex fetch order: vertices are renumbered by first use, unused ones go last
+		std::vector<uint32_t> remap(vertexCount, UINT32_MAX);
+		std::vector<uint32_t> newTriangles(objDesc.triangles.size());
+		uint32_t next = 0;
+		for (uint32_t i = 0; i < triangleCount; i++) {
+			for (uint32_t k = 0; k < 3; k++) {
+				const uint32_t v = objDesc.triangles[triangleOrder[i] * 3 + k];
+				if (remap[v] == UINT32_MAX) {
+					remap[v] = next++;
+				}
+				newTriangles[i * 3 + k] = remap[v];
+			}
+		}
+		for (uint32_t v = 0; v < vertexCount; v++) {
+			if (remap[v] == UINT32_MAX) {
+				remap[v] = next++;
+			}
+		}
+		auto reorderVertices = [&](std::vector<vec3>& attribute) {
+			if (attribute.size() != vertexCount) {
+				return;
+			}
+			std::vector<vec3> reordered(vertexCount);
+			for (uint32_t v = 0; v < vertexCount; v++) {
+				reordered[remap[v]] = attribute[v];
+			}
+			attribute = std::move(reordered);
+		};
+		reorderVertices(objDesc.vertices);
+		reorderVertices(objDesc.normals);
+		reorderVertices(objDesc.colors);
+		objDesc.triangles = std::move(newTriangles);
+
+		acmrAfter = _internalComputeAcmr(objDesc.triangles, vertexCount, CacheSize);
+		return triangleOrder;
+	}
+
+	static void _internalAddPlaneQuadric(Quadric& q, const glm::dvec3& n, double d, double weight) {
+		q.a00 += weight * n.x * n.x; q.a01 += weight * n.x * n.y; q.a02 += weight * n.x * n.z;
+		q.a11 += weight * n.y * n.y; q.a12 += weight * n.y * n.z; q.a22 += weight * n.z * n.z;
+		q.b0 += weight * n.x * d; q.b1 += weight * n.y * d; q.b2 += weight * n.z * d;
+		q.c += weight * d * d;
+	}
+
+	static void _internalAddQuadric(Quadric& q, const Quadric& other) {
+		q.a00 += other.a00; q.a01 += other.a01; q.a02 += other.a02;
+		q.a11 += other.a11; q.a12 += other.a12; q.a22 += other.a22;
+		q.b0 += other.b0; q.b1 += other.b1; q.b2 += other.b2;
+		q.c += other.c;
+	}
+
+	static double _internalQuadricError(const Quadric& q, const vec3& p) {
+		const double x = p.x, y = p.y, z = p.z;
+		const double error =
+			q.a00 * x * x + 2.0 * q.a01 * x * y + 2.0 * q.a02 * x * z +
+			q.a11 * y * y + 2.0 * q.a12 * y * z + q.a22 * z * z +
+			2.0 * (q.b0 * x + q.b1 * y + q.b2 * z) + q.c;
+		return std::max(error, 0.0);
+	}
+
+	struct PositionHash {
+		size_t operator()(const vec3& p) const {
+			return size_t(_internalHashBytes(0xcbf29ce484222325ull, &p, sizeof(vec3)));
+		}
+	};
+
+	// Quadric error metric simplification (Garland & Heckbert) with half edge collapses, so that every level
+	// only references vertices of the original mesh. Vertices at the same position are collapsed together,
+	// and open borders are kept in place with extra quadrics. Each level has at most half the triangles of the previous one.
+	static std::vector<std::vector<uint32_t>> _internalSimplifyMesh(const std::vector<vec3>& positions, const std::vector<uint32_t>& triangles,
+		std::vector<float>& errors) {
+		const uint32_t MaxLods = 6;
+		const uint32_t MinTriangles = 32;
+		const double BorderWeight = 10.0;
+		std::vector<std::vector<uint32_t>> lods;
+		const uint32_t vertexCount = uint32_t(positions.size());
+		const uint32_t triangleCount = uint32_t(triangles.size() / 3);
+		if (triangleCount < 2 * MinTriangles) {
+			return lods;
+		}
+
+		// Weld vertices by position, the first vertex of each position represents it
+		std::unordered_map<vec3, uint32_t, PositionHash> weld;
+		std::vector<uint32_t> canonical(vertexCount);
+		std::vector<uint32_t> representative;
+		for (uint32_t v = 0; v < vertexCount; v++) {
+			auto it = weld.insert({ positions[v], uint32_t(representative.size()) }).first;
+			if (it->second == representative.size()) {
+				representative.push_back(v);
+			}
+			canonical[v] = it->second;
+		}
+		const uint32_t weldedCount = uint32_t(representative.size());
+		auto position = [&](uint32_t c) -> const vec3& { return positions[representative[c]]; };
+
+		std::vector<uint32_t> corners(triangles.size());
+		for (size_t i = 0; i < triangles.size(); i++) {
+			corners[i] = canonical[triangles[i]];
+		}
+		std::vector<bool> triangleAlive(triangleCount, true);
+		uint32_t aliveCount = triangleCount;
+		std::vector<std::vector<uint32_t>> vertexTriangles(weldedCount);
+		std::vector<Quadric> quadrics(weldedCount);
+		std::unordered_map<uint64_t, uint32_t> edgeUses;
+		for (uint32_t t = 0; t < triangleCount; t++) {
+			const uint32_t* c = &corners[t * 3];
+			if (c[0] == c[1] || c[1] == c[2] || c[0] == c[2]) {
+				triangleAlive[t] = false;
+				aliveCount--;
+				continue;
+			}
+			const glm::dvec3 p0 = position(c[0]), p1 = position(c[1]), p2 = position(c[2]);
+			glm::dvec3 n = glm::cross(p1 - p0, p2 - p0);
+			const double length = glm::length(n);
+			n = length > 0.0 ? n / length : n;
+			for (uint32_t k = 0; k < 3; k++) {
+				_internalAddPlaneQuadric(quadrics[c[k]], n, -glm::dot(n, p0), 1.0);
+				vertexTriangles[c[k]].push_back(t);
+				const uint32_t a = std::min(c[k], c[(k + 1) % 3]), b = std::max(c[k], c[(k + 1) % 3]);
+				edgeUses[(uint64_t(a) << 32) | b]++;
+			}
+		}
+
+		// Borders: plane through the edge, orthogonal to its triangle
+		for (uint32_t t = 0; t < triangleCount; t++) {
+			if (!triangleAlive[t]) {
+				continue;
+			}
+			const uint32_t* c = &corners[t * 3];
+			const glm::dvec3 p0 = position(c[0]), p1 = position(c[1]), p2 = position(c[2]);
+			const glm::dvec3 faceNormal = glm::cross(p1 - p0, p2 - p0);
+			for (uint32_t k = 0; k < 3; k++) {
+				const uint32_t a = c[k], b = c[(k + 1) % 3];
+				if (edgeUses[(uint64_t(std::min(a, b)) << 32) | std::max(a, b)] != 1) {
+					continue;
+				}
+				const glm::dvec3 pa = position(a), pb = position(b);
+				glm::dvec3 n = glm::cross(pb - pa, faceNormal);
+				const double length = glm::length(n);
+				if (length == 0.0) {
+					continue;
+				}
+				n /= length;
+				_internalAddPlaneQuadric(quadrics[a], n, -glm::dot(n, pa), BorderWeight);
+				_internalAddPlaneQuadric(quadrics[b], n, -glm::dot(n, pa), BorderWeight);
+			}
+		}
+
+		// Candidate collapses, in a min heap. Entries are invalidated by bumping the version of their vertices.
+		struct Collapse {
+			double cost;
+			uint32_t from, to;
+			uint32_t fromVersion, toVersion;
+			bool operator<(const Collapse& other) const { return cost > other.cost; }
+		};
+		std::vector<Collapse> heap;
+		std::vector<uint32_t> versions(weldedCount, 0);
+		std::vector<bool> removed(weldedCount, false);
+		auto pushEdge = [&](uint32_t a, uint32_t b) {
+			Quadric q = quadrics[a];
+			_internalAddQuadric(q, quadrics[b]);
+			const double costAB = _internalQuadricError(q, position(b));
+			const double costBA = _internalQuadricError(q, position(a));
+			if (costAB <= costBA) {
+				heap.push_back({ costAB, a, b, versions[a], versions[b] });
+			}
+			else {
+				heap.push_back({ costBA, b, a, versions[b], versions[a] });
+			}
+			std::push_heap(heap.begin(), heap.end());
+		};
+		for (const auto& edge : edgeUses) {
+			pushEdge(uint32_t(edge.first >> 32), uint32_t(edge.first & 0xffffffffu));
+		}
+
+		// A collapse is rejected if it flips or degenerates one of the remaining triangles
+		auto collapseIsValid = [&](uint32_t from, uint32_t to) {
+			for (uint32_t t : vertexTriangles[from]) {
+				const uint32_t* c = &corners[t * 3];
+				if (!triangleAlive[t] || c[0] == to || c[1] == to || c[2] == to) {
+					continue;
+				}
+				vec3 p[3] = { position(c[0]), position(c[1]), position(c[2]) };
+				const vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+				for (uint32_t k = 0; k < 3; k++) {
+					p[k] = c[k] == from ? position(to) : p[k];
+				}
+				const vec3 after = glm::cross(p[1] - p[0], p[2] - p[0]);
+				if (glm::dot(before, after) <= 0.0f) {
+					return false;
+				}
+			}
+			return true;
+		};
+
+		// Current triangles, referencing original vertices: corners keep their own vertex while it is not collapsed
+		auto snapshot = [&]() {
+			std::vector<uint32_t> lod;
+			lod.reserve(aliveCount * 3);
+			for (uint32_t t = 0; t < triangleCount; t++) {
+				if (!triangleAlive[t]) {
+					continue;
+				}
+				for (uint32_t k = 0; k < 3; k++) {
+					const uint32_t original = triangles[t * 3 + k];
+					lod.push_back(canonical[original] == corners[t * 3 + k] ? original : representative[corners[t * 3 + k]]);
+				}
+			}
+			return lod;
+		};
+
+		double maxCost = 0.0;
+		uint32_t target = aliveCount / 2;
+		uint32_t lastCount = aliveCount;
+		while (lods.size() < MaxLods && target >= MinTriangles) {
+			const bool exhausted = heap.empty();
+			if (!exhausted) {
+				std::pop_heap(heap.begin(), heap.end());
+				const Collapse collapse = heap.back();
+				heap.pop_back();
+				if (removed[collapse.from] || removed[collapse.to] ||
+					versions[collapse.from] != collapse.fromVersion || versions[collapse.to] != collapse.toVersion ||
+					!collapseIsValid(collapse.from, collapse.to)) {
+					continue;
+				}
+
+				// Move the triangles of from to to, the ones sharing the edge disappear
+				const uint32_t from = collapse.from, to = collapse.to;
+				for (uint32_t t : vertexTriangles[from]) {
+					if (!triangleAlive[t]) {
+						continue;
+					}
+					uint32_t* c = &corners[t * 3];
+					if (c[0] == to || c[1] == to || c[2] == to) {
+						triangleAlive[t] = false;
+						aliveCount--;
+						continue;
+					}
+					for (uint32_t k = 0; k < 3; k++) {
+						c[k] = c[k] == from ? to : c[k];
+					}
+					vertexTriangles[to].push_back(t);
+				}
+				vertexTriangles[from].clear();
+				removed[from] = true;
+				_internalAddQuadric(quadrics[to], quadrics[from]);
+				versions[to]++;
+				maxCost = std::max(maxCost, collapse.cost);
+
+				// Drop dead triangles of to, and queue its edges again with the new quadric
+				std::vector<uint32_t>& toTriangles = vertexTriangles[to];
+				toTriangles.erase(std::remove_if(toTriangles.begin(), toTriangles.end(), [&](uint32_t t) { return !triangleAlive[t]; }), toTriangles.end());
+				std::sort(toTriangles.begin(), toTriangles.end());
+				toTriangles.erase(std::unique(toTriangles.begin(), toTriangles.end()), toTriangles.end());
+				std::vector<uint32_t> neighbours;
+				for (uint32_t t : toTriangles) {
+					for (uint32_t k = 0; k < 3; k++) {
+						if (corners[t * 3 + k] != to) {
+							neighbours.push_back(corners[t * 3 + k]);
+						}
+					}
+				}
+				std::sort(neighbours.begin(), neighbours.end());
+				neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+				for (uint32_t n : neighbours) {
+					pushEdge(to, n);
+				}
+			}
+
+			// Keep a level each time the triangle count halves, or when nothing can be collapsed anymore
+			if (aliveCount <= target || exhausted) {
+				if (aliveCount < lastCount * 9 / 10) {
+					lods.push_back(snapshot());
+					errors.push_back(float(std::sqrt(maxCost)));
+					lastCount = aliveCount;
+				}
+				if (exhausted) {
+					break;
+				}
+				target = aliveCount / 2;
+			}
+		}
+		return lods;
+	}
+
+	// Builds the coarser levels of detail of a geometry when enabled in the options
+	static void _internalBuildLods(const ObjectDescriptor& objDesc, GeometryInternal& geometry) {
+		if (!scene.options.lods) {
+			return;
+		}
+		std::vector<float> errors;
+		const std::vector<std::vector<uint32_t>> lods = _internalSimplifyMesh(objDesc.vertices, objDesc.triangles, errors);
+		if (lods.empty()) {
+			return;
+		}
+		geometry.lods.push_back({ 0, uint32_t(objDesc.triangles.size()), 0.0f });
+		for (size_t i = 0; i < lods.size(); i++) {
+			geometry.lods.push_back({ uint32_t(geometry.lodTriangles.size()), uint32_t(lods[i].size()), errors[i] });
+			geometry.lodTriangles.insert(geometry.lodTriangles.end(), lods[i].begin(), lods[i].end());
+			geometry.lodTriangles.resize((geometry.lodTriangles.size() + 1) & ~size_t(1)); // keeps 16 bits levels 4 bytes aligned
+		}
+	}
+
+	// Vertex cache misses of the optimized meshes, summed so that a batch is reported once.
+	// ACMR of several meshes is their total misses over their total triangles.
+	struct OptimizationReport {
+		uint32_t meshCount = 0;
+		uint64_t triangleCount = 0;
+		double missesBefore = 0.0;
+		double missesAfter = 0.0;
+
+		void add(const OptimizationReport& other) {
+			meshCount += other.meshCount;
+			triangleCount += other.triangleCount;
+			missesBefore += other.missesBefore;
+			missesAfter += other.missesAfter;
+		}
+	};
+
+	static void _internalLogOptimization(const OptimizationReport& report) {
+		if (report.meshCount == 0) {
+			return;
+		}
+		const double triangles = double(std::max<uint64_t>(report.triangleCount, 1));
+		if (report.meshCount == 1) {
+			std::cout << "Mesh optimized (" << report.triangleCount << " triangles): ACMR ";
+		}
+		else {
+			std::cout << report.meshCount << " meshes optimized (" << report.triangleCount << " triangles): ACMR ";
+		}
+		std::cout << report.missesBefore / triangles << " -> " << report.missesAfter / triangles << std::endl;
+	}
+
+	// Optimizes the descriptor in place when enabled in the options, and keeps the triangle order for picking
+	static void _internalOptimizeGeometry(ObjectDescriptor& objDesc, GeometryInternal& geometry, OptimizationReport& report) {
+		if (!scene.options.optimizeMeshes || objDesc.triangles.size() < 3) {
+			return;
+		}
+		float acmrBefore, acmrAfter;
+		std::vector<uint32_t> triangleOrder = _internalOptimizeMesh(objDesc, acmrBefore, acmrAfter);
+		if (scene.options.picking) {
+			geometry.triangleOrder = std::move(triangleOrder);
+		}
+		const uint32_t triangleCount = uint32_t(objDesc.triangles.size() / 3);
+		report.meshCount++;
+		report.triangleCount += triangleCount;
+		report.missesBefore += double(acmrBefore) * triangleCount;
+		report.missesAfter += double(acmrAfter) * triangleCount;
+	}
+
+	static void _internalOptimizeGeometry(ObjectDescriptor& objDesc, GeometryInternal& geometry) {
+		OptimizationReport report;
+		_internalOptimizeGeometry(objDesc, geometry, report);
+		_internalLogOptimization(report);
+	}
+
+	// Writes position and normal interleaved, four vertices at a time when SSE is available
+	static void _internalInterleaveVertices(const vec3* positions, const vec3* normals, size_t count, vec3* out) {
+		size_t i = 0;
+#ifdef TINYRENDER_SSE
+		// (x[i0], x[i1], y[j0], y[j1])
+#define TINYRENDER_PICK(x, y, i0, i1, j0, j1) _mm_shuffle_ps(x, y, _MM_SHUFFLE(j1, j0, i1, i0))
+		for (; i + 4 <= count; i += 4) {
+			const float* p = &positions[i].x;
+			const float* n = &normals[i].x;
+			const __m128 p0 = _mm_loadu_ps(p), p1 = _mm_loadu_ps(p + 4), p2 = _mm_loadu_ps(p + 8);
+			const __m128 n0 = _mm_loadu_ps(n), n1 = _mm_loadu_ps(n + 4), n2 = _mm_loadu_ps(n + 8);
+			float* o = &out[i * 2].x;
+			_mm_storeu_ps(o + 0, TINYRENDER_PICK(p0, TINYRENDER_PICK(p0, n0, 2, 2, 0, 0), 0, 1, 0, 2));
+			_mm_storeu_ps(o + 4, TINYRENDER_PICK(n0, TINYRENDER_PICK(p0, p1, 3, 3, 0, 0), 1, 2, 0, 2));
+			_mm_storeu_ps(o + 8, TINYRENDER_PICK(TINYRENDER_PICK(p1, n0, 1, 1, 3, 3), n1, 0, 2, 0, 1));
+			_mm_storeu_ps(o + 12, TINYRENDER_PICK(p1, TINYRENDER_PICK(p2, n1, 0, 0, 2, 2), 2, 3, 0, 2));
+			_mm_storeu_ps(o + 16, TINYRENDER_PICK(TINYRENDER_PICK(n1, n2, 3, 3, 0, 0), p2, 0, 2, 1, 2));
+			_mm_storeu_ps(o + 20, TINYRENDER_PICK(TINYRENDER_PICK(p2, n2, 3, 3, 1, 1), n2, 0, 2, 2, 3));
+		}
+#undef TINYRENDER_PICK
+#endif
+		for (; i < count; i++) {
+			out[(i * 2) + 0] = positions[i];
+			out[(i * 2) + 1] = normals[i];
+		}
+	}
+
+	// Size of the index data in 4 bytes units, indexed on 16 bits whenever the vertex count allows it.
+	// Coarser levels of detail are stored after the full mesh.
+	static uint64_t _internalIndexUnits(const ObjectDescriptor& objDesc, const GeometryInternal& geometry) {
+		if (objDesc.vertices.size() <= 65536) {
+			return (objDesc.triangles.size() + 1) / 2 + geometry.lodTriangles.size() / 2; // writes must be a multiple of 4 bytes
+		}
+		return objDesc.triangles.size() + geometry.lodTriangles.size();
+	}
+
+	static uint64_t _internalVertexStride(bool quantized) {
+		return quantized ? sizeof(QuantizedVertex) : sizeof(VertexAttributes);
+	}
+
+	// Octahedral mapping of a unit vector to [-1, 1]^2
+	static glm::vec2 _internalEncodeOctahedral(vec3 n) {
+		n /= std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+		glm::vec2 e = glm::vec2(n.x, n.y);
+		if (n.z < 0.0f) {
+			e.x = (1.0f - std::abs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+			e.y = (1.0f - std::abs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+		}
+		return e;
+	}
+
+	// Positions are quantized in the bounding box. Normals are stored in the same [0, 1] space
+	// (scaled by the box extent), so that the cofactor matrix in the shader maps them back to the right direction.
+	static void _internalQuantizeVertices(const ObjectDescriptor& objDesc, const GeometryInternal& geometry, QuantizedVertex* out) {
+		const mat4 dequantize = _internalDequantizeMatrix(geometry);
+		const vec3 scale = vec3(dequantize[0][0], dequantize[1][1], dequantize[2][2]);
+		for (size_t i = 0; i < objDesc.vertices.size(); i++) {
+			const vec3 q = glm::clamp((objDesc.vertices[i] - geometry.boundsMin) / scale, 0.0f, 1.0f);
+			const vec3 n = objDesc.normals[i] * scale;
+			const glm::vec2 e = glm::dot(n, n) > 0.0f ? _internalEncodeOctahedral(n) : glm::vec2(0.0f);
+			out[i].position[0] = uint16_t(std::lround(q.x * 65535.0f));
+			out[i].position[1] = uint16_t(std::lround(q.y * 65535.0f));
+			out[i].position[2] = uint16_t(std::lround(q.z * 65535.0f));
+			out[i].position[3] = 0;
+			out[i].normal[0] = int16_t(std::lround(glm::clamp(e.x, -1.0f, 1.0f) * 32767.0f));
+			out[i].normal[1] = int16_t(std::lround(glm::clamp(e.y, -1.0f, 1.0f) * 32767.0f));
+		}
+	}
+
+	// Fills everything but the arena allocations and the picking copy, and packs vertex and index data for upload.
+	// Only touches CPU memory, so several geometries can be packed in parallel.
+	static void _internalPackGeometry(const ObjectDescriptor& objDesc, GeometryInternal& geometry, void* vertexData, uint32_t* indexData) {
+		// Local bounds, used for culling and quantization
+		geometry.boundsMin = objDesc.vertices.empty() ? vec3(0) : objDesc.vertices[0];
+		geometry.boundsMax = geometry.boundsMin;
+		for (const vec3& v : objDesc.vertices) {
+			geometry.boundsMin = glm::min(geometry.boundsMin, v);
+			geometry.boundsMax = glm::max(geometry.boundsMax, v);
+		}
+
+		geometry.quantized = objDesc.quantized;
+		if (geometry.quantized) {
+			_internalQuantizeVertices(objDesc, geometry, static_cast<QuantizedVertex*>(vertexData));
+		}
+		else {
+			// Interleaved position & normal
+			_internalInterleaveVertices(objDesc.vertices.data(), objDesc.normals.data(), objDesc.vertices.size(), static_cast<vec3*>(vertexData));
+		}
+
+		geometry.drawCount = uint32_t(objDesc.triangles.size());
+		uint32_t lodStart = uint32_t(objDesc.triangles.size());
+		if (objDesc.vertices.size() <= 65536) {
+			geometry.indexFormat = IndexFormat::Uint16;
+			uint16_t* packed = reinterpret_cast<uint16_t*>(indexData);
+			std::copy(objDesc.triangles.begin(), objDesc.triangles.end(), packed);
+			if (objDesc.triangles.size() % 2 == 1) {
+				packed[lodStart++] = 0;
+			}
+			std::copy(geometry.lodTriangles.begin(), geometry.lodTriangles.end(), packed + lodStart);
+		}
+		else {
+			geometry.indexFormat = IndexFormat::Uint32;
+			std::copy(objDesc.triangles.begin(), objDesc.triangles.end(), indexData);
+			std::copy(geometry.lodTriangles.begin(), geometry.lodTriangles.end(), indexData + lodStart);
+		}
+		for (size_t i = 1; i < geometry.lods.size(); i++) {
+			geometry.lods[i].firstIndex += lodStart;
+		}
+		geometry.lodTriangles = {};
+	}
+
+	static MappedUpload _internalBeginMappedUpload(uint64_t vertexCount, uint64_t vertexStride, uint64_t indexCapacity) {
+		MappedUpload upload;
+		upload.vertexCount = vertexCount;
+		upload.vertexStride = vertexStride;
+		upload.indexCapacity = indexCapacity;
+		const uint64_t vertexBytes = vertexCount * vertexStride;
+		const uint64_t size = std::max<uint64_t>(4, vertexBytes + indexCapacity * sizeof(uint32_t));
+
+		BufferDescriptor bufferDesc;
+		bufferDesc.label = "Geometry upload";
+		bufferDesc.size = size;
+		bufferDesc.usage = BufferUsage::MapWrite | BufferUsage::CopySrc;
+		bufferDesc.mappedAtCreation = true;
+		upload.buffer = scene.device.createBuffer(bufferDesc);
+		uint8_t* data = static_cast<uint8_t*>(upload.buffer.getMappedRange(0, size));
+		upload.vertexData = data;
+		upload.indexData = reinterpret_cast<uint32_t*>(data + vertexBytes);
+		return upload;
+	}
+
+	// Allocates the geometry in the arenas and copies the packed data there. indexUnits can be less than the
+	// capacity of the upload, when indices were packed on 16 bits in place.
+	static void _internalEndMappedUpload(MappedUpload& upload, GeometryInternal& geometry, uint64_t indexUnits) {
+		upload.buffer.unmap();
+		GpuArena& vertexArena = _internalVertexArena(geometry.quantized);
+		geometry.vertexAlloc = _internalArenaAllocate(vertexArena, upload.vertexCount);
+		geometry.indexAlloc = _internalArenaAllocate(scene.indexArena, indexUnits);
+
+		CommandEncoderDescriptor encoderDesc = {};
+		encoderDesc.label = "Geometry upload encoder";
+		CommandEncoder encoder = wgpuDeviceCreateCommandEncoder(scene.device, &encoderDesc);
+		const uint64_t vertexBytes = upload.vertexCount * upload.vertexStride;
+		if (vertexBytes > 0) {
+			encoder.copyBufferToBuffer(upload.buffer, 0,
+				vertexArena.blocks[geometry.vertexAlloc.block].buffer, geometry.vertexAlloc.offset * vertexArena.unitSize,
+				vertexBytes);
+		}
+		if (indexUnits > 0) {
+			encoder.copyBufferToBuffer(upload.buffer, vertexBytes,
+				scene.indexArena.blocks[geometry.indexAlloc.block].buffer, geometry.indexAlloc.offset * scene.indexArena.unitSize,
+				indexUnits * sizeof(uint32_t));
+		}
+		CommandBufferDescriptor cmdBufferDescriptor = {};
+		cmdBufferDescriptor.label = "Geometry upload command buffer";
+		CommandBuffer command = encoder.finish(cmdBufferDescriptor);
+		encoder.release();
+		scene.queue.submit(1, &command);
+		command.release();
+
+		// Still referenced by the submitted copy, which keeps it alive until it is done
+		upload.buffer.release();
+	}
+
+	// Large geometries are packed straight into mapped memory, without an intermediate copy
+	static GeometryInternal _internalCreateGeometry(ObjectDescriptor&& objDesc);
+
+	static GeometryInternal _internalCreateGeometry(const ObjectDescriptor& objDesc) {
+		const uint64_t LargeGeometryBytes = 1 << 20;
+		if (scene.options.optimizeMeshes) {
+			ObjectDescriptor optimized = objDesc;
+			return _internalCreateGeometry(std::move(optimized));
+		}
+		GeometryInternal geometry;
+		_internalBuildLods(objDesc, geometry);
+		const uint64_t vertexStride = _internalVertexStride(objDesc.quantized);
+		if (objDesc.vertices.size() * vertexStride >= LargeGeometryBytes) {
+			MappedUpload upload = _internalBeginMappedUpload(objDesc.vertices.size(), vertexStride, _internalIndexUnits(objDesc, geometry));
+			_internalPackGeometry(objDesc, geometry, upload.vertexData, upload.indexData);
+			_internalEndMappedUpload(upload, geometry, upload.indexCapacity);
+		}
+		else {
+			std::vector<uint8_t> vertexData(objDesc.vertices.size() * vertexStride);
+			std::vector<uint32_t> indexData(_internalIndexUnits(objDesc, geometry));
+			_internalPackGeometry(objDesc, geometry, vertexData.data(), indexData.data());
+
+			// Vertex data is drawn with baseVertex = offset in the arena block
+			GpuArena& vertexArena = _internalVertexArena(geometry.quantized);
+			geometry.vertexAlloc = _internalArenaAllocate(vertexArena, objDesc.vertices.size());
+			_internalArenaWrite(vertexArena, geometry.vertexAlloc, vertexData.data(), vertexData.size());
+			geometry.indexAlloc = _internalArenaAllocate(scene.indexArena, indexData.size());
+			_internalArenaWrite(scene.indexArena, geometry.indexAlloc, indexData.data(), indexData.size() * sizeof(uint32_t));
+		}
+		if (scene.options.picking) {
+			geometry.positions = objDesc.vertices;
+			geometry.triangles = objDesc.triangles;
+		}
+		return geometry;
+	}
+
+	// Same as _internalCreateGeometry, the descriptor data is moved to the picking copy instead of copied
+	static GeometryInternal _internalCreateGeometry(ObjectDescriptor&& objDesc) {
+		GeometryInternal geometry;
+		_internalOptimizeGeometry(objDesc, geometry);
+		_internalBuildLods(objDesc, geometry);
+		MappedUpload upload = _internalBeginMappedUpload(objDesc.vertices.size(), _internalVertexStride(objDesc.quantized), _internalIndexUnits(objDesc, geometry));
+		_internalPackGeometry(objDesc, geometry, upload.vertexData, upload.indexData);
+		_internalEndMappedUpload(upload, geometry, upload.indexCapacity);
+		if (scene.options.picking) {
+			geometry.positions = std::move(objDesc.vertices);
+			geometry.triangles = std::move(objDesc.triangles);
+		}
+		return geometry;
+	}
+
+	// Interleaved attributes and 32 bits indices from the caller, copied once into the upload buffer.
+	// Bounds and the picking copy are computed from the caller's data: the mapped memory is write-combined.
+	static GeometryInternal _internalCreateGeometry(MappedUpload& upload, const VertexAttributes* vertices, const uint32_t* triangles, uint64_t indexCount) {
+		GeometryInternal geometry;
+		geometry.boundsMin = upload.vertexCount == 0 ? vec3(0) : vertices[0].position;
+		geometry.boundsMax = geometry.boundsMin;
+		for (uint64_t i = 0; i < upload.vertexCount; i++) {
+			geometry.boundsMin = glm::min(geometry.boundsMin, vertices[i].position);
+			geometry.boundsMax = glm::max(geometry.boundsMax, vertices[i].position);
+		}
+		memcpy(upload.vertexData, vertices, upload.vertexCount * sizeof(VertexAttributes));
+		if (scene.options.picking) {
+			geometry.positions.resize(upload.vertexCount);
+			for (uint64_t i = 0; i < upload.vertexCount; i++) {
+				geometry.positions[i] = vertices[i].position;
+			}
+			geometry.triangles.assign(triangles, triangles + indexCount);
+		}
+
+		geometry.drawCount = uint32_t(indexCount);
+		uint64_t indexUnits = indexCount;
+		if (upload.vertexCount <= 65536) {
+			geometry.indexFormat = IndexFormat::Uint16;
+			std::vector<uint16_t> packed(indexCount + 1, 0); // writes must be a multiple of 4 bytes
+			std::copy(triangles, triangles + indexCount, packed.begin());
+			indexUnits = (indexCount + 1) / 2;
+			memcpy(upload.indexData, packed.data(), indexUnits * sizeof(uint32_t));
+		}
+		else {
+			geometry.indexFormat = IndexFormat::Uint32;
+			memcpy(upload.indexData, triangles, indexCount * sizeof(uint32_t));
+		}
+		_internalEndMappedUpload(upload, geometry, indexUnits);
+		return geometry;
+	}
+
+	// Geometry written by the caller in place in the upload buffer, with the bounds it provides.
+	// Indices stay on 32 bits, packing them would read the mapped memory back.
+	static GeometryInternal _internalCreateGeometry(MappedUpload& upload, uint64_t indexCount, const vec3& boundsMin, const vec3& boundsMax) {
+		GeometryInternal geometry;
+		geometry.boundsMin = boundsMin;
+		geometry.boundsMax = boundsMax;
+		geometry.drawCount = uint32_t(indexCount);
+		geometry.indexFormat = IndexFormat::Uint32;
+		_internalEndMappedUpload(upload, geometry, indexCount);
+		return geometry;
+	}
+
+	static void _internalDestroyGeometry(GeometryInternal& geometry) {
+		_internalArenaFree(_internalVertexArena(geometry.quantized), geometry.vertexAlloc);
+		_internalArenaFree(scene.indexArena, geometry.indexAlloc);
+	}
+
+	// Geometries are counted by vertex format, to know which object pipelines are needed
+	static GeometryInternal& _internalInsertGeometry(GeometryInternal&& geometry) {
+		scene.geometryCounts[geometry.quantized]++;
+		const uint64_t hash = geometry.key.hash;
+		return geometries.insert({ hash, std::move(geometry) }).first->second;
+	}
+
+	// Returns the cached geometry with the same content as key, or nullptr with key.hash moved past the colliding
+	// geometries to a free map key
+	static GeometryInternal* _internalFindGeometry(GeometryKey& key) {
+		for (;;) {
+			auto it = geometries.find(key.hash);
+			if (it == geometries.end()) {
+				return nullptr;
+			}
+			if (_internalSameGeometry(it->second.key, key)) {
+				return &it->second;
+			}
+			key.hash = _internalNextGeometryHash(key.hash);
+		}
+	}
+
+	// Returns the cached geometry for key, building its descriptor and uploading it on a cache miss
+	template<typename DescriptorBuilder>
+	static GeometryInternal* _internalAcquireGeometry(GeometryKey key, DescriptorBuilder buildDescriptor) {
+		GeometryInternal* geometry = _internalFindGeometry(key);
+		if (!geometry) {
+			GeometryInternal created = _internalCreateGeometry(buildDescriptor());
+			created.key = key;
+			geometry = &_internalInsertGeometry(std::move(created));
+		}
+		geometry->refCount++;
+		return geometry;
+	}
+
+	static GeometryInternal* _internalAcquireGeometry(const ObjectDescriptor& objDesc) {
+		return _internalAcquireGeometry(
+			_internalHashDescriptor(objDesc),
+			[&]() -> const ObjectDescriptor& { return objDesc; }
+		);
+	}
+
+	static GeometryInternal* _internalAcquireGeometry(ObjectDescriptor&& objDesc) {
+		GeometryKey key = _internalHashDescriptor(objDesc);
+		GeometryInternal* geometry = _internalFindGeometry(key);
+		if (!geometry) {
+			GeometryInternal created = _internalCreateGeometry(std::move(objDesc));
+			created.key = key;
+			geometry = &_internalInsertGeometry(std::move(created));
+		}
+		geometry->refCount++;
+		return geometry;
+	}
+
+	// Geometry uploaded in place is not hashed, it gets a key of its own and is never shared
+	static GeometryInternal* _internalAcquireGeometry(GeometryInternal&& geometry) {
+		geometry.key = _internalUploadKey(scene.nextUploadKey++);
+		while (geometries.count(geometry.key.hash) != 0) {
+			geometry.key.hash = _internalNextGeometryHash(geometry.key.hash);
+		}
+		GeometryInternal& inserted = _internalInsertGeometry(std::move(geometry));
+		inserted.refCount++;
+		return &inserted;
+	}
+
+	// GPU memory is only freed when the last user of the geometry goes away
+	static void _internalReleaseGeometry(GeometryInternal* geometry) {
+		assert(geometry->refCount > 0);
+		if (--geometry->refCount == 0) {
+			scene.geometryCounts[geometry->quantized]--;
+			_internalDestroyGeometry(*geometry);
+			geometries.erase(geometry->key.hash);
+		}
+	}
+
+	// Takes a slot in the shared transform buffer, reusing freed ones first
+	static uint32_t _internalAcquireObjectSlot() {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		uint32_t slot;
+		if (!transforms.freeSlots.empty()) {
+			slot = transforms.freeSlots.back();
+			transforms.freeSlots.pop_back();
+		}
+		else {
+			slot = uint32_t(transforms.uniforms.size());
+			transforms.uniforms.push_back({});
+			transforms.centerX.push_back(0.0f);
+			transforms.centerY.push_back(0.0f);
+			transforms.centerZ.push_back(0.0f);
+			transforms.extentX.push_back(0.0f);
+			transforms.extentY.push_back(0.0f);
+			transforms.extentZ.push_back(0.0f);
+			transforms.objectIds.push_back(UINT32_MAX);
+			transforms.lodScale.push_back(1.0f);
+			transforms.lod.push_back(0);
+			for (std::vector<float>* v : { &transforms.translationX, &transforms.translationY, &transforms.translationZ,
+				&transforms.rotationX, &transforms.rotationY, &transforms.rotationZ }) {
+				v->push_back(0.0f);
+			}
+			for (std::vector<float>* v : { &transforms.scaleX, &transforms.scaleY, &transforms.scaleZ }) {
+				v->push_back(1.0f);
+			}
+			transforms.local.push_back(mat4(1.0f));
+			transforms.world.push_back(mat4(1.0f));
+			transforms.geometries.push_back(nullptr);
+			transforms.pending.push_back(0);
+			transforms.parent.push_back(UINT32_MAX);
+			transforms.firstChild.push_back(UINT32_MAX);
+			transforms.nextSibling.push_back(UINT32_MAX);
+			transforms.depth.push_back(0);
+		}
+		return slot;
+	}
+
+	static bool _internalIsObjectAlive(uint32_t handle) {
+		const uint32_t index = handle & ObjectIndexMask;
+		return index < objects.sparse.size() && objects.sparse[index] != UINT32_MAX && objects.generations[index] == handle >> ObjectIndexBits;
+	}
+
+	static ObjectInternal& _internalGetObject(uint32_t handle) {
+		assert(_internalIsObjectAlive(handle));
+		return objects.dense[objects.sparse[handle & ObjectIndexMask]];
+	}
+
+	// Appends an object to the dense array and returns its handle
+	// Handles hold ObjectIndexBits of index: creating objects past that limit fails with an error instead of
+	// overflowing into the generation bits
+	static bool _internalCanInsertObjects(uint64_t count) {
+		const uint64_t available = uint64_t(ObjectIndexMask) - objects.sparse.size() + objects.freeIndices.size();
+		if (count > available) {
+			std::cerr << "Error: too many objects, at most " << ObjectIndexMask << " can be alive at once" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	static uint32_t _internalInsertObject(const ObjectInternal& obj) {
+		uint32_t index;
+		if (objects.freeIndices.size() > MinFreeObjectIndices || objects.sparse.size() >= ObjectIndexMask) {
+			index = objects.freeIndices.front();
+			objects.freeIndices.pop_front();
+		}
+		else {
+			// The last index is never used, so that no handle is UINT32_MAX
+			index = uint32_t(objects.sparse.size());
+			assert(index < ObjectIndexMask);
+			objects.sparse.push_back(UINT32_MAX);
+			objects.generations.push_back(0);
+		}
+		const uint32_t handle = (objects.generations[index] << ObjectIndexBits) | index;
+		objects.sparse[index] = uint32_t(objects.dense.size());
+		objects.dense.push_back(obj);
+		objects.denseHandles.push_back(handle);
+		scene.objectTransforms.objectIds[obj.slot] = handle;
+		return handle;
+	}
+
+	// Moves the last object in the place of the removed one
+	static void _internalEraseObject(uint32_t handle) {
+		const uint32_t index = handle & ObjectIndexMask;
+		const uint32_t position = objects.sparse[index];
+		const uint32_t lastHandle = objects.denseHandles.back();
+		objects.dense[position] = objects.dense.back();
+		objects.denseHandles[position] = lastHandle;
+		objects.sparse[lastHandle & ObjectIndexMask] = position;
+		objects.dense.pop_back();
+		objects.denseHandles.pop_back();
+
+		objects.sparse[index] = UINT32_MAX;
+		objects.generations[index] = (objects.generations[index] + 1) & ObjectGenerationMask;
+		objects.freeIndices.push_back(index);
+	}
+
+	static uint32_t _internalCreateObject(GeometryInternal* geometry, const vec3& t, const vec3& r, const vec3& s) {
+		if (!_internalCanInsertObjects(1)) {
+			_internalReleaseGeometry(geometry);
+			return UINT32_MAX;
+		}
+		ObjectInternal newObj;
+		newObj.geometry = geometry;
+		newObj.slot = _internalAcquireObjectSlot();
+		scene.sceneBvh.needsRebuild = true;
+		scene.gpuCulling.commandsDirty = true;
+		scene.drawBundle.dirty = true;
+		scene.objectTransforms.geometries[newObj.slot] = geometry;
+		_internalSetLocalTransform(newObj.slot, t, r, s);
+		return _internalInsertObject(newObj);
+	}
+
+	// Uploads allocations sorted by block and offset, merging the ones that are adjacent in the arena into a single write.
+	// data holds the packed allocations back to back, in the same order.
+	static void _internalArenaWriteMerged(GpuArena& arena, const ArenaAllocation* allocations, size_t count, const uint8_t* data) {
+		size_t first = 0;
+		uint64_t dataOffset = 0;
+		while (first < count) {
+			size_t last = first + 1;
+			uint64_t units = allocations[first].size;
+			while (last < count && allocations[last].block == allocations[first].block &&
+				allocations[last].offset == allocations[first].offset + units) {
+				units += allocations[last].size;
+				last++;
+			}
+			_internalArenaWrite(arena, allocations[first], data + dataOffset, units * arena.unitSize);
+			dataOffset += units * arena.unitSize;
+			first = last;
+		}
+	}
+
+	// Creates the geometries of a batch of descriptors: descriptors are hashed and packed in parallel,
+	// and vertex and index data are uploaded with a few large writes.
+	static std::vector<GeometryInternal*> _internalAcquireGeometries(const ObjectDescriptor* objDescs, uint32_t count) {
+		std::vector<GeometryKey> keys(count);
+		_internalParallelFor(_internalWorkerCount(), [&](uint32_t worker) {
+			for (uint32_t i = worker; i < count; i += _internalWorkerCount()) {
+				keys[i] = _internalHashDescriptor(objDescs[i]);
+			}
+		});
+
+		// Geometries missing from the cache, each created once even if the batch holds duplicates.
+		// Colliding keys move on to the next map key, past both the cache and the new geometries of the batch.
+		std::vector<uint32_t> newDescs;
+		std::unordered_map<uint64_t, uint32_t> newKeys;
+		for (uint32_t i = 0; i < count; i++) {
+			GeometryKey& key = keys[i];
+			while (!_internalFindGeometry(key)) {
+				auto it = newKeys.find(key.hash);
+				if (it == newKeys.end()) {
+					newKeys.insert({ key.hash, uint32_t(newDescs.size()) });
+					newDescs.push_back(i);
+					break;
+				}
+				if (_internalSameGeometry(keys[newDescs[it->second]], key)) {
+					break;
+				}
+				key.hash = _internalNextGeometryHash(key.hash);
+			}
+		}
+
+		// Mesh optimization and levels of detail change the index data, they are done before allocating
+		const uint32_t newCount = uint32_t(newDescs.size());
+		std::vector<GeometryInternal> newGeometries(newCount);
+		std::vector<ObjectDescriptor> optimized(scene.options.optimizeMeshes ? newCount : 0);
+		auto newDescriptor = [&](uint32_t i) -> const ObjectDescriptor& {
+			return scene.options.optimizeMeshes ? optimized[i] : objDescs[newDescs[i]];
+		};
+		std::vector<OptimizationReport> reports(_internalWorkerCount());
+		_internalParallelFor(_internalWorkerCount(), [&](uint32_t worker) {
+			for (uint32_t i = worker; i < newCount; i += _internalWorkerCount()) {
+				if (scene.options.optimizeMeshes) {
+					optimized[i] = objDescs[newDescs[i]];
+					_internalOptimizeGeometry(optimized[i], newGeometries[i], reports[worker]);
+				}
+				_internalBuildLods(newDescriptor(i), newGeometries[i]);
+			}
+		});
+		for (uint32_t worker = 1; worker < reports.size(); worker++) {
+			reports[0].add(reports[worker]);
+		}
+		_internalLogOptimization(reports[0]);
+
+		// Allocate first, then sort by position in the arenas so that neighbour allocations share a write
+		for (uint32_t i = 0; i < newCount; i++) {
+			const ObjectDescriptor& objDesc = newDescriptor(i);
+			newGeometries[i].quantized = objDesc.quantized;
+			newGeometries[i].vertexAlloc = _internalArenaAllocate(_internalVertexArena(objDesc.quantized), objDesc.vertices.size());
+			newGeometries[i].indexAlloc = _internalArenaAllocate(scene.indexArena, _internalIndexUnits(objDesc, newGeometries[i]));
+		}
+		auto sortedOrder = [&](ArenaAllocation GeometryInternal::* alloc) {
+			std::vector<uint32_t> order(newCount);
+			for (uint32_t i = 0; i < newCount; i++) {
+				order[i] = i;
+			}
+			std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+				const ArenaAllocation& allocA = newGeometries[a].*alloc;
+				const ArenaAllocation& allocB = newGeometries[b].*alloc;
+				const bool quantizedA = alloc == &GeometryInternal::vertexAlloc && newGeometries[a].quantized;
+				const bool quantizedB = alloc == &GeometryInternal::vertexAlloc && newGeometries[b].quantized;
+				if (quantizedA != quantizedB) {
+					return quantizedB;
+				}
+				return allocA.block != allocB.block ? allocA.block < allocB.block : allocA.offset < allocB.offset;
+			});
+			return order;
+		};
+		const std::vector<uint32_t> vertexOrder = sortedOrder(&GeometryInternal::vertexAlloc);
+		const std::vector<uint32_t> indexOrder = sortedOrder(&GeometryInternal::indexAlloc);
+
+		// Offsets of each geometry in the packed data: float vertices come first, then quantized ones
+		std::vector<uint64_t> vertexOffsets(newCount), indexOffsets(newCount);
+		std::vector<ArenaAllocation> vertexAllocs(newCount), indexAllocs(newCount);
+		uint64_t vertexBytes = 0, floatVertexBytes = 0, indexUnits = 0;
+		uint32_t floatCount = 0;
+		for (uint32_t i = 0; i < newCount; i++) {
+			const GeometryInternal& geometry = newGeometries[vertexOrder[i]];
+			if (!geometry.quantized) {
+				floatCount = i + 1;
+				floatVertexBytes = vertexBytes + geometry.vertexAlloc.size * sizeof(VertexAttributes);
+			}
+			vertexOffsets[vertexOrder[i]] = vertexBytes;
+			vertexAllocs[i] = geometry.vertexAlloc;
+			vertexBytes += geometry.vertexAlloc.size * _internalVertexStride(geometry.quantized);
+			indexOffsets[indexOrder[i]] = indexUnits;
+			indexAllocs[i] = newGeometries[indexOrder[i]].indexAlloc;
+			indexUnits += indexAllocs[i].size;
+		}
+
+		std::vector<uint8_t> vertexData(vertexBytes);
+		std::vector<uint32_t> indexData(indexUnits);
+		_internalParallelFor(_internalWorkerCount(), [&](uint32_t worker) {
+			for (uint32_t i = worker; i < newCount; i += _internalWorkerCount()) {
+				const ObjectDescriptor& objDesc = newDescriptor(i);
+				_internalPackGeometry(objDesc, newGeometries[i], &vertexData[vertexOffsets[i]], &indexData[indexOffsets[i]]);
+				if (scene.options.picking) {
+					newGeometries[i].positions = objDesc.vertices;
+					newGeometries[i].triangles = objDesc.triangles;
+				}
+			}
+		});
+		_internalArenaWriteMerged(scene.vertexArena, vertexAllocs.data(), floatCount, vertexData.data());
+		_internalArenaWriteMerged(scene.quantizedVertexArena, vertexAllocs.data() + floatCount, newCount - floatCount, vertexData.data() + floatVertexBytes);
+		_internalArenaWriteMerged(scene.indexArena, indexAllocs.data(), newCount, reinterpret_cast<const uint8_t*>(indexData.data()));
+
+		for (uint32_t i = 0; i < newCount; i++) {
+			newGeometries[i].key = keys[newDescs[i]];
+			_internalInsertGeometry(std::move(newGeometries[i]));
+		}
+
+		std::vector<GeometryInternal*> result(count);
+		for (uint32_t i = 0; i < count; i++) {
+			GeometryInternal& geometry = geometries.at(keys[i].hash);
+			geometry.refCount++;
+			result[i] = &geometry;
+		}
+		return result;
+	}
+
+	// Transforms of a batch are composed with the others at the next frame
+	static void _internalCreateObjects(const ObjectDescriptor* objDescs, uint32_t count, uint32_t* ids) {
+		if (!_internalCanInsertObjects(count)) {
+			std::fill(ids, ids + count, UINT32_MAX);
+			return;
+		}
+		const std::vector<GeometryInternal*> batchGeometries = _internalAcquireGeometries(objDescs, count);
+
+		for (uint32_t i = 0; i < count; i++) {
+			ObjectInternal newObj;
+			newObj.geometry = batchGeometries[i];
+			newObj.slot = _internalAcquireObjectSlot();
+			scene.objectTransforms.geometries[newObj.slot] = newObj.geometry;
+			_internalSetLocalTransform(newObj.slot, objDescs[i].translation, objDescs[i].rotation, objDescs[i].scale);
+			ids[i] = _internalInsertObject(newObj);
+		}
+		scene.sceneBvh.needsRebuild = true;
+		scene.sceneBvh.refitSlots.clear();
+		scene.gpuCulling.commandsDirty = true;
+		scene.drawBundle.dirty = true;
+	}
+
+	static uint32_t _internalCreateMesh(GeometryInternal* geometry) {
+		MeshInternal newMesh;
+		newMesh.geometry = geometry;
+
+		uint32_t id = nextMeshId++;
+		meshes.insert({ id, newMesh });
+		return id;
+	}
+
+	static void _internalResizeInstanceBuffer(MeshInternal& mesh, uint32_t capacity) {
+		if (mesh.instanceBuffer) {
+			mesh.instanceBuffer.destroy();
+			mesh.instanceBuffer.release();
+			mesh.bindGroup.release();
+		}
+		mesh.instanceCapacity = capacity;
+
+		BufferDescriptor bufferDesc;
+		bufferDesc.size = capacity * sizeof(ObjectUniforms);
+		bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Storage;
+		bufferDesc.mappedAtCreation = false;
+		mesh.instanceBuffer = scene.device.createBuffer(bufferDesc);
+
+		BindGroupEntry binding{};
+		binding.binding = 0;
+		binding.buffer = mesh.instanceBuffer;
+		binding.offset = 0;
+		binding.size = bufferDesc.size;
+
+		BindGroupDescriptor bindGroupDesc;
+		bindGroupDesc.layout = scene.bindGroupLayouts[1];
+		bindGroupDesc.entryCount = 1;
+		bindGroupDesc.entries = &binding;
+		mesh.bindGroup = scene.device.createBindGroup(bindGroupDesc);
+		scene.drawBundle.dirty = true;
+	}
+
+	static void _internalUploadInstances(MeshInternal& mesh) {
+		const uint32_t count = uint32_t(mesh.instances.size());
+		if (count > mesh.instanceCapacity) {
+			// Grow geometrically to amortize reallocations when instances are added one by one
+			_internalResizeInstanceBuffer(mesh, std::max(count, 2 * mesh.instanceCapacity));
+		}
+		_internalStageWrite(mesh.instanceBuffer, 0, mesh.instances.data(), count * sizeof(ObjectUniforms));
+		mesh.dirty = false;
+	}
+
+	static void _internalDestroyMesh(MeshInternal& mesh) {
+		_internalReleaseGeometry(mesh.geometry);
+		if (mesh.instanceBuffer) {
+			mesh.instanceBuffer.destroy();
+			mesh.instanceBuffer.release();
+			mesh.bindGroup.release();
+		}
+	}
+
+	static void _internalRenderProfilerGui() {
+		const Profiler& profiler = scene.profiler;
+		ImGui::Begin("Profiler", &scene.showProfiler);
+		{
+			// Frame time history, CPU phases only
+			std::vector<float> frameTimes;
+			frameTimes.reserve(profiler.history.size());
+			for (const ProfileFrame& frame : profiler.history) {
+				double total = 0.0;
+				for (uint32_t p = 0; p < ProfileGpuCulling; p++) {
+					total += frame.totalUs[p];
+				}
+				frameTimes.push_back(float(total / 1000.0));
+			}
+			ImGui::PlotLines("CPU ms", frameTimes.data(), int(frameTimes.size()), 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 60));
+
+			// Average and maximum per phase over the history
+			if (ImGui::BeginTable("Phases", 3)) {
+				ImGui::TableSetupColumn("Phase");
+				ImGui::TableSetupColumn("Avg ms");
+				ImGui::TableSetupColumn("Max ms");
+				ImGui::TableHeadersRow();
+				for (uint32_t p = 0; p < ProfilePhaseCount; p++) {
+					if (p >= ProfileGpuCulling && !profiler.timestamps) {
+						continue;
+					}
+					double sum = 0.0, max = 0.0;
+					for (const ProfileFrame& frame : profiler.history) {
+						sum += frame.totalUs[p];
+						max = std::max(max, frame.totalUs[p]);
+					}
+					const double count = double(std::max<size_t>(1, profiler.history.size()));
+					ImGui::TableNextRow();
+					ImGui::TableNextColumn();
+					ImGui::TextUnformatted(ProfilePhaseNames[p]);
+					ImGui::TableNextColumn();
+					ImGui::Text("%.3f", sum / count / 1000.0);
+					ImGui::TableNextColumn();
+					ImGui::Text("%.3f", max / 1000.0);
+				}
+				ImGui::EndTable();
+			}
+			if (!profiler.timestamps) {
+				ImGui::TextUnformatted("GPU timestamps not supported by the adapter");
+			}
+			if (ImGui::Button("Export Chrome trace")) {
+				exportChromeTrace("tinyrender_trace.json");
+			}
+		}
+		ImGui::End();
+	}
+
+	static void _internalRenderGui() {
+		ImGui::Begin("tinyrenderwgpu");
+		{
+			ImGui::Text("Dt= %.1f ms", ImGui::GetIO().DeltaTime * 1000.0f);
+			ImGui::Text("FPS= %.1f", ImGui::GetIO().Framerate);
+			const char* presentModes[] = { "Fifo", "Mailbox", "Immediate" };
+			int presentMode = int(scene.options.presentMode);
+			if (ImGui::Combo("Present mode", &presentMode, presentModes, 3)) {
+				scene.options.presentMode = PresentMode(presentMode);
+			}
+			ImGui::SliderFloat("Target FPS", &scene.options.targetFps, 0.0f, 240.0f, "%.0f");
+			ImGui::Checkbox("Uncapped", &scene.options.uncapped);
+			ImGui::Checkbox("Frustum culling", &scene.options.frustumCulling);
+			ImGui::Checkbox("Render bundles", &scene.options.renderBundles);
+			if (scene.gpuCulling.supported) {
+				ImGui::Checkbox("GPU-driven culling", &scene.options.gpuCulling);
+			}
+			if (scene.options.gpuCulling && scene.gpuCulling.supported) {
+				ImGui::Text("Objects= %u, culled on GPU, drawn with %u indirect draws", uint32_t(objects.dense.size()), uint32_t(scene.gpuCulling.draws.size()));
+			}
+			else {
+				ImGui::Text("Objects= %u visible, %u culled", scene.stats.visibleObjects, scene.stats.culledObjects);
+			}
+
+			const float MB = 1024.0f * 1024.0f;
+			const GpuArena& va = scene.vertexArena;
+			const GpuArena& qa = scene.quantizedVertexArena;
+			const GpuArena& ia = scene.indexArena;
+			ImGui::Text("Vertex memory= %.1f / %.1f MB", float(va.usedUnits * va.unitSize) / MB, float(_internalArenaCapacity(va) * va.unitSize) / MB);
+			if (!qa.blocks.empty()) {
+				ImGui::Text("Quantized vertex memory= %.1f / %.1f MB", float(qa.usedUnits * qa.unitSize) / MB, float(_internalArenaCapacity(qa) * qa.unitSize) / MB);
+			}
+			ImGui::Text("Index memory= %.1f / %.1f MB", float(ia.usedUnits * ia.unitSize) / MB, float(_internalArenaCapacity(ia) * ia.unitSize) / MB);
+			ImGui::Checkbox("Profiler", &scene.showProfiler);
+		}
+		ImGui::End();
+
+		if (scene.showProfiler) {
+			_internalRenderProfilerGui();
+		}
+	}
+
+
+	bool init(const char* windowName, int width, int height) {
+		const bool headless = scene.options.headless;
+		if (headless && (width <= 0 || height <= 0)) {
+			width = 1280;
+			height = 720;
+		}
+		scene.width = width;
+		scene.height = height;
+		std::cout << "Initialization" << std::endl;
+
+		if (!headless) {
+			// GLFW
+			if (!glfwInit()) {
+				std::cerr << "Error: could not initialize GLFW" << std::endl;
+				return false;
+			}
+			std::cout << "--- GLFW" << std::endl;
+
+			// Window
+			scene.window = glfwCreateWindow(width, height, windowName, nullptr, nullptr);
+			if (!scene.window) {
+				std::cerr << "Error: could not open window" << std::endl;
+				glfwTerminate();
+				return false;
+			}
+			std::cout << "--- window" << std::endl;
+		}
+
+		// Instance
+		Instance instance = wgpuCreateInstance(nullptr);
+
+		// Adapter, not tied to any surface in headless mode
+		if (!headless) {
+			scene.surface = glfwGetWGPUSurface(instance, scene.window);
+		}
+		RequestAdapterOptions adapterOpts = {};
+		adapterOpts.nextInChain = nullptr;
+		adapterOpts.compatibleSurface = scene.surface;
+		adapterOpts.powerPreference = WGPUPowerPreference_HighPerformance;
+		Adapter adapter = requestAdapterSync(instance, &adapterOpts);
+		std::cout << "--- adapter" << std::endl;
+		AdapterProperties properties = {};
+		properties.nextInChain = nullptr;
+		wgpuAdapterGetProperties(adapter, &properties);
+		if (properties.name) {
+			std::cout << "--- adapter name: " << properties.name << std::endl;
+			scene.pipelineCache.isolationKey = properties.name;
+		}
+		wgpuInstanceRelease(instance);
+
+		// Device, GPU culling needs the object slot as firstInstance in indirect draws
+		std::vector<WGPUFeatureName> requiredFeatures;
+		scene.profiler.timestamps = adapter.hasFeature(WGPUFeatureName_TimestampQuery);
+		if (scene.profiler.timestamps) {
+			requiredFeatures.push_back(WGPUFeatureName_TimestampQuery);
+		}
+		scene.gpuCulling.supported = adapter.hasFeature(WGPUFeatureName_IndirectFirstInstance);
+		if (scene.gpuCulling.supported) {
+			requiredFeatures.push_back(WGPUFeatureName_IndirectFirstInstance);
+		}
+		// Dawn objects are only safe to use from several threads with implicit device synchronization
+#if defined(WEBGPU_BACKEND_WGPU)
+		scene.threadSafeEncoding = true;
+#elif defined(WEBGPU_BACKEND_DAWN)
+		scene.threadSafeEncoding = adapter.hasFeature(WGPUFeatureName_ImplicitDeviceSynchronization);
+		if (scene.threadSafeEncoding) {
+			requiredFeatures.push_back(WGPUFeatureName_ImplicitDeviceSynchronization);
+		}
+#endif
+#if defined(WEBGPU_BACKEND_WGPU)
+		scene.gpuCulling.multiDrawIndirect = adapter.hasFeature(WGPUFeatureName(WGPUNativeFeature_MultiDrawIndirect));
+		if (scene.gpuCulling.multiDrawIndirect) {
+			requiredFeatures.push_back(WGPUFeatureName(WGPUNativeFeature_MultiDrawIndirect));
+		}
+#endif
+		DeviceDescriptor deviceDesc = {};
+		deviceDesc.nextInChain = nullptr;
+		deviceDesc.label = "TinyRenderDevice";
+		deviceDesc.requiredFeatureCount = requiredFeatures.size();
+		deviceDesc.requiredFeatures = requiredFeatures.data();
+		auto limits = _internalSetupWpuLimits(adapter);
+		deviceDesc.requiredLimits = &limits;
+		deviceDesc.defaultQueue.nextInChain = nullptr;
+		deviceDesc.defaultQueue.label = "Default queue";
+#if defined(WEBGPU_BACKEND_DAWN)
+		// Compiled pipelines are kept on disk, per adapter. wgpu-native has no pipeline cache, and browsers have their own.
+		PipelineCache& pipelineCache = scene.pipelineCache;
+		std::error_code error;
+		pipelineCache.directory = scene.options.pipelineCachePath.empty() ?
+			fs::temp_directory_path(error) / "tinyrender_pipelines" : fs::path(scene.options.pipelineCachePath);
+		fs::create_directories(pipelineCache.directory, error);
+		WGPUDawnCacheDeviceDescriptor cacheDesc = {};
+		cacheDesc.chain.next = nullptr;
+		cacheDesc.chain.sType = WGPUSType_DawnCacheDeviceDescriptor;
+		cacheDesc.isolationKey = pipelineCache.isolationKey.c_str();
+		cacheDesc.loadDataFunction = _internalLoadPipelineData;
+		cacheDesc.storeDataFunction = _internalStorePipelineData;
+		cacheDesc.functionUserdata = nullptr;
+		if (!error) {
+			deviceDesc.nextInChain = &cacheDesc.chain;
+		}
+#endif
+		deviceDesc.deviceLostCallbackInfo.callback = [](
+			WGPUDevice const* /*device*/,
+			WGPUDeviceLostReason reason,
+			char const* message,
+			void* /*userdata*/
+			) {
+				std::cout << "Device lost: reason " << reason;
+				if (message) {
+					std::cout << " (" << message << ")";
+				}
+				std::cout << std::endl;
+			};
+		scene.device = requestDeviceSync(adapter, &deviceDesc);
+		std::cout << "-- device" << std::endl;
+
+		// Device error callback
+		auto onDeviceError = [](
+			WGPUErrorType type,
+			char const* message,
+			void* /* pUserData */
+			) {
+				std::cout << "Uncaptured device error: type " << type;
+				if (message) {
+					std::cout << " (" << message << ")";
+				}
+				std::cout << std::endl;
+			};
+		wgpuDeviceSetUncapturedErrorCallback(scene.device, onDeviceError, nullptr);
+
+		// Queue
+		scene.queue = wgpuDeviceGetQueue(scene.device);
+
+		// Geometry arenas are sized according to the actual device limits
+		scene.device.getLimits(&scene.limits);
+		_internalSetupArena(scene.vertexArena, "Vertex arena", BufferUsage::Vertex, sizeof(VertexAttributes));
+		_internalSetupArena(scene.quantizedVertexArena, "Quantized vertex arena", BufferUsage::Vertex, sizeof(QuantizedVertex));
+		_internalSetupArena(scene.indexArena, "Index arena", BufferUsage::Index, sizeof(uint32_t));
+
+		// Release the adapter only after it has been fully utilized
+		adapter.release();
+
+		// Surface, or offscreen color target in headless mode
+		if (!headless) {
+			SurfaceConfiguration& config = scene.surfaceConfig;
+			config = {};
+			config.width = scene.width;
+			config.height = scene.height;
+			config.usage = TextureUsage::RenderAttachment;
+			wgpu::SurfaceCapabilities capabilities;
+			scene.surface.getCapabilities(adapter, &capabilities);
+			config.format = capabilities.formats[0];
+			config.viewFormatCount = 0;
+			config.viewFormats = nullptr;
+			config.device = scene.device;
+			config.alphaMode = CompositeAlphaMode::Auto;
+			scene.supportedPresentModes.assign(capabilities.presentModes, capabilities.presentModes + capabilities.presentModeCount);
+			_internalConfigureSurface();
+			std::cout << "-- surface" << std::endl;
+		}
+		else {
+			_internalSetupOffscreenTarget();
+			std::cout << "-- offscreen target" << std::endl;
+		}
+
+		_internalSetupRenderPipeline();
+		std::cout << "-- render pipeline" << std::endl;
+
+		_internalSetupDepthTexture();
+		std::cout << "-- depth texture" << std::endl;
+
+		_internalSetupSceneData();
+		std::cout << "-- scene buffer and bind groups" << std::endl;
+
+		_internalSetupStaging();
+		std::cout << "-- staging ring (" << scene.staging.frames.size() << " frames in flight)" << std::endl;
+
+		_internalSetupWorkers();
+		std::cout << "-- " << _internalWorkerCount() << " threads" << (scene.threadSafeEncoding ? "" : ", single-threaded encoding") << std::endl;
+
+		if (scene.profiler.timestamps) {
+			_internalSetupGpuTimestamps();
+			std::cout << "-- gpu timestamps" << std::endl;
+		}
+
+		if (scene.gpuCulling.supported) {
+			_internalSetupGpuCulling();
+			std::cout << "-- gpu culling" << std::endl;
+		}
+		else {
+			std::cout << "-- gpu culling not supported (no indirect-first-instance)" << std::endl;
+		}
+
+		if (!headless) {
+			_internalSetupCallbacks();
+			std::cout << "-- callbacks" << std::endl;
+
+			_internalSetupImgui();
+			std::cout << "-- imgui" << std::endl;
+		}
+
+		return true;
+	}
+
+	bool shouldQuit() {
+		if (scene.options.headless) {
+			return false;
+		}
+		return glfwWindowShouldClose(scene.window);
+	}
+
+	void update() {
+		if (scene.options.headless) {
+			return;
+		}
+		_internalRotateProfileFrame();
+		{
+			ProfileScope phase(ProfileEvents);
+			glfwPollEvents();
+		}
+
+		vec2 mousePos = getMousePosition();
+		float x = 0.0f, y = 0.0f;
+		if (scene.currentMouseButton == GLFW_MOUSE_BUTTON_LEFT) {
+			float xoffset = float(mousePos.x) - scene.mouseLastPosition.x;
+			// Reversed since y-coordinates
+			float yoffset = scene.mouseLastPosition.y - float(mousePos.y);
+			x += (xoffset * scene.options.mouseSensitivity);
+			y += (yoffset * scene.options.mouseSensitivity);
+		}
+		if (!ImGui::GetIO().WantCaptureMouse)
+			_internalApplyCameraMove(x, y, 0.0f);
+
+		// Auto rotation test
+		_internalApplyCameraMove(0.001f, 0.0f, 0.0f);
+
+		scene.mouseLastPosition = mousePos;
+	}
+
+	template<typename Encoder>
+	static void _internalEncodeObjectDraw(Encoder renderPass, const ObjectInternal& obj, uint8_t lod, GeometryBindings& bindings) {
+		_internalBindGeometry(renderPass, *obj.geometry, bindings);
+		const uint32_t indexCount = lod == 0 ? obj.geometry->drawCount : obj.geometry->lods[lod].indexCount;
+		const uint32_t lodFirstIndex = lod == 0 ? 0 : obj.geometry->lods[lod].firstIndex;
+
+		// The object transform is fetched with instance_index, which starts at firstInstance
+		renderPass.drawIndexed(
+			indexCount, 1,
+			_internalFirstIndex(*obj.geometry) + lodFirstIndex,
+			int32_t(obj.geometry->vertexAlloc.offset),
+			obj.slot
+		);
+	}
+
+	// Indirect draws [begin, end), binding the geometry of each group they belong to
+	template<typename Encoder>
+	static void _internalEncodeIndirectDraws(Encoder renderPass, uint32_t begin, uint32_t end, GeometryBindings& bindings) {
+		const GpuCulling& culling = scene.gpuCulling;
+		const uint64_t stride = sizeof(GpuIndirectDraw);
+		auto group = std::upper_bound(culling.groups.begin(), culling.groups.end(), begin,
+			[](uint32_t draw, const GpuDrawGroup& g) { return draw < g.first; }) - 1;
+		_internalSetGpuCulledDraws(renderPass, bindings, true);
+		for (uint32_t i = begin; i < end; i++) {
+			if (i >= group->first + group->count) {
+				++group;
+			}
+			_internalBindGeometry(renderPass, *group->geometry, bindings);
+			renderPass.drawIndexedIndirect(culling.indirectBuffer, i * stride);
+		}
+	}
+
+	// One instanced draw per mesh
+	template<typename Encoder>
+	static void _internalEncodeMeshDraws(Encoder renderPass, GeometryBindings& bindings) {
+		for (auto& it : meshes) {
+			auto& mesh = it.second;
+			if (mesh.instances.empty()) {
+				continue;
+			}
+			_internalBindGeometry(renderPass, *mesh.geometry, bindings);
+			renderPass.setBindGroup(1, mesh.bindGroup, 0, nullptr);
+
+			renderPass.drawIndexed(
+				mesh.geometry->drawCount, uint32_t(mesh.instances.size()),
+				_internalFirstIndex(*mesh.geometry),
+				int32_t(mesh.geometry->vertexAlloc.offset),
+				0
+			);
+		}
+	}
+
+	template<typename Encoder>
+	static void _internalBeginDraws(Encoder renderPass) {
+		if (scene.renderPipeline) {
+			renderPass.setPipeline(scene.renderPipeline); // missing when no geometry uses it
+		}
+		renderPass.setBindGroup(0, scene.bindGroup, 0, nullptr);
+		renderPass.setBindGroup(1, scene.objectTransforms.bindGroup, 0, nullptr);
+	}
+
+	// Object and mesh draws encoded directly in the render pass, when render bundles are disabled
+	static void _internalEncodeDraws(RenderPassEncoder renderPass, bool gpuCulling) {
+		_internalBeginDraws(renderPass);
+		GeometryBindings bindings;
+		if (gpuCulling) {
+			_internalDrawObjectsGpu(renderPass, bindings);
+		}
+		else {
+			for (const ObjectInternal& obj : objects.dense) {
+				if (scene.objectTransforms.visible[obj.slot]) {
+					_internalEncodeObjectDraw(renderPass, obj, scene.objectTransforms.lod[obj.slot], bindings);
+				}
+			}
+		}
+		_internalEncodeMeshDraws(renderPass, bindings);
+	}
+
+	static RenderBundleEncoder _internalCreateBundleEncoder() {
+		const WGPUTextureFormat colorFormat = TextureFormat::BGRA8Unorm;
+		RenderBundleEncoderDescriptor encoderDesc = {};
+		encoderDesc.label = "Draw bundle encoder";
+		encoderDesc.colorFormatCount = 1;
+		encoderDesc.colorFormats = &colorFormat;
+		encoderDesc.depthStencilFormat = TextureFormat::Depth24Plus;
+		encoderDesc.sampleCount = 1;
+		encoderDesc.depthReadOnly = false;
+		encoderDesc.stencilReadOnly = true;
+		RenderBundleEncoder encoder = scene.device.createRenderBundleEncoder(encoderDesc);
+		_internalBeginDraws(encoder);
+		return encoder;
+	}
+
+	static RenderBundle _internalFinishBundleEncoder(RenderBundleEncoder encoder) {
+		RenderBundleDescriptor bundleDesc = {};
+		bundleDesc.label = "Draw bundle";
+		RenderBundle bundle = encoder.finish(bundleDesc);
+		encoder.release();
+		return bundle;
+	}
+
+	// Object draws are split in contiguous chunks of the draw list, each recorded in its own bundle by a worker.
+	// Bundles are executed in chunk order, so the draw order does not depend on thread scheduling.
+	// Without GPU culling every live object is recorded at full detail, so that camera moves never re-record.
+	static void _internalRecordDrawBundles(bool gpuCulling) {
+		const uint32_t MinDrawsPerBundle = 2048;
+		DrawBundle& drawBundle = scene.drawBundle;
+		for (RenderBundle& bundle : drawBundle.bundles) {
+			bundle.release();
+		}
+		drawBundle.bundles.clear();
+
+		const uint32_t drawCount = uint32_t(gpuCulling ? scene.gpuCulling.draws.size() : objects.dense.size());
+		const uint32_t maxChunks = scene.threadSafeEncoding ? _internalWorkerCount() : 1;
+		const uint32_t chunkCount = std::max(1u, std::min(maxChunks, drawCount / MinDrawsPerBundle));
+
+		drawBundle.bundles.resize(chunkCount + 1);
+		_internalParallelFor(chunkCount, [&](uint32_t chunk) {
+			const uint32_t begin = uint32_t(uint64_t(drawCount) * chunk / chunkCount);
+			const uint32_t end = uint32_t(uint64_t(drawCount) * (chunk + 1) / chunkCount);
+			RenderBundleEncoder encoder = _internalCreateBundleEncoder();
+			GeometryBindings bindings;
+			if (gpuCulling) {
+				_internalEncodeIndirectDraws(encoder, begin, end, bindings);
+			}
+			else {
+				for (uint32_t i = begin; i < end; i++) {
+					_internalEncodeObjectDraw(encoder, objects.dense[i], 0, bindings);
+				}
+			}
+			drawBundle.bundles[chunk] = _internalFinishBundleEncoder(encoder);
+		});
+
+		RenderBundleEncoder encoder = _internalCreateBundleEncoder();
+		GeometryBindings bindings;
+		_internalEncodeMeshDraws(encoder, bindings);
+		drawBundle.bundles[chunkCount] = _internalFinishBundleEncoder(encoder);
+
+		drawBundle.dirty = false;
+		drawBundle.gpuCulling = gpuCulling;
+	}
+
+	// Counts visible objects and selects their levels of detail, for draws encoded each frame
+	static void _internalUpdateVisibility() {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		uint32_t visibleCount = 0;
+		for (size_t slot = 0; slot < transforms.visible.size(); slot++) {
+			if (transforms.objectIds[slot] == UINT32_MAX) {
+				transforms.visible[slot] = 0; // free slots are never counted
+			}
+			visibleCount += transforms.visible[slot];
+		}
+		scene.stats.visibleObjects = visibleCount;
+		scene.stats.culledObjects = uint32_t(objects.dense.size()) - visibleCount;
+		_internalSelectLods();
+	}
+
+	// Records and submits a frame into targetView, with the GUI on top when gui is set
+	static void _internalRenderFrame(TextureView targetView, bool gui) {
+		_internalRotateProfileFrame();
+		scene.profiler.rendered = true;
+		scene.stats = {};
+		scene.profiler.cullingWritten = false;
+		_internalWatchShaders();
+
+		// Create a command encoder for the draw call
+		CommandEncoderDescriptor encoderDesc = {};
+		encoderDesc.label = "Draw Call Encoder";
+		CommandEncoder encoder = wgpuDeviceCreateCommandEncoder(scene.device, &encoderDesc);
+		_internalBeginStagingFrame(encoder);
+
+		// Create the render pass that clears the screen with our color
+		RenderPassColorAttachment renderPassColorAttachment = {};
+		renderPassColorAttachment.view = targetView;
+		renderPassColorAttachment.resolveTarget = nullptr;
+		renderPassColorAttachment.loadOp = LoadOp::Clear;
+		renderPassColorAttachment.storeOp = StoreOp::Store;
+		renderPassColorAttachment.clearValue = Color{ 0.2, 0.2, 0.2, 1.0 };
+		renderPassColorAttachment.depthSlice = WGPU_DEPTH_SLICE_UNDEFINED;
+		RenderPassDescriptor renderPassDesc = {};
+		renderPassDesc.colorAttachmentCount = 1;
+		renderPassDesc.colorAttachments = &renderPassColorAttachment;
+
+		// We now add depth/stencil attachment
+		RenderPassDepthStencilAttachment depthStencilAttachment;
+		depthStencilAttachment.view = depthTextureView;
+		depthStencilAttachment.depthClearValue = 1.0f;
+		depthStencilAttachment.depthLoadOp = LoadOp::Clear;
+		depthStencilAttachment.depthStoreOp = StoreOp::Store;
+		depthStencilAttachment.depthReadOnly = false;
+		depthStencilAttachment.stencilClearValue = 0;
+		depthStencilAttachment.stencilLoadOp = LoadOp::Undefined;
+		depthStencilAttachment.stencilStoreOp = StoreOp::Undefined;
+		depthStencilAttachment.stencilReadOnly = true;
+		renderPassDesc.depthStencilAttachment = &depthStencilAttachment;
+
+		RenderPassTimestampWrites timestampWrites;
+		timestampWrites.querySet = scene.profiler.querySet;
+		timestampWrites.beginningOfPassWriteIndex = 0;
+		timestampWrites.endOfPassWriteIndex = 1;
+		renderPassDesc.timestampWrites = scene.profiler.timestamps ? &timestampWrites : nullptr;
+
+		// Update camera data & buffer
+		std::optional<ProfileScope> phase;
+		phase.emplace(ProfileUpload);
+		scene.uniforms.projMatrix = glm::perspective(
+			glm::radians(45.0f),
+			float(scene.width) / float(scene.height),
+			scene.options.zNear,
+			scene.options.zFar
+		);
+		scene.uniforms.viewMatrix = glm::lookAt(
+			scene.options.eye,
+			scene.options.at,
+			scene.options.up
+		);
+		if (!scene.uniformsUploaded || memcmp(&scene.uniforms, &scene.uploadedUniforms, sizeof(SceneUniforms)) != 0) {
+			_internalStageWrite(
+				scene.uniformBuffer,
+				0,
+				&scene.uniforms,
+				sizeof(SceneUniforms)
+			);
+			scene.uploadedUniforms = scene.uniforms;
+			scene.uniformsUploaded = true;
+		}
+
+		// Compose and upload object and instance transforms modified since last frame
+		_internalResolveTransforms();
+		const GpuCulling& culling = scene.gpuCulling;
+		const bool gpuCulling = scene.options.gpuCulling && culling.supported && culling.pipeline &&
+			_internalObjectPipelinesReady(culling.renderPipelines[0], culling.renderPipelines[1]);
+		if (gpuCulling) {
+			_internalPrepareGpuCulling();
+		}
+		_internalUploadObjectTransforms();
+		for (auto& it : meshes) {
+			if (it.second.dirty && !it.second.instances.empty()) {
+				_internalUploadInstances(it.second);
+			}
+		}
+
+		// Defragment geometry memory if a lot of it has been freed
+		_internalCompactArenas(encoder);
+		if (gpuCulling && scene.gpuCulling.commandsDirty) {
+			_internalRebuildGpuDrawCommands();
+		}
+
+		// With a static draw list only the uniforms change between frames: replay the recorded bundle.
+		// Multi draw indirect is already a handful of calls, and is not available in bundles.
+		const bool useBundle = scene.options.renderBundles && !(gpuCulling && scene.gpuCulling.multiDrawIndirect);
+
+		// Frustum culling, either in a compute pass writing indirect draws or on the CPU. Bundles without GPU
+		// culling draw all objects: culling them on the CPU would re-record the bundle whenever the camera moves.
+		phase.emplace(ProfileCulling);
+		vec4 frustumPlanes[6];
+		_internalExtractFrustumPlanes(scene.uniforms.projMatrix * scene.uniforms.viewMatrix, frustumPlanes);
+		if (gpuCulling) {
+			_internalCullObjectsGpu(encoder, frustumPlanes);
+		}
+		else if (!useBundle) {
+			_internalCullObjects(frustumPlanes);
+			_internalUpdateVisibility();
+		}
+		else {
+			scene.stats.visibleObjects = uint32_t(objects.dense.size());
+		}
+
+		// Objects are not drawn while their pipelines are still being created
+		const bool pipelinesReady = _internalObjectPipelinesReady(scene.renderPipeline, scene.quantizedPipeline);
+
+		// Create the render pass
+		phase.emplace(ProfileEncoding);
+		const Clock::time_point encodeStart = Clock::now();
+		RenderPassEncoder renderPass = encoder.beginRenderPass(renderPassDesc);
+		if (pipelinesReady && useBundle) {
+			DrawBundle& bundle = scene.drawBundle;
+			if (bundle.dirty || bundle.gpuCulling != gpuCulling) {
+				_internalRecordDrawBundles(gpuCulling);
+			}
+			renderPass.executeBundles(bundle.bundles.size(), (WGPURenderBundle*)bundle.bundles.data());
+		}
+		else if (pipelinesReady) {
+			_internalEncodeDraws(renderPass, gpuCulling);
+		}
+		scene.stats.encodeMs = std::chrono::duration<float, std::milli>(Clock::now() - encodeStart).count();
+
+		if (gui) {
+			phase.emplace(ProfileGui);
+			_internalRenderGui();
+
+			ImGui::EndFrame();
+			ImGui::Render();
+			ImGui_ImplWGPU_RenderDrawData(ImGui::GetDrawData(), renderPass);
+		}
+
+		renderPass.end();
+		renderPass.release();
+		GpuTimestampReadback* timestampReadback = scene.profiler.timestamps ? _internalResolveTimestamps(encoder) : nullptr;
+
+		// Finally encode and submit the render pass
+		CommandBufferDescriptor cmdBufferDescriptor = {};
+		cmdBufferDescriptor.label = "Command buffer";
+		CommandBuffer command = encoder.finish(cmdBufferDescriptor);
+		encoder.release();
+		_internalEndStagingFrame();
+
+		phase.emplace(ProfileSubmit);
+		const Clock::time_point submitStart = Clock::now();
+		scene.queue.submit(1, &command);
+		command.release();
+		_internalStagingFrameSubmitted();
+		const Clock::time_point submitEnd = Clock::now();
+		phase.reset();
+		if (timestampReadback) {
+			timestampReadback->busy = true;
+			timestampReadback->frame = scene.profiler.frameNumber;
+			timestampReadback->submitUs = _internalProfilerTimeUs(submitStart);
+			wgpuBufferMapAsync(timestampReadback->buffer, WGPUMapMode_Read, 0, 4 * sizeof(uint64_t), _internalOnTimestampsMapped, timestampReadback);
+		}
+		scene.stats.submitMs = std::chrono::duration<float, std::milli>(submitEnd - submitStart).count();
+
+		for (Buffer& buffer : scene.pendingDestroyBuffers) {
+			buffer.destroy();
+			buffer.release();
+		}
+		scene.pendingDestroyBuffers.clear();
+	}
+
+	void render() {
+		if (scene.options.headless) {
+			// Headless frames are benchmarks or tests: draw everything from the first frame
+			_internalWaitForPipelines();
+			_internalRenderFrame(scene.offscreen.colorView, false);
+			return;
+		}
+
+		ImGui_ImplWGPU_NewFrame();
+		ImGui_ImplGlfw_NewFrame();
+		ImGui::NewFrame();
+
+		// Present mode may have been changed in the options
+		if (_internalRequestedPresentMode() != scene.configuredPresentMode) {
+			_internalConfigureSurface();
+		}
+
+		// Get the next target texture view, this is where the CPU waits when the swap chain is full
+		TextureView targetView;
+		{
+			ProfileScope phase(ProfileAcquire);
+			targetView = _internalNextSurfaceTextureView();
+		}
+		if (!targetView) return;
+
+		_internalRenderFrame(targetView, true);
+
+		// At the end of the frame
+		targetView.release();
+	}
+
+	Image renderToImage() {
+		OffscreenTarget& target = scene.offscreen;
+		if (!target.colorTexture || target.width != uint32_t(scene.width) || target.height != uint32_t(scene.height)) {
+			_internalSetupOffscreenTarget();
+		}
+		_internalWaitForPipelines();
+		_internalRenderFrame(target.colorView, false);
+
+		// Copy the frame to the staging buffer, rows are padded to the copy alignment
+		CommandEncoderDescriptor encoderDesc = {};
+		encoderDesc.label = "Readback encoder";
+		CommandEncoder encoder = wgpuDeviceCreateCommandEncoder(scene.device, &encoderDesc);
+		ImageCopyTexture source = {};
+		source.texture = target.colorTexture;
+		source.mipLevel = 0;
+		source.origin = { 0, 0, 0 };
+		source.aspect = TextureAspect::All;
+		ImageCopyBuffer destination = {};
+		destination.buffer = target.readbackBuffer;
+		destination.layout.offset = 0;
+		destination.layout.bytesPerRow = target.bytesPerRow;
+		destination.layout.rowsPerImage = target.height;
+		encoder.copyTextureToBuffer(source, destination, { target.width, target.height, 1 });
+		CommandBufferDescriptor cmdBufferDescriptor = {};
+		cmdBufferDescriptor.label = "Readback command buffer";
+		CommandBuffer command = encoder.finish(cmdBufferDescriptor);
+		encoder.release();
+		scene.queue.submit(1, &command);
+		command.release();
+
+		// Wait for the copy to be done and the staging buffer mapped
+		bool done = false;
+		bool success = false;
+		const uint64_t size = uint64_t(target.bytesPerRow) * target.height;
+		auto handle = target.readbackBuffer.mapAsync(MapMode::Read, 0, size, [&](WGPUBufferMapAsyncStatus status) {
+			done = true;
+			success = status == WGPUBufferMapAsyncStatus_Success;
+		});
+		while (!done) {
+			_internalPollDevice(true);
+		}
+
+		Image image;
+		if (!success) {
+			std::cerr << "Error: could not read back the rendered image" << std::endl;
+			return image;
+		}
+		image.width = target.width;
+		image.height = target.height;
+		image.pixels.resize(size_t(target.width) * target.height * 4);
+		const uint8_t* mapped = (const uint8_t*)target.readbackBuffer.getConstMappedRange(0, size);
+		for (uint32_t y = 0; y < target.height; y++) {
+			const uint8_t* src = mapped + size_t(y) * target.bytesPerRow;
+			uint8_t* dst = image.pixels.data() + size_t(y) * target.width * 4;
+			for (uint32_t x = 0; x < target.width; x++) {
+				// The color target is BGRA, images are RGBA
+				dst[4 * x + 0] = src[4 * x + 2];
+				dst[4 * x + 1] = src[4 * x + 1];
+				dst[4 * x + 2] = src[4 * x + 0];
+				dst[4 * x + 3] = src[4 * x + 3];
+			}
+		}
+		target.readbackBuffer.unmap();
+		return image;
+	}
+
+	void swap() {
+		{
+			ProfileScope phase(ProfilePresent);
+			if (!scene.options.headless) {
+				scene.surface.present();
+			}
+			scene.device.tick();
+		}
+		{
+			ProfileScope phase(ProfilePacing);
+			_internalPaceFrame();
+		}
+		_internalEndProfileFrame();
+	}
+
+	void terminate() {
+		for (ObjectInternal& obj : objects.dense) {
+			_internalReleaseGeometry(obj.geometry);
+		}
+		objects = ObjectStorage();
+		for (auto& it : meshes) {
+			_internalDestroyMesh(it.second);
+		}
+		meshes.clear();
+		instances.clear();
+		scene.objectTransforms.buffer.destroy();
+		scene.objectTransforms.buffer.release();
+		scene.objectTransforms.bindGroup.release();
+		_internalDestroyPipelines();
+		if (scene.gpuCulling.supported) {
+			_internalDestroyGpuCulling();
+		}
+		if (scene.profiler.timestamps) {
+			_internalDestroyGpuTimestamps();
+		}
+		for (RenderBundle& bundle : scene.drawBundle.bundles) {
+			bundle.release();
+		}
+		scene.drawBundle.bundles.clear();
+		_internalDestroyWorkers();
+		_internalDestroyStaging();
+		for (auto& it : scene.pendingUploads) {
+			it.second.buffer.release();
+		}
+		scene.pendingUploads.clear();
+		_internalDestroyArena(scene.vertexArena);
+		_internalDestroyArena(scene.quantizedVertexArena);
+		_internalDestroyArena(scene.indexArena);
+
+		depthTexture.destroy();
+		depthTexture.release();
+		depthTextureView.release();
+		if (scene.offscreen.colorTexture) {
+			_internalDestroyOffscreenTarget();
+		}
+
+		if (!scene.options.headless) {
+			ImGui_ImplGlfw_Shutdown();
+			ImGui_ImplWGPU_Shutdown();
+
+			scene.surface.unconfigure();
+			scene.surface.release();
+		}
+		scene.queue.release();
+		scene.device.release();
+
+		if (!scene.options.headless) {
+			glfwDestroyWindow(scene.window);
+			glfwTerminate();
+		}
+	}
+
+	Options& getOptions() {
+		return scene.options;
+	}
+
+	const FrameStats& getFrameStats() {
+		return scene.stats;
+	}
+
+	bool exportChromeTrace(const std::string& path) {
+		const bool success = _internalWriteChromeTrace(path);
+		if (success) {
+			std::cout << "Chrome trace written to " << path << std::endl;
+		}
+		else {
+			std::cerr << "Error: could not write trace " << path << std::endl;
+		}
+		return success;
+	}
+
+
+	// Read-only view of a whole file, memory mapped when the platform allows it
+	struct MappedFile {
+		const char* data = nullptr;
+		size_t size = 0;
+#if defined(_WIN32)
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#elif defined(__EMSCRIPTEN__)
+		std::vector<char> buffer;
+#else
+		int descriptor = -1;
+#endif
+	};
+
+	static void _internalUnmapFile(MappedFile& file) {
+#if defined(_WIN32)
+		if (file.data) {
+			UnmapViewOfFile(file.data);
+		}
+		if (file.mapping) {
+			CloseHandle(file.mapping);
+		}
+		if (file.file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file.file);
+		}
+#elif defined(__EMSCRIPTEN__)
+		file.buffer.clear();
+#else
+		if (file.data && file.size > 0) {
+			munmap(const_cast<char*>(file.data), file.size);
+		}
+		if (file.descriptor >= 0) {
+			close(file.descriptor);
+		}
+#endif
+		file = MappedFile();
+	}
+
+	static bool _internalMapFile(const std::string& path, MappedFile& file) {
+#if defined(_WIN32)
+		file.file = CreateFileW(fs::path(path).wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		LARGE_INTEGER size;
+		if (file.file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file.file, &size)) {
+			_internalUnmapFile(file);
+			return false;
+		}
+		file.size = size_t(size.QuadPart);
+		if (file.size > 0) {
+			file.mapping = CreateFileMappingW(file.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			file.data = file.mapping ? static_cast<const char*>(MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+			if (!file.data) {
+				_internalUnmapFile(file);
+				return false;
+			}
+		}
+#elif defined(__EMSCRIPTEN__)
+		std::ifstream stream(path, std::ios::binary | std::ios::ate);
+		if (!stream.is_open()) {
+			return false;
+		}
+		file.buffer.resize(size_t(stream.tellg()));
+		stream.seekg(0);
+		stream.read(file.buffer.data(), file.buffer.size());
+		file.data = file.buffer.data();
+		file.size = file.buffer.size();
+#else
+		file.descriptor = open(path.c_str(), O_RDONLY);
+		struct stat status;
+		if (file.descriptor < 0 || fstat(file.descriptor, &status) != 0) {
+			_internalUnmapFile(file);
+			return false;
+		}
+		file.size = size_t(status.st_size);
+		if (file.size > 0) {
+			void* data = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, file.descriptor, 0);
+			if (data == MAP_FAILED) {
+				file.size = 0;
+				_internalUnmapFile(file);
+				return false;
+			}
+			madvise(data, file.size, MADV_SEQUENTIAL);
+			file.data = static_cast<const char*>(data);
+		}
+#endif
+		return true;
+	}
+
+	// Text parsing helpers, all bounded by the end of the buffer
+	static const char* _internalSkipSpaces(const char* p, const char* end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+			p++;
+		}
+		return p;
+	}
+
+	static const char* _internalNextLine(const char* p, const char* end) {
+		p = static_cast<const char*>(memchr(p, '\n', end - p));
+		return p ? p + 1 : end;
+	}
+
+	static bool _internalStartsWith(const char* p, const char* end, const char* word) {
+		const size_t length = strlen(word);
+		return size_t(end - p) >= length && memcmp(p, word, length) == 0;
+	}
+
+	static int64_t _internalParseInt(const char*& p, const char* end) {
+		p = _internalSkipSpaces(p, end);
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			negative = *p++ == '-';
+		}
+		int64_t value = 0;
+		while (p < end && *p >= '0' && *p <= '9') {
+			value = value * 10 + (*p++ - '0');
+		}
+		return negative ? -value : value;
+	}
+
+	// Locale independent, precise enough for vertex data
+	static double _internalParseFloat(const char*& p, const char* end) {
+		p = _internalSkipSpaces(p, end);
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			negative = *p++ == '-';
+		}
+		double value = 0.0;
+		while (p < end && *p >= '0' && *p <= '9') {
+			value = value * 10.0 + (*p++ - '0');
+		}
+		if (p < end && *p == '.') {
+			p++;
+			double scale = 0.1;
+			while (p < end && *p >= '0' && *p <= '9') {
+				value += (*p++ - '0') * scale;
+				scale *= 0.1;
+			}
+		}
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			p++;
+			value *= std::pow(10.0, double(_internalParseInt(p, end)));
+		}
+		return negative ? -value : value;
+	}
+
+	// Splits [begin, end) in chunks of whole lines, so that they can be parsed in parallel
+	static std::vector<const char*> _internalSplitLines(const char* begin, const char* end) {
+		const size_t MinChunkSize = 1 << 20;
+		const size_t chunkCount = std::max<size_t>(1, std::min<size_t>(4 * _internalWorkerCount(), (end - begin) / MinChunkSize));
+		std::vector<const char*> bounds = { begin };
+		for (size_t i = 1; i < chunkCount; i++) {
+			const char* p = std::max(bounds.back(), begin + (end - begin) * i / chunkCount);
+			bounds.push_back(_internalNextLine(p, end));
+		}
+		bounds.push_back(end);
+		return bounds;
+	}
+
+	// Area weighted vertex normals, for files without normals
+	static void _internalComputeNormals(ObjectDescriptor& objDesc) {
+		objDesc.normals.assign(objDesc.vertices.size(), vec3(0.0f));
+		for (size_t t = 0; t + 2 < objDesc.triangles.size(); t += 3) {
+			const uint32_t a = objDesc.triangles[t], b = objDesc.triangles[t + 1], c = objDesc.triangles[t + 2];
+			const vec3 n = glm::cross(objDesc.vertices[b] - objDesc.vertices[a], objDesc.vertices[c] - objDesc.vertices[a]);
+			objDesc.normals[a] += n;
+			objDesc.normals[b] += n;
+			objDesc.normals[c] += n;
+		}
+		for (vec3& n : objDesc.normals) {
+			const float length = glm::length(n);
+			n = length > 0.0f ? n / length : vec3(0.0f, 0.0f, 1.0f);
+		}
+	}
+
+	// Merges identical positions of a triangle soup into shared vertices
+	static void _internalWeldTriangleSoup(const std::vector<vec3>& soup, ObjectDescriptor& objDesc) {
+		std::unordered_map<vec3, uint32_t, PositionHash> indices;
+		indices.reserve(soup.size() / 4);
+		objDesc.triangles.resize(soup.size());
+		for (size_t i = 0; i < soup.size(); i++) {
+			auto it = indices.insert({ soup[i], uint32_t(objDesc.vertices.size()) }).first;
+			if (it->second == objDesc.vertices.size()) {
+				objDesc.vertices.push_back(soup[i]);
+			}
+			objDesc.triangles[i] = it->second;
+		}
+	}
+
+	// OBJ: positions, normals and polygonal faces, other statements are ignored
+	struct ObjCorner {
+		int64_t position;
+		int64_t normal;  // -1 when the face has no normals
+		uint8_t relative; // bit 0: position, bit 1: normal are relative to the chunk
+	};
+
+	struct ObjChunk {
+		std::vector<vec3> positions;
+		std::vector<vec3> normals;
+		std::vector<ObjCorner> corners; // three per triangle
+	};
+
+	static void _internalParseObjChunk(const char* p, const char* end, ObjChunk& chunk) {
+		std::vector<ObjCorner> polygon;
+		while (p < end) {
+			const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+			lineEnd = lineEnd ? lineEnd : end;
+			p = _internalSkipSpaces(p, lineEnd);
+			if (_internalStartsWith(p, lineEnd, "v ") || _internalStartsWith(p, lineEnd, "v\t")) {
+				p += 2;
+				vec3 v;
+				v.x = float(_internalParseFloat(p, lineEnd));
+				v.y = float(_internalParseFloat(p, lineEnd));
+				v.z = float(_internalParseFloat(p, lineEnd));
+				chunk.positions.push_back(v);
+			}
+			else if (_internalStartsWith(p, lineEnd, "vn")) {
+				p += 2;
+				vec3 n;
+				n.x = float(_internalParseFloat(p, lineEnd));
+				n.y = float(_internalParseFloat(p, lineEnd));
+				n.z = float(_internalParseFloat(p, lineEnd));
+				chunk.normals.push_back(n);
+			}
+			else if (_internalStartsWith(p, lineEnd, "f ") || _internalStartsWith(p, lineEnd, "f\t")) {
+				p += 2;
+				polygon.clear();
+				while ((p = _internalSkipSpaces(p, lineEnd)) < lineEnd && *p != '#') {
+					// v, v/vt, v//vn or v/vt/vn. Negative indices count back from the last element read.
+					ObjCorner corner = { _internalParseInt(p, lineEnd), 0, 0 };
+					if (p < lineEnd && *p == '/') {
+						p++;
+						if (p < lineEnd && *p != '/') {
+							_internalParseInt(p, lineEnd);
+						}
+						if (p < lineEnd && *p == '/') {
+							p++;
+							corner.normal = _internalParseInt(p, lineEnd);
+						}
+					}
+					while (p < lineEnd && *p != ' ' && *p != '\t' && *p != '\r') {
+						p++;
+					}
+					if (corner.position < 0) {
+						corner.position += int64_t(chunk.positions.size());
+						corner.relative |= 1;
+					}
+					else {
+						corner.position -= 1;
+					}
+					if (corner.normal < 0) {
+						corner.normal += int64_t(chunk.normals.size());
+						corner.relative |= 2;
+					}
+					else {
+						corner.normal -= 1;
+					}
+					polygon.push_back(corner);
+				}
+
+				// Fan triangulation
+				for (size_t i = 2; i < polygon.size(); i++) {
+					chunk.corners.push_back(polygon[0]);
+					chunk.corners.push_back(polygon[i - 1]);
+					chunk.corners.push_back(polygon[i]);
+				}
+			}
+			p = lineEnd < end ? lineEnd + 1 : end;
+		}
+	}
+
+	static bool _internalLoadObj(const MappedFile& file, ObjectDescriptor& objDesc) {
+		const std::vector<const char*> bounds = _internalSplitLines(file.data, file.data + file.size);
+		std::vector<ObjChunk> chunks(bounds.size() - 1);
+		_internalParallelFor(uint32_t(chunks.size()), [&](uint32_t i) {
+			_internalParseObjChunk(bounds[i], bounds[i + 1], chunks[i]);
+		});
+
+		// Global indices of the first position and normal of each chunk
+		std::vector<vec3> positions, normals;
+		std::vector<int64_t> positionBase(chunks.size()), normalBase(chunks.size());
+		for (size_t i = 0; i < chunks.size(); i++) {
+			positionBase[i] = int64_t(positions.size());
+			normalBase[i] = int64_t(normals.size());
+			positions.insert(positions.end(), chunks[i].positions.begin(), chunks[i].positions.end());
+			normals.insert(normals.end(), chunks[i].normals.begin(), chunks[i].normals.end());
+			chunks[i].positions = {};
+			chunks[i].normals = {};
+		}
+
+		// Vertices are unique (position, normal) pairs. Corners without a normal get a computed one,
+		// the normals of the file are kept for the others.
+		std::unordered_map<uint64_t, uint32_t> vertices;
+		std::vector<uint8_t> missingNormals;
+		bool anyMissing = false;
+		for (size_t c = 0; c < chunks.size(); c++) {
+			for (const ObjCorner& corner : chunks[c].corners) {
+				const int64_t position = corner.position + ((corner.relative & 1) ? positionBase[c] : 0);
+				int64_t normal = corner.normal + ((corner.relative & 2) ? normalBase[c] : 0);
+				if (position < 0 || position >= int64_t(positions.size()) || normal >= int64_t(normals.size())) {
+					std::cerr << "Error: index out of range in OBJ file" << std::endl;
+					return false;
+				}
+				if (normal < 0) {
+					normal = UINT32_MAX;
+				}
+				const uint64_t key = (uint64_t(position) << 32) | uint64_t(normal);
+				auto it = vertices.insert({ key, uint32_t(objDesc.vertices.size()) }).first;
+				if (it->second == objDesc.vertices.size()) {
+					objDesc.vertices.push_back(positions[position]);
+					objDesc.normals.push_back(normal == UINT32_MAX ? vec3(0.0f) : normals[normal]);
+					missingNormals.push_back(normal == UINT32_MAX);
+					anyMissing |= normal == UINT32_MAX;
+				}
+				objDesc.triangles.push_back(it->second);
+			}
+			chunks[c].corners = {};
+		}
+		if (anyMissing) {
+			std::vector<vec3> fileNormals = std::move(objDesc.normals);
+			_internalComputeNormals(objDesc);
+			for (size_t v = 0; v < fileNormals.size(); v++) {
+				if (!missingNormals[v]) {
+					objDesc.normals[v] = fileNormals[v];
+				}
+			}
+		}
+		return true;
+	}
+
+	// STL: triangle soup, binary or ASCII. Facet normals are ignored, smooth normals are computed after welding.
+	static bool _internalLoadStl(const MappedFile& file, ObjectDescriptor& objDesc) {
+		std::vector<vec3> soup;
+		uint32_t binaryCount = 0;
+		if (file.size >= 84) {
+			memcpy(&binaryCount, file.data + 80, sizeof(uint32_t));
+		}
+		if (file.size >= 84 && file.size == 84 + 50 * uint64_t(binaryCount)) {
+			soup.resize(3 * size_t(binaryCount));
+			const uint32_t chunkCount = 4 * _internalWorkerCount();
+			_internalParallelFor(chunkCount, [&](uint32_t chunk) {
+				const uint64_t begin = uint64_t(binaryCount) * chunk / chunkCount;
+				const uint64_t end = uint64_t(binaryCount) * (chunk + 1) / chunkCount;
+				for (uint64_t t = begin; t < end; t++) {
+					memcpy(&soup[3 * t], file.data + 84 + 50 * t + 12, 3 * sizeof(vec3));
+				}
+			});
+		}
+		else {
+			const std::vector<const char*> bounds = _internalSplitLines(file.data, file.data + file.size);
+			std::vector<std::vector<vec3>> chunks(bounds.size() - 1);
+			_internalParallelFor(uint32_t(chunks.size()), [&](uint32_t i) {
+				for (const char* p = bounds[i]; p < bounds[i + 1]; p = _internalNextLine(p, bounds[i + 1])) {
+					const char* lineEnd = _internalNextLine(p, bounds[i + 1]);
+					p = _internalSkipSpaces(p, lineEnd);
+					if (_internalStartsWith(p, lineEnd, "vertex")) {
+						p += 6;
+						vec3 v;
+						v.x = float(_internalParseFloat(p, lineEnd));
+						v.y = float(_internalParseFloat(p, lineEnd));
+						v.z = float(_internalParseFloat(p, lineEnd));
+						chunks[i].push_back(v);
+					}
+				}
+			});
+			for (std::vector<vec3>& chunk : chunks) {
+				soup.insert(soup.end(), chunk.begin(), chunk.end());
+				chunk = {};
+			}
+			if (soup.size() % 3 != 0) {
+				std::cerr << "Error: incomplete facet in STL file" << std::endl;
+				return false;
+			}
+		}
+		_internalWeldTriangleSoup(soup, objDesc);
+		_internalComputeNormals(objDesc);
+		return true;
+	}
+
+	// PLY: vertex (x, y, z, nx, ny, nz, red, green, blue) and face (vertex_indices) elements, other data is skipped
+	enum PlyType { PlyInt8, PlyUint8, PlyInt16, PlyUint16, PlyInt32, PlyUint32, PlyFloat32, PlyFloat64, PlyInvalid };
+	static const uint32_t PlyTypeSizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+
+	struct PlyProperty {
+		std::string name;
+		PlyType type = PlyInvalid;
+		PlyType countType = PlyInvalid; // lists only
+	};
+
+	struct PlyElement {
+		std::string name;
+		uint64_t count = 0;
+		std::vector<PlyProperty> properties;
+	};
+
+	static PlyType _internalPlyType(const std::string& name) {
+		static const std::pair<const char*, PlyType> types[] = {
+			{ "char", PlyInt8 }, { "int8", PlyInt8 }, { "uchar", PlyUint8 }, { "uint8", PlyUint8 },
+			{ "short", PlyInt16 }, { "int16", PlyInt16 }, { "ushort", PlyUint16 }, { "uint16", PlyUint16 },
+			{ "int", PlyInt32 }, { "int32", PlyInt32 }, { "uint", PlyUint32 }, { "uint32", PlyUint32 },
+			{ "float", PlyFloat32 }, { "float32", PlyFloat32 }, { "double", PlyFloat64 }, { "float64", PlyFloat64 }
+		};
+		for (const auto& type : types) {
+			if (name == type.first) {
+				return type.second;
+			}
+		}
+		return PlyInvalid;
+	}
+
+	static double _internalReadPlyValue(const char* p, PlyType type, bool bigEndian) {
+		uint8_t bytes[8];
+		const uint32_t size = PlyTypeSizes[type];
+		memcpy(bytes, p, size);
+		if (bigEndian) {
+			std::reverse(bytes, bytes + size);
+		}
+		switch (type) {
+		case PlyInt8: { int8_t v; memcpy(&v, bytes, 1); return v; }
+		case PlyUint8: return bytes[0];
+		case PlyInt16: { int16_t v; memcpy(&v, bytes, 2); return v; }
+		case PlyUint16: { uint16_t v; memcpy(&v, bytes, 2); return v; }
+		case PlyInt32: { int32_t v; memcpy(&v, bytes, 4); return v; }
+		case PlyUint32: { uint32_t v; memcpy(&v, bytes, 4); return v; }
+		case PlyFloat32: { float v; memcpy(&v, bytes, 4); return v; }
+		default: { double v; memcpy(&v, bytes, 8); return v; }
+		}
+	}
+
+	// Reads one element: returns the values of its scalar properties, and the list of its list property
+	struct PlyReader {
+		const PlyElement* element;
+		bool ascii;
+		bool bigEndian;
+
+		// truncated is set when a binary element does not fit before end
+		const char* read(const char* p, const char* end, double* values, std::vector<uint32_t>& list, bool* truncated = nullptr) const {
+			list.clear();
+			for (size_t i = 0; i < element->properties.size(); i++) {
+				const PlyProperty& property = element->properties[i];
+				if (property.countType != PlyInvalid) {
+					const uint64_t count = uint64_t(readScalar(p, end, property.countType, truncated));
+					uint64_t k = 0;
+					for (; k < count && p < end; k++) {
+						list.push_back(uint32_t(readScalar(p, end, property.type, truncated)));
+					}
+					if (k < count && !ascii && truncated) {
+						*truncated = true;
+					}
+					values[i] = 0.0;
+				}
+				else {
+					values[i] = readScalar(p, end, property.type, truncated);
+				}
+			}
+			return ascii ? _internalNextLine(p, end) : p;
+		}
+
+		double readScalar(const char*& p, const char* end, PlyType type, bool* truncated = nullptr) const {
+			if (ascii) {
+				return _internalParseFloat(p, end);
+			}
+			if (p + PlyTypeSizes[type] > end) {
+				p = end;
+				if (truncated) {
+					*truncated = true;
+				}
+				return 0.0;
+			}
+			const double value = _internalReadPlyValue(p, type, bigEndian);
+			p += PlyTypeSizes[type];
+			return value;
+		}
+	};
+
+	// Size in bytes of each binary element, 0 when it has lists
+	static uint64_t _internalPlyStride(const PlyElement& element) {
+		uint64_t stride = 0;
+		for (const PlyProperty& property : element.properties) {
+			if (property.countType != PlyInvalid) {
+				return 0;
+			}
+			stride += PlyTypeSizes[property.type];
+		}
+		return stride;
+	}
+
+	static bool _internalLoadPly(const MappedFile& file, ObjectDescriptor& objDesc) {
+		const char* end = file.data + file.size;
+		const char* p = file.data;
+		bool ascii = false, bigEndian = false;
+		std::vector<PlyElement> elements;
+		bool headerEnded = false;
+		while (p < end && !headerEnded) {
+			const char* lineEnd = _internalNextLine(p, end);
+			std::string line(p, lineEnd);
+			line.erase(line.find_last_not_of(" \t\r\n") + 1);
+			std::vector<std::string> words;
+			for (size_t begin = 0; begin < line.size();) {
+				const size_t next = std::min(line.find(' ', begin), line.size());
+				if (next > begin) {
+					words.push_back(line.substr(begin, next - begin));
+				}
+				begin = next + 1;
+			}
+			if (words.empty() || words[0] == "comment" || words[0] == "obj_info" || words[0] == "ply") {
+			}
+			else if (words[0] == "format" && words.size() >= 2) {
+				ascii = words[1] == "ascii";
+				bigEndian = words[1] == "binary_big_endian";
+			}
+			else if (words[0] == "element" && words.size() >= 3) {
+				// Every element takes at least one byte, larger counts (or negative ones, wrapped) are malformed
+				char* countEnd = nullptr;
+				const uint64_t count = strtoull(words[2].c_str(), &countEnd, 10);
+				if (countEnd == words[2].c_str() || *countEnd != '\0' || count > file.size) {
+					std::cerr << "Error: invalid PLY element count " << line << std::endl;
+					return false;
+				}
+				elements.push_back({ words[1], count, {} });
+			}
+			else if (words[0] == "property" && words.size() >= 3 && !elements.empty()) {
+				PlyProperty property;
+				if (words[1] == "list" && words.size() >= 5) {
+					property.countType = _internalPlyType(words[2]);
+					property.type = _internalPlyType(words[3]);
+					property.name = words[4];
+					if (property.countType == PlyInvalid) {
+						property.type = PlyInvalid;
+					}
+				}
+				else {
+					property.type = _internalPlyType(words[1]);
+					property.name = words[2];
+				}
+				if (property.type == PlyInvalid) {
+					std::cerr << "Error: unsupported PLY property " << line << std::endl;
+					return false;
+				}
+				elements.back().properties.push_back(property);
+			}
+			else if (words[0] == "end_header") {
+				headerEnded = true;
+			}
+			p = lineEnd;
+		}
+		if (!headerEnded) {
+			std::cerr << "Error: missing PLY header" << std::endl;
+			return false;
+		}
+
+		std::vector<uint32_t> list;
+		for (const PlyElement& element : elements) {
+			const PlyReader reader = { &element, ascii, bigEndian };
+			const uint64_t stride = ascii ? 0 : _internalPlyStride(element);
+			auto propertyIndex = [&](const char* name) {
+				for (size_t i = 0; i < element.properties.size(); i++) {
+					if (element.properties[i].name == name) {
+						return int(i);
+					}
+				}
+				return -1;
+			};
+
+			// Start of each block of elements parsed in parallel: fixed size binary elements are indexed directly,
+			// ASCII lines are counted, and binary elements with lists are walked.
+			const uint32_t blockCount = std::max<uint32_t>(1, uint32_t(std::min<uint64_t>(4 * _internalWorkerCount(), element.count / 4096)));
+			std::vector<const char*> blockStarts(blockCount + 1);
+			std::vector<uint64_t> blockFirst(blockCount + 1);
+			std::vector<double> values(element.properties.size());
+			for (uint32_t b = 0; b <= blockCount; b++) {
+				blockFirst[b] = element.count * b / blockCount;
+			}
+			if (stride > 0) {
+				if (uint64_t(end - p) < element.count * stride) {
+					std::cerr << "Error: truncated PLY file" << std::endl;
+					return false;
+				}
+				for (uint32_t b = 0; b <= blockCount; b++) {
+					blockStarts[b] = p + blockFirst[b] * stride;
+				}
+			}
+			else {
+				// Walked one by one: running out of data before the last element is a truncated file
+				uint32_t b = 0;
+				bool truncated = false;
+				for (uint64_t i = 0; i <= element.count && !truncated; i++) {
+					while (b <= blockCount && blockFirst[b] == i) {
+						blockStarts[b++] = p;
+					}
+					if (i < element.count) {
+						truncated = p >= end;
+						p = ascii ? _internalNextLine(p, end) : reader.read(p, end, values.data(), list, &truncated);
+					}
+				}
+				if (truncated) {
+					std::cerr << "Error: truncated PLY file" << std::endl;
+					return false;
+				}
+			}
+			p = blockStarts[blockCount];
+
+			if (element.name == "vertex") {
+				const int x = propertyIndex("x"), y = propertyIndex("y"), z = propertyIndex("z");
+				const int nx = propertyIndex("nx"), ny = propertyIndex("ny"), nz = propertyIndex("nz");
+				const int red = propertyIndex("red"), green = propertyIndex("green"), blue = propertyIndex("blue");
+				if (x < 0 || y < 0 || z < 0) {
+					std::cerr << "Error: PLY vertices without positions" << std::endl;
+					return false;
+				}
+				const bool hasNormals = nx >= 0 && ny >= 0 && nz >= 0;
+				const bool hasColors = red >= 0 && green >= 0 && blue >= 0;
+				const float colorScale = hasColors && element.properties[red].type == PlyUint8 ? 1.0f / 255.0f : 1.0f;
+				objDesc.vertices.resize(element.count);
+				objDesc.normals.resize(hasNormals ? element.count : 0);
+				objDesc.colors.resize(hasColors ? element.count : 0);
+				_internalParallelFor(blockCount, [&](uint32_t b) {
+					std::vector<double> v(element.properties.size());
+					std::vector<uint32_t> unused;
+					const char* q = blockStarts[b];
+					for (uint64_t i = blockFirst[b]; i < blockFirst[b + 1]; i++) {
+						q = reader.read(q, end, v.data(), unused);
+						objDesc.vertices[i] = vec3(v[x], v[y], v[z]);
+						if (hasNormals) {
+							objDesc.normals[i] = vec3(v[nx], v[ny], v[nz]);
+						}
+						if (hasColors) {
+							objDesc.colors[i] = vec3(v[red], v[green], v[blue]) * colorScale;
+						}
+					}
+				});
+			}
+			else if (element.name == "face") {
+				// Polygons are fan triangulated, each block writes its own triangles
+				std::vector<std::vector<uint32_t>> blockTriangles(blockCount);
+				_internalParallelFor(blockCount, [&](uint32_t b) {
+					std::vector<double> v(element.properties.size());
+					std::vector<uint32_t> polygon;
+					const char* q = blockStarts[b];
+					for (uint64_t i = blockFirst[b]; i < blockFirst[b + 1]; i++) {
+						q = reader.read(q, end, v.data(), polygon);
+						for (size_t k = 2; k < polygon.size(); k++) {
+							blockTriangles[b].insert(blockTriangles[b].end(), { polygon[0], polygon[k - 1], polygon[k] });
+						}
+					}
+				});
+				for (std::vector<uint32_t>& triangles : blockTriangles) {
+					objDesc.triangles.insert(objDesc.triangles.end(), triangles.begin(), triangles.end());
+					triangles = {};
+				}
+			}
+		}
+
+		for (uint32_t index : objDesc.triangles) {
+			if (index >= objDesc.vertices.size()) {
+				std::cerr << "Error: index out of range in PLY file" << std::endl;
+				return false;
+			}
+		}
+		if (objDesc.normals.empty()) {
+			_internalComputeNormals(objDesc);
+		}
+		return true;
+	}
+
+
+	// .trmesh: GPU ready geometry of a mesh file, written to the mesh cache directory the first time it is loaded.
+	// The header is followed by the interleaved vertices, the packed indices, the levels of detail and the triangle order.
+	struct MeshCacheHeader {
+		char magic[4];               // "TRMS"
+		uint32_t version;
+		uint64_t sourceSize;         // the cache is valid while the source has the same size and write time,
+		int64_t sourceTime;          // or the same content hash when only the time changed
+		uint64_t sourceHash;
+		GeometryKey geometryKey;     // key of the parsed descriptor, shared with the geometry cache
+		uint32_t flags;              // MeshCacheFlags the geometry was built with
+		uint32_t vertexCount;
+		uint32_t drawCount;
+		uint32_t indexUnits;         // in 4 bytes units
+		uint32_t indexBits;          // 16 or 32
+		uint32_t lodCount;
+		uint32_t triangleOrderCount;
+		uint32_t padding;
+		float boundsMin[3];
+		float boundsMax[3];
+	};
+	static_assert(sizeof(MeshCacheHeader) == 112);
+
+	enum MeshCacheFlags : uint32_t {
+		MeshCacheOptimized = 1,
+		MeshCacheLods = 2,
+		MeshCacheTriangleOrder = 4 // optimized for picking, triangles are mapped back to the file order
+	};
 
-		_internalSetupDepthTexture();
-		std::cout << "-- depth texture" << std::endl;
+	static const uint32_t MeshCacheVersion = 2;
 
-		_internalSetupSceneData();
-		std::cout << "-- scene buffer and bind groups" << std::endl;
+	static uint32_t _internalMeshCacheFlags() {
+		uint32_t flags = 0;
+		if (scene.options.optimizeMeshes) {
+			flags |= MeshCacheOptimized | (scene.options.picking ? MeshCacheTriangleOrder : 0u);
+		}
+		if (scene.options.lods) {
+			flags |= MeshCacheLods;
+		}
+		return flags;
+	}
 
-		_internalSetupCallbacks();
-		std::cout << "-- callbacks" << std::endl;
+	static uint64_t _internalMeshCacheSize(const MeshCacheHeader& header) {
+		return sizeof(MeshCacheHeader) + uint64_t(header.vertexCount) * sizeof(VertexAttributes) + uint64_t(header.indexUnits) * sizeof(uint32_t) +
+			uint64_t(header.lodCount) * sizeof(GeometryLod) + uint64_t(header.triangleOrderCount) * sizeof(uint32_t);
+	}
 
-		_internalSetupImgui();
-		std::cout << "-- imgui" << std::endl;
+	static bool _internalSourceStatus(const std::string& path, uint64_t& size, int64_t& time) {
+		std::error_code error;
+		size = uint64_t(fs::file_size(path, error));
+		if (error) {
+			return false;
+		}
+		time = int64_t(fs::last_write_time(path, error).time_since_epoch().count());
+		return !error;
+	}
 
-		return true;
+	// Content hash of a file, hashed in fixed size chunks in parallel
+	static uint64_t _internalHashFile(const MappedFile& file) {
+		const uint64_t ChunkSize = 4 << 20;
+		std::vector<uint64_t> chunkHashes((file.size + ChunkSize - 1) / ChunkSize);
+		_internalParallelFor(uint32_t(chunkHashes.size()), [&](uint32_t i) {
+			const uint64_t begin = i * ChunkSize;
+			chunkHashes[i] = _internalHashBytes(0xcbf29ce484222325ull, file.data + begin, std::min<uint64_t>(ChunkSize, file.size - begin));
+		});
+		return _internalHashVector(0xcbf29ce484222325ull, chunkHashes);
 	}
 
-	bool shouldQuit() {
-		return glfwWindowShouldClose(scene.window);
+	// Packs a copy of the descriptor as it would be uploaded, and writes it to a temporary file renamed at the end,
+	// so that a cache file is never seen half written. The descriptor is left as parsed for the fallback upload.
+	static bool _internalWriteMeshCache(const std::string& cachePath, const ObjectDescriptor& parsed, const MeshCacheHeader& source) {
+		ObjectDescriptor objDesc = parsed;
+		MeshCacheHeader header = source;
+		memcpy(header.magic, "TRMS", 4);
+		header.version = MeshCacheVersion;
+		header.geometryKey = _internalHashDescriptor(objDesc);
+		header.flags = _internalMeshCacheFlags();
+		header.padding = 0;
+
+		objDesc.quantized = false;
+		GeometryInternal geometry;
+		_internalOptimizeGeometry(objDesc, geometry);
+		_internalBuildLods(objDesc, geometry);
+		std::vector<VertexAttributes> vertexData(objDesc.vertices.size());
+		std::vector<uint32_t> indexData(_internalIndexUnits(objDesc, geometry));
+		_internalPackGeometry(objDesc, geometry, vertexData.data(), indexData.data());
+		header.vertexCount = uint32_t(vertexData.size());
+		header.drawCount = geometry.drawCount;
+		header.indexUnits = uint32_t(indexData.size());
+		header.indexBits = geometry.indexFormat == IndexFormat::Uint16 ? 16 : 32;
+		header.lodCount = uint32_t(geometry.lods.size());
+		header.triangleOrderCount = uint32_t(geometry.triangleOrder.size());
+		memcpy(header.boundsMin, &geometry.boundsMin, sizeof(header.boundsMin));
+		memcpy(header.boundsMax, &geometry.boundsMax, sizeof(header.boundsMax));
+
+		const std::string tempPath = cachePath + ".tmp";
+		{
+			std::ofstream file(tempPath, std::ios::binary);
+			if (!file.is_open()) {
+				return false;
+			}
+			file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			file.write(reinterpret_cast<const char*>(vertexData.data()), vertexData.size() * sizeof(VertexAttributes));
+			file.write(reinterpret_cast<const char*>(indexData.data()), indexData.size() * sizeof(uint32_t));
+			file.write(reinterpret_cast<const char*>(geometry.lods.data()), geometry.lods.size() * sizeof(GeometryLod));
+			file.write(reinterpret_cast<const char*>(geometry.triangleOrder.data()), geometry.triangleOrder.size() * sizeof(uint32_t));
+			if (!file.good()) {
+				file.close();
+				fs::remove(tempPath);
+				return false;
+			}
+		}
+		std::error_code error;
+		fs::rename(tempPath, cachePath, error);
+		if (error) {
+			fs::remove(tempPath, error);
+			return false;
+		}
+		return true;
 	}
 
-	void update() {
-		glfwPollEvents();
+	// Returns the header of a mapped cache file built with the current options, or nullptr.
+	// Draw and LOD ranges are checked against the index allocation, index values are checked with the picking copy.
+	static const MeshCacheHeader* _internalMeshCacheHeader(const MappedFile& file) {
+		if (file.size < sizeof(MeshCacheHeader)) {
+			return nullptr;
+		}
+		const MeshCacheHeader* header = reinterpret_cast<const MeshCacheHeader*>(file.data);
+		if (memcmp(header->magic, "TRMS", 4) != 0 || header->version != MeshCacheVersion || header->flags != _internalMeshCacheFlags() ||
+			(header->indexBits != 16 && header->indexBits != 32) || file.size < _internalMeshCacheSize(*header)) {
+			return nullptr;
+		}
+		const uint64_t indexCapacity = uint64_t(header->indexUnits) * (32 / header->indexBits);
+		if (header->drawCount > indexCapacity || header->drawCount % 3 != 0 ||
+			(header->triangleOrderCount != 0 && header->triangleOrderCount != header->drawCount / 3)) {
+			return nullptr;
+		}
+		const uint8_t* lodData = reinterpret_cast<const uint8_t*>(file.data) + sizeof(MeshCacheHeader) +
+			uint64_t(header->vertexCount) * sizeof(VertexAttributes) + uint64_t(header->indexUnits) * sizeof(uint32_t);
+		for (uint32_t i = 0; i < header->lodCount; i++) {
+			GeometryLod lod;
+			memcpy(&lod, lodData + i * sizeof(GeometryLod), sizeof(GeometryLod));
+			if (uint64_t(lod.firstIndex) + lod.indexCount > indexCapacity) {
+				return nullptr;
+			}
+		}
+		return header;
+	}
 
-		vec2 mousePos = getMousePosition();
-		float x = 0.0f, y = 0.0f;
-		if (scene.currentMouseButton == GLFW_MOUSE_BUTTON_LEFT) {
-			float xoffset = float(mousePos.x) - scene.mouseLastPosition.x;
-			// Reversed since y-coordinates
-			float yoffset = scene.mouseLastPosition.y - float(mousePos.y);
-			x += (xoffset * scene.options.mouseSensitivity);
-			y += (yoffset * scene.options.mouseSensitivity);
+	// Picking copy of a cache file. Indices are checked against the vertex count, and the triangle order against
+	// the triangle count of the source descriptor: the copy is read on the CPU, where nothing clamps them.
+	static bool _internalReadCachedPickingData(const uint8_t* vertexData, const uint8_t* indexData, const uint8_t* triangleOrderData,
+		const MeshCacheHeader& header, GeometryInternal& geometry) {
+		geometry.positions.resize(header.vertexCount);
+		for (uint32_t i = 0; i < header.vertexCount; i++) {
+			memcpy(&geometry.positions[i], vertexData + i * sizeof(VertexAttributes), sizeof(vec3));
 		}
-		if (!ImGui::GetIO().WantCaptureMouse)
-			_internalApplyCameraMove(x, y, 0.0f);
+		geometry.triangles.resize(header.drawCount);
+		if (header.indexBits == 16) {
+			for (uint32_t i = 0; i < header.drawCount; i++) {
+				uint16_t index;
+				memcpy(&index, indexData + i * sizeof(uint16_t), sizeof(uint16_t));
+				geometry.triangles[i] = index;
+			}
+		}
+		else {
+			memcpy(geometry.triangles.data(), indexData, geometry.triangles.size() * sizeof(uint32_t));
+		}
+		for (uint32_t index : geometry.triangles) {
+			if (index >= header.vertexCount) {
+				return false;
+			}
+		}
+		geometry.triangleOrder.resize(header.triangleOrderCount);
+		memcpy(geometry.triangleOrder.data(), triangleOrderData, geometry.triangleOrder.size() * sizeof(uint32_t));
+		for (uint32_t triangle : geometry.triangleOrder) {
+			if (triangle >= header.geometryKey.indexCount / 3) {
+				return false;
+			}
+		}
+		return true;
+	}
 
-		// Auto rotation test
-		_internalApplyCameraMove(0.001f, 0.0f, 0.0f);
+	// Uploads the geometry with writes straight from the mapped file, unless it is already in the geometry cache.
+	// Returns nullptr when the picking copy of the file is corrupted.
+	static GeometryInternal* _internalAcquireCachedGeometry(const MappedFile& file, const MeshCacheHeader& header) {
+		GeometryKey key = header.geometryKey;
+		GeometryInternal* cached = _internalFindGeometry(key);
+		if (!cached) {
+			const uint8_t* vertexData = reinterpret_cast<const uint8_t*>(file.data) + sizeof(MeshCacheHeader);
+			const uint8_t* indexData = vertexData + uint64_t(header.vertexCount) * sizeof(VertexAttributes);
+			const uint8_t* lodData = indexData + uint64_t(header.indexUnits) * sizeof(uint32_t);
+			const uint8_t* triangleOrderData = lodData + uint64_t(header.lodCount) * sizeof(GeometryLod);
+
+			GeometryInternal geometry;
+			geometry.key = key;
+			geometry.drawCount = header.drawCount;
+			geometry.indexFormat = header.indexBits == 16 ? IndexFormat::Uint16 : IndexFormat::Uint32;
+			memcpy(&geometry.boundsMin, header.boundsMin, sizeof(header.boundsMin));
+			memcpy(&geometry.boundsMax, header.boundsMax, sizeof(header.boundsMax));
+			geometry.lods.resize(header.lodCount);
+			memcpy(geometry.lods.data(), lodData, geometry.lods.size() * sizeof(GeometryLod));
+			if (scene.options.picking && !_internalReadCachedPickingData(vertexData, indexData, triangleOrderData, header, geometry)) {
+				return nullptr;
+			}
 
-		scene.mouseLastPosition = mousePos;
+			geometry.vertexAlloc = _internalArenaAllocate(scene.vertexArena, header.vertexCount);
+			_internalArenaWrite(scene.vertexArena, geometry.vertexAlloc, vertexData, uint64_t(header.vertexCount) * sizeof(VertexAttributes));
+			geometry.indexAlloc = _internalArenaAllocate(scene.indexArena, header.indexUnits);
+			_internalArenaWrite(scene.indexArena, geometry.indexAlloc, indexData, uint64_t(header.indexUnits) * sizeof(uint32_t));
+
+			cached = &_internalInsertGeometry(std::move(geometry));
+		}
+		cached->refCount++;
+		return cached;
 	}
 
-	void render() {
-		ImGui_ImplWGPU_NewFrame();
-		ImGui_ImplGlfw_NewFrame();
-		ImGui::NewFrame();
+	// Creates an object from a cache file, after checking it against its source file when there is one.
+	// Returns UINT32_MAX when the cache is missing or out of date.
+	static uint32_t _internalLoadMeshCache(const std::string& cachePath, const std::string* sourcePath) {
+		MappedFile file;
+		if (!_internalMapFile(cachePath, file)) {
+			return UINT32_MAX;
+		}
+		const MeshCacheHeader* header = _internalMeshCacheHeader(file);
+		bool valid = header != nullptr;
+		bool timeChanged = false;
+		int64_t time = 0;
+		if (valid && sourcePath) {
+			uint64_t size;
+			valid = _internalSourceStatus(*sourcePath, size, time) && size == header->sourceSize;
+			if (valid && time != header->sourceTime) {
+				MappedFile source;
+				valid = _internalMapFile(*sourcePath, source) && _internalHashFile(source) == header->sourceHash;
+				_internalUnmapFile(source);
+				timeChanged = valid;
+			}
+		}
+		uint32_t id = UINT32_MAX;
+		GeometryInternal* geometry = valid ? _internalAcquireCachedGeometry(file, *header) : nullptr;
+		if (geometry) {
+			id = _internalCreateObject(geometry, vec3(0), vec3(0), vec3(1));
+		}
+		else {
+			timeChanged = false;
+		}
+		_internalUnmapFile(file);
 
-		// Get the next target texture view
-		TextureView targetView = _internalNextSurfaceTextureView();
-		if (!targetView) return;
+		// Same content with a new write time: store the time, so that the next loads do not hash the source again
+		if (timeChanged) {
+			std::fstream cacheFile(cachePath, std::ios::binary | std::ios::in | std::ios::out);
+			cacheFile.seekp(offsetof(MeshCacheHeader, sourceTime));
+			cacheFile.write(reinterpret_cast<const char*>(&time), sizeof(time));
+		}
+		return id;
+	}
 
-		// Create a command encoder for the draw call
-		CommandEncoderDescriptor encoderDesc = {};
-		encoderDesc.label = "Draw Call Encoder";
-		CommandEncoder encoder = wgpuDeviceCreateCommandEncoder(scene.device, &encoderDesc);
+	// Cache files are named after the mesh file and a hash of its absolute path
+	static std::string _internalMeshCachePath(const std::string& path) {
+		std::error_code error;
+		const fs::path directory = scene.options.meshCachePath.empty() ?
+			fs::temp_directory_path(error) / "tinyrender_meshes" : fs::path(scene.options.meshCachePath);
+		fs::create_directories(directory, error);
+		const std::string absolute = fs::absolute(path, error).lexically_normal().string();
+		char hash[24];
+		snprintf(hash, sizeof(hash), "-%016llx", (unsigned long long)_internalHashBytes(0xcbf29ce484222325ull, absolute.data(), absolute.size()));
+		return (directory / (fs::path(path).stem().string() + hash + ".trmesh")).string();
+	}
 
-		// Create the render pass that clears the screen with our color
-		RenderPassColorAttachment renderPassColorAttachment = {};
-		renderPassColorAttachment.view = targetView;
-		renderPassColorAttachment.resolveTarget = nullptr;
-		renderPassColorAttachment.loadOp = LoadOp::Clear;
-		renderPassColorAttachment.storeOp = StoreOp::Store;
-		renderPassColorAttachment.clearValue = Color{ 0.2, 0.2, 0.2, 1.0 };
-		renderPassColorAttachment.depthSlice = WGPU_DEPTH_SLICE_UNDEFINED;
-		RenderPassDescriptor renderPassDesc = {};
-		renderPassDesc.colorAttachmentCount = 1;
-		renderPassDesc.colorAttachments = &renderPassColorAttachment;
+	static std::string _internalFileExtension(const std::string& path) {
+		std::string extension = fs::path(path).extension().string();
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return char(tolower(c)); });
+		return extension;
+	}
 
-		// We now add depth/stencil attachment
-		RenderPassDepthStencilAttachment depthStencilAttachment;
-		depthStencilAttachment.view = depthTextureView;
-		depthStencilAttachment.depthClearValue = 1.0f;
-		depthStencilAttachment.depthLoadOp = LoadOp::Clear;
-		depthStencilAttachment.depthStoreOp = StoreOp::Store;
-		depthStencilAttachment.depthReadOnly = false;
-		depthStencilAttachment.stencilClearValue = 0;
-		depthStencilAttachment.stencilLoadOp = LoadOp::Undefined;
-		depthStencilAttachment.stencilStoreOp = StoreOp::Undefined;
-		depthStencilAttachment.stencilReadOnly = true;
-		renderPassDesc.depthStencilAttachment = &depthStencilAttachment;
+	static bool _internalParseMesh(const MappedFile& file, const std::string& path, ObjectDescriptor& objDesc) {
+		const std::string extension = _internalFileExtension(path);
+		objDesc = ObjectDescriptor();
+		bool success = false;
+		if (extension == ".obj") {
+			success = _internalLoadObj(file, objDesc);
+		}
+		else if (extension == ".ply") {
+			success = _internalLoadPly(file, objDesc);
+		}
+		else if (extension == ".stl") {
+			success = _internalLoadStl(file, objDesc);
+		}
+		else {
+			std::cerr << "Error: unsupported mesh format " << extension << std::endl;
+		}
+		if (!success) {
+			std::cerr << "Error: could not load " << path << std::endl;
+			objDesc = ObjectDescriptor();
+		}
+		return success;
+	}
 
-		renderPassDesc.timestampWrites = nullptr;
 
-		// Update camera data & buffer
-		scene.uniforms.projMatrix = glm::perspective(
-			glm::radians(45.0f),
-			float(scene.width) / float(scene.height),
-			scene.options.zNear,
-			scene.options.zFar
-		);
-		scene.uniforms.viewMatrix = glm::lookAt(
-			scene.options.eye,
-			scene.options.at,
-			scene.options.up
-		);
-		scene.queue.writeBuffer(
-			scene.uniformBuffer,
-			0,
-			&scene.uniforms,
-			sizeof(SceneUniforms)
+	uint32_t addObject(const ObjectDescriptor& objDesc) {
+		return _internalCreateObject(
+			_internalAcquireGeometry(objDesc),
+			objDesc.translation,
+			objDesc.rotation,
+			objDesc.scale
 		);
+	}
 
-		// Create the render pass
-		RenderPassEncoder renderPass = encoder.beginRenderPass(renderPassDesc);
-		renderPass.setPipeline(scene.renderPipeline);
-		for (auto& it : objects) {
-			auto& obj = it.second;
-			renderPass.setVertexBuffer(0,
-				obj.vertexBuffer,
-				0,
-				obj.vertexBuffer.getSize()
-			);
-			renderPass.setIndexBuffer(obj.indexBuffer,
-				IndexFormat::Uint16,
-				0,
-				obj.indexBuffer.getSize()
-			);
+	void addObjects(const ObjectDescriptor* objDescs, uint32_t count, uint32_t* ids) {
+		_internalCreateObjects(objDescs, count, ids);
+	}
+
+	std::vector<uint32_t> addObjects(const std::vector<ObjectDescriptor>& objDescs) {
+		std::vector<uint32_t> ids(objDescs.size());
+		_internalCreateObjects(objDescs.data(), uint32_t(objDescs.size()), ids.data());
+		return ids;
+	}
 
-			renderPass.setBindGroup(0, scene.bindGroup, 0, nullptr);
-			renderPass.setBindGroup(1, obj.bindGroup, 0, nullptr);
+	uint32_t addObject(ObjectDescriptor&& objDesc) {
+		const vec3 t = objDesc.translation, r = objDesc.rotation, s = objDesc.scale;
+		return _internalCreateObject(_internalAcquireGeometry(std::move(objDesc)), t, r, s);
+	}
+
+	uint32_t addObject(const VertexAttributes* vertices, uint32_t vertexCount, const uint32_t* triangles, uint32_t indexCount,
+		const vec3& t, const vec3& r, const vec3& s) {
+		MappedUpload mapped = _internalBeginMappedUpload(vertexCount, sizeof(VertexAttributes), indexCount);
+		return _internalCreateObject(_internalAcquireGeometry(_internalCreateGeometry(mapped, vertices, triangles, indexCount)), t, r, s);
+	}
 
-			renderPass.drawIndexed(obj.drawCount, 1, 0, 0, 0);
+	ObjectUpload beginObject(uint32_t vertexCount, uint32_t indexCount) {
+		MappedUpload mapped = _internalBeginMappedUpload(vertexCount, sizeof(VertexAttributes), indexCount);
+		ObjectUpload upload;
+		if (scene.options.picking) {
+			mapped.vertices.resize(vertexCount);
+			mapped.triangles.resize(indexCount);
+			upload.vertices = mapped.vertices.data();
+			upload.triangles = mapped.triangles.data();
+		}
+		else {
+			upload.vertices = reinterpret_cast<VertexAttributes*>(mapped.vertexData);
+			upload.triangles = mapped.indexData;
 		}
+		upload.vertexCount = vertexCount;
+		upload.indexCount = indexCount;
+		upload.id = scene.nextUploadId++;
+		scene.pendingUploads.insert({ upload.id, std::move(mapped) });
+		return upload;
+	}
 
-		_internalRenderGui();
+	uint32_t endObject(const ObjectUpload& upload, const vec3& t, const vec3& r, const vec3& s) {
+		auto it = scene.pendingUploads.find(upload.id);
+		assert(it != scene.pendingUploads.end());
+		MappedUpload mapped = std::move(it->second);
+		scene.pendingUploads.erase(it);
+		const bool copied = !mapped.vertices.empty() || !mapped.triangles.empty();
+		GeometryInternal geometry = copied ?
+			_internalCreateGeometry(mapped, mapped.vertices.data(), mapped.triangles.data(), upload.indexCount) :
+			_internalCreateGeometry(mapped, upload.indexCount, upload.boundsMin, upload.boundsMax);
+		return _internalCreateObject(_internalAcquireGeometry(std::move(geometry)), t, r, s);
+	}
 
-		ImGui::EndFrame();
-		ImGui::Render();
-		ImGui_ImplWGPU_RenderDrawData(ImGui::GetDrawData(), renderPass);
+	bool loadMesh(const std::string& path, ObjectDescriptor& objDesc) {
+		MappedFile file;
+		if (!_internalMapFile(path, file)) {
+			std::cerr << "Error: could not open " << path << std::endl;
+			return false;
+		}
+		const bool success = _internalParseMesh(file, path, objDesc);
+		_internalUnmapFile(file);
+		return success;
+	}
 
-		renderPass.end();
-		renderPass.release();
+	uint32_t loadMesh(const std::string& path) {
+		if (_internalFileExtension(path) == ".trmesh") {
+			const uint32_t id = _internalLoadMeshCache(path, nullptr);
+			if (id == UINT32_MAX) {
+				std::cerr << "Error: could not load " << path << " (missing file, other version or other mesh options)" << std::endl;
+			}
+			return id;
+		}
 
-		// Finally encode and submit the render pass
-		CommandBufferDescriptor cmdBufferDescriptor = {};
-		cmdBufferDescriptor.label = "Command buffer";
-		CommandBuffer command = encoder.finish(cmdBufferDescriptor);
-		encoder.release();
+		const std::string cachePath = scene.options.meshCache ? _internalMeshCachePath(path) : std::string();
+		if (scene.options.meshCache) {
+			const uint32_t id = _internalLoadMeshCache(cachePath, &path);
+			if (id != UINT32_MAX) {
+				return id;
+			}
+		}
 
-		scene.queue.submit(1, &command);
-		ImGui_ImplGlfw_Sleep(16); // TODO: fix this
-		command.release();
+		MappedFile file;
+		if (!_internalMapFile(path, file)) {
+			std::cerr << "Error: could not open " << path << std::endl;
+			return UINT32_MAX;
+		}
+		ObjectDescriptor objDesc;
+		const bool success = _internalParseMesh(file, path, objDesc);
+		MeshCacheHeader source = {};
+		if (success && scene.options.meshCache) {
+			source.sourceHash = _internalHashFile(file);
+		}
+		_internalUnmapFile(file);
+		if (!success) {
+			return UINT32_MAX;
+		}
 
-		// At the end of the frame
-		targetView.release();
+		// The new cache file is loaded like it will be on the next runs
+		if (scene.options.meshCache) {
+			if (_internalSourceStatus(path, source.sourceSize, source.sourceTime) && _internalWriteMeshCache(cachePath, objDesc, source)) {
+				const uint32_t id = _internalLoadMeshCache(cachePath, &path);
+				if (id != UINT32_MAX) {
+					return id;
+				}
+			}
+			std::cerr << "Warning: could not write mesh cache " << cachePath << std::endl;
+		}
+		return addObject(std::move(objDesc));
 	}
 
-	void swap() {
-		scene.surface.present();
-		scene.device.tick();
+	void removeObject(uint32_t id) {
+		if (!_internalIsObjectAlive(id)) {
+			std::cerr << "Error: removeObject called with an invalid or removed object id " << id << std::endl;
+			return;
+		}
+		ObjectInternal& obj = _internalGetObject(id);
+		_internalReleaseSlotHierarchy(obj.slot);
+		_internalReleaseGeometry(obj.geometry);
+		scene.objectTransforms.freeSlots.push_back(obj.slot);
+		scene.objectTransforms.objectIds[obj.slot] = UINT32_MAX;
+		scene.sceneBvh.needsRebuild = true;
+		scene.gpuCulling.commandsDirty = true;
+		scene.drawBundle.dirty = true;
+		_internalEraseObject(id);
 	}
 
-	void terminate() {
-		for (auto& it : objects) {
-			auto& obj = it.second;
-			obj.indexBuffer.destroy();
-			obj.vertexBuffer.destroy();
-			obj.indexBuffer.release();
-			obj.vertexBuffer.release();
+	void updateObject(uint32_t id, const vec3& t, const vec3& r, const vec3& s) {
+		if (!_internalIsObjectAlive(id)) {
+			std::cerr << "Error: updateObject called with an invalid or removed object id " << id << std::endl;
+			return;
 		}
+		_internalSetLocalTransform(_internalGetObject(id).slot, t, r, s);
+	}
 
-		ImGui_ImplGlfw_Shutdown();
-		ImGui_ImplWGPU_Shutdown();
+	void updateObjects(const uint32_t* ids, uint32_t count, const vec3* t, const vec3* r, const vec3* s) {
+		for (uint32_t i = 0; i < count; i++) {
+			if (!_internalIsObjectAlive(ids[i])) {
+				std::cerr << "Error: updateObjects called with an invalid or removed object id " << ids[i] << std::endl;
+				continue;
+			}
+			_internalSetLocalTransform(_internalGetObject(ids[i]).slot, t[i], r[i], s[i]);
+		}
+	}
 
-		depthTexture.destroy();
-		depthTexture.release();
-		depthTextureView.release();
+	void updateObjects(const std::vector<uint32_t>& ids, const std::vector<vec3>& t, const std::vector<vec3>& r, const std::vector<vec3>& s) {
+		assert(t.size() == ids.size() && r.size() == ids.size() && s.size() == ids.size());
+		updateObjects(ids.data(), uint32_t(ids.size()), t.data(), r.data(), s.data());
+	}
 
-		scene.surface.unconfigure();
-		scene.surface.release();
-		scene.queue.release();
-		scene.device.release();
+	void setParent(uint32_t id, uint32_t parentId) {
+		ObjectTransforms& transforms = scene.objectTransforms;
+		if (!_internalIsObjectAlive(id) || (parentId != UINT32_MAX && !_internalIsObjectAlive(parentId))) {
+			std::cerr << "Error: setParent called with an invalid or removed object id" << std::endl;
+			return;
+		}
+		const uint32_t slot = _internalGetObject(id).slot;
+		const uint32_t parentSlot = parentId == UINT32_MAX ? UINT32_MAX : _internalGetObject(parentId).slot;
+		for (uint32_t ancestor = parentSlot; ancestor != UINT32_MAX; ancestor = transforms.parent[ancestor]) {
+			if (ancestor == slot) {
+				std::cerr << "Error: setParent would create a cycle" << std::endl;
+				return;
+			}
+		}
+		if (transforms.parent[slot] == parentSlot) {
+			return;
+		}
+		_internalDetachSlot(slot);
+		if (parentSlot != UINT32_MAX) {
+			_internalAttachSlot(slot, parentSlot);
+		}
+		_internalQueueTransform(slot, PendingWorld);
+	}
 
-		glfwDestroyWindow(scene.window);
-		glfwTerminate();
+	uint32_t addMesh(const ObjectDescriptor& meshDesc) {
+		return _internalCreateMesh(_internalAcquireGeometry(meshDesc));
 	}
 
-	Options& getOptions() {
-		return scene.options;
+	void removeMesh(uint32_t meshId) {
+		assert(meshes.count(meshId) == 1);
+		MeshInternal& mesh = meshes[meshId];
+		for (uint32_t instanceId : mesh.instanceIds) {
+			instances.erase(instanceId);
+		}
+		_internalDestroyMesh(mesh);
+		meshes.erase(meshId);
+		scene.drawBundle.dirty = true;
 	}
 
+	uint32_t addInstance(uint32_t meshId, const vec3& t, const vec3& r, const vec3& s) {
+		assert(meshes.count(meshId) == 1);
+		MeshInternal& mesh = meshes[meshId];
 
-	uint32_t addObject(const ObjectDescriptor& objDesc) {
-		return _internalCreateObject(objDesc);
+		uint32_t id = nextInstanceId++;
+		instances.insert({ id, { meshId, uint32_t(mesh.instances.size()) } });
+		mesh.instances.push_back({ _internalComputeModelMatrix(t, r, s) * _internalDequantizeMatrix(*mesh.geometry) });
+		mesh.instanceIds.push_back(id);
+		mesh.dirty = true;
+		scene.drawBundle.dirty = true;
+		return id;
 	}
 
-	void removeObject(uint32_t id) {
-		assert(id < objects.size());
-		ObjectInternal& obj = objects[id];
-		obj.indexBuffer.destroy();
-		obj.vertexBuffer.destroy();
-		obj.indexBuffer.release();
-		obj.vertexBuffer.release();
-		objects.erase(id);
+	void removeInstance(uint32_t instanceId) {
+		assert(instances.count(instanceId) == 1);
+		const InstanceInternal instance = instances[instanceId];
+		MeshInternal& mesh = meshes[instance.meshId];
+
+		// Swap with the last instance to keep the storage buffer densely packed
+		const uint32_t last = uint32_t(mesh.instances.size()) - 1;
+		if (instance.index != last) {
+			mesh.instances[instance.index] = mesh.instances[last];
+			mesh.instanceIds[instance.index] = mesh.instanceIds[last];
+			instances[mesh.instanceIds[instance.index]].index = instance.index;
+		}
+		mesh.instances.pop_back();
+		mesh.instanceIds.pop_back();
+		mesh.dirty = true;
+		scene.drawBundle.dirty = true;
+		instances.erase(instanceId);
 	}
 
-	void updateObject(uint32_t id, const vec3& t, const vec3& r, const vec3& s) {
-		assert(id < objects.size());
-		ObjectInternal& obj = objects[id];
-		obj.uniforms.modelMatrix = _internalComputeModelMatrix(t, r, s);
-		scene.queue.writeBuffer(obj.uniformBuffer, 0, &obj.uniforms.modelMatrix, sizeof(ObjectUniforms));
+	void updateInstance(uint32_t instanceId, const vec3& t, const vec3& r, const vec3& s) {
+		assert(instances.count(instanceId) == 1);
+		const InstanceInternal& instance = instances[instanceId];
+		MeshInternal& mesh = meshes[instance.meshId];
+		mesh.instances[instance.index].modelMatrix = _internalComputeModelMatrix(t, r, s) * _internalDequantizeMatrix(*mesh.geometry);
+		mesh.dirty = true;
 	}
 
-	uint32_t addSphere(float r, int n) {
+	static ObjectDescriptor _internalSphereDescriptor(float r, int n) {
 		ObjectDescriptor newObj;
 
-		const uint16_t p = 2 * (uint16_t)n;
-		const uint16_t s = (2 * (uint16_t)n) * ((uint16_t)n - 1) + 2;
+		const uint32_t p = 2 * (uint32_t)n;
+		const uint32_t s = (2 * (uint32_t)n) * ((uint32_t)n - 1) + 2;
 		newObj.vertices.resize(s);
 		newObj.normals.resize(s);
 
@@ -846,26 +6353,26 @@ namespace tinyrender {
 		newObj.triangles.reserve(4 * n * (n - 1) * 3);
 
 		// South cap
-		for (uint16_t i = 0; i < 2 * n; i++) {
+		for (uint32_t i = 0; i < p; i++) {
 			newObj.triangles.push_back(s - 1);
 			newObj.triangles.push_back((i + 1) % p);
 			newObj.triangles.push_back(i);
 		}
 
 		// North cap
-		for (uint16_t i = 0; i < 2 * n; i++) {
+		for (uint32_t i = 0; i < p; i++) {
 			newObj.triangles.push_back(s - 2);
-			newObj.triangles.push_back(2 * (uint16_t)n * ((uint16_t)n - 2) + i);
-			newObj.triangles.push_back(2 * (uint16_t)n * ((uint16_t)n - 2) + (i + 1) % p);
+			newObj.triangles.push_back(2 * (uint32_t)n * ((uint32_t)n - 2) + i);
+			newObj.triangles.push_back(2 * (uint32_t)n * ((uint32_t)n - 2) + (i + 1) % p);
 		}
 
 		// Sphere
-		for (uint16_t j = 1; j < n - 1; j++) {
-			for (uint16_t i = 0; i < 2 * n; i++) {
-				const uint16_t v0 = (j - 1) * p + i;
-				const uint16_t v1 = (j - 1) * p + (i + 1) % p;
-				const uint16_t v2 = j * p + (i + 1) % p;
-				const uint16_t v3 = j * p + i;
+		for (uint32_t j = 1; j + 1 < (uint32_t)n; j++) {
+			for (uint32_t i = 0; i < p; i++) {
+				const uint32_t v0 = (j - 1) * p + i;
+				const uint32_t v1 = (j - 1) * p + (i + 1) % p;
+				const uint32_t v2 = j * p + (i + 1) % p;
+				const uint32_t v3 = j * p + i;
 
 				newObj.triangles.push_back(v0);
 				newObj.triangles.push_back(v1);
@@ -877,10 +6384,10 @@ namespace tinyrender {
 			}
 		}
 
-		return addObject(newObj);
+		return newObj;
 	}
 
-	uint32_t addPlane(float size, int n) {
+	static ObjectDescriptor _internalPlaneDescriptor(float size, int n) {
 		n = n + 1;
 		vec3 a({ -size, 0.0f, -size });
 		vec3 b({ size, 0.0f, size });
@@ -906,21 +6413,21 @@ namespace tinyrender {
 				int v3 = ((j + 1) * n) + i + 1;
 
 				// tri 0
-				planeObject.triangles.push_back((uint16_t)v0);
-				planeObject.triangles.push_back((uint16_t)v1);
-				planeObject.triangles.push_back((uint16_t)v2);
+				planeObject.triangles.push_back((uint32_t)v0);
+				planeObject.triangles.push_back((uint32_t)v1);
+				planeObject.triangles.push_back((uint32_t)v2);
 
 				// tri 1
-				planeObject.triangles.push_back((uint16_t)v2);
-				planeObject.triangles.push_back((uint16_t)v1);
-				planeObject.triangles.push_back((uint16_t)v3);
+				planeObject.triangles.push_back((uint32_t)v2);
+				planeObject.triangles.push_back((uint32_t)v1);
+				planeObject.triangles.push_back((uint32_t)v3);
 			}
 		}
 
-		return addObject(planeObject);
+		return planeObject;
 	}
 
-	uint32_t addBox(float r) {
+	static ObjectDescriptor _internalBoxDescriptor(float r) {
 		const vec3 a = vec3(-r);
 		const vec3 b = vec3(r);
 
@@ -974,13 +6481,221 @@ namespace tinyrender {
 		newObj.triangles.push_back(20); newObj.triangles.push_back(21); newObj.triangles.push_back(22);
 		newObj.triangles.push_back(20); newObj.triangles.push_back(22); newObj.triangles.push_back(23);
 
-		return addObject(newObj);
+		return newObj;
+	}
+
+	// Primitives are cached by their parameters, so the descriptor is only built on the first call
+	static GeometryInternal* _internalAcquireSphereGeometry(float r, int n) {
+		return _internalAcquireGeometry(
+			_internalHashPrimitive("sphere", r, n),
+			[&]() { return _internalSphereDescriptor(r, n); }
+		);
+	}
+
+	static GeometryInternal* _internalAcquirePlaneGeometry(float size, int n) {
+		return _internalAcquireGeometry(
+			_internalHashPrimitive("plane", size, n),
+			[&]() { return _internalPlaneDescriptor(size, n); }
+		);
+	}
+
+	static GeometryInternal* _internalAcquireBoxGeometry(float r) {
+		return _internalAcquireGeometry(
+			_internalHashPrimitive("box", r, 0),
+			[&]() { return _internalBoxDescriptor(r); }
+		);
+	}
+
+	uint32_t addSphere(float r, int n) {
+		return _internalCreateObject(_internalAcquireSphereGeometry(r, n), vec3(0), vec3(0), vec3(1));
+	}
+
+	uint32_t addPlane(float size, int n) {
+		return _internalCreateObject(_internalAcquirePlaneGeometry(size, n), vec3(0), vec3(0), vec3(1));
+	}
+
+	uint32_t addBox(float r) {
+		return _internalCreateObject(_internalAcquireBoxGeometry(r), vec3(0), vec3(0), vec3(1));
+	}
+
+	uint32_t addSphereMesh(float r, int n) {
+		return _internalCreateMesh(_internalAcquireSphereGeometry(r, n));
+	}
+
+	uint32_t addPlaneMesh(float size, int n) {
+		return _internalCreateMesh(_internalAcquirePlaneGeometry(size, n));
+	}
+
+	uint32_t addBoxMesh(float r) {
+		return _internalCreateMesh(_internalAcquireBoxGeometry(r));
+	}
+
+	PickResult pick(const vec2& screenPos) {
+		PickResult result;
+		if (!scene.options.picking) {
+			std::cerr << "Error: pick needs Options::picking, set before adding objects" << std::endl;
+			return result;
+		}
+		_internalResolveTransforms();
+		_internalUpdateSceneBvh();
+		const Bvh& bvh = scene.sceneBvh.bvh;
+		if (bvh.nodes.empty()) {
+			return result;
+		}
+
+		// World space ray through the pixel, t = 1 on the far plane
+		const vec4 viewport = vec4(0.0f, 0.0f, float(scene.width), float(scene.height));
+		const vec3 windowPos = vec3(screenPos.x, float(scene.height) - screenPos.y, 0.0f);
+		const vec3 origin = glm::unProject(windowPos, scene.uniforms.viewMatrix, scene.uniforms.projMatrix, viewport);
+		const vec3 target = glm::unProject(vec3(windowPos.x, windowPos.y, 1.0f), scene.uniforms.viewMatrix, scene.uniforms.projMatrix, viewport);
+		const vec3 dir = target - origin;
+		const vec3 invDir = 1.0f / dir;
+
+		float tMax = 1.0f;
+		std::vector<uint32_t> stack = { 0 };
+		while (!stack.empty()) {
+			const BvhNode& node = bvh.nodes[stack.back()];
+			stack.pop_back();
+			if (!_internalRayBoxIntersect(origin, invDir, node.boundsMin, node.boundsMax, tMax)) {
+				continue;
+			}
+			if (node.count == 0) {
+				stack.push_back(node.leftFirst);
+				stack.push_back(node.leftFirst + 1);
+				continue;
+			}
+			for (uint32_t i = 0; i < node.count; i++) {
+				const uint32_t slot = bvh.primitives[node.leftFirst + i];
+				const uint32_t objectId = scene.objectTransforms.objectIds[slot];
+				GeometryInternal& geometry = *_internalGetObject(objectId).geometry;
+
+				// Intersect in object space, the ray parameter is preserved by the affine transform
+				const mat4 invModel = _internalDequantizeMatrix(geometry) * glm::inverse(scene.objectTransforms.uniforms[slot].modelMatrix);
+				const vec3 localOrigin = vec3(invModel * vec4(origin, 1.0f));
+				const vec3 localDir = vec3(invModel * vec4(dir, 0.0f));
+				uint32_t triangle;
+				if (_internalRayGeometryIntersect(geometry, localOrigin, localDir, tMax, triangle)) {
+					result.hit = true;
+					result.objectId = objectId;
+					result.triangle = geometry.triangleOrder.empty() ? triangle : geometry.triangleOrder[triangle];
+				}
+			}
+		}
+		if (result.hit) {
+			result.position = origin + tMax * dir;
+			result.distance = tMax * glm::length(dir);
+		}
+		return result;
 	}
 
 	vec2 getMousePosition() {
+		if (scene.options.headless) {
+			return vec2(0.0f);
+		}
 		double x, y;
 		glfwGetCursorPos(scene.window, &x, &y);
 		return vec2(float(x), float(y));
 	}
 
+
+	static uint32_t _internalCrc32(uint32_t crc, const uint8_t* data, size_t size) {
+		static uint32_t table[256] = {};
+		if (table[1] == 0) {
+			for (uint32_t i = 0; i < 256; i++) {
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++) {
+					c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+				}
+				table[i] = c;
+			}
+		}
+		crc = ~crc;
+		for (size_t i = 0; i < size; i++) {
+			crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		}
+		return ~crc;
+	}
+
+	static void _internalAppendBigEndian(std::vector<uint8_t>& out, uint32_t v) {
+		out.push_back(uint8_t(v >> 24));
+		out.push_back(uint8_t(v >> 16));
+		out.push_back(uint8_t(v >> 8));
+		out.push_back(uint8_t(v));
+	}
+
+	static void _internalWritePngChunk(std::ofstream& file, const char* type, const std::vector<uint8_t>& data) {
+		std::vector<uint8_t> chunk;
+		_internalAppendBigEndian(chunk, uint32_t(data.size()));
+		chunk.insert(chunk.end(), type, type + 4);
+		chunk.insert(chunk.end(), data.begin(), data.end());
+		_internalAppendBigEndian(chunk, _internalCrc32(0, chunk.data() + 4, chunk.size() - 4));
+		file.write((const char*)chunk.data(), chunk.size());
+	}
+
+	// Uncompressed PNG: the zlib stream only contains stored deflate blocks
+	static bool _internalWritePng(const Image& image, const std::string& path) {
+		std::ofstream file(path, std::ios::binary);
+		if (!file.is_open()) {
+			return false;
+		}
+		const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		file.write((const char*)signature, sizeof(signature));
+
+		std::vector<uint8_t> header;
+		_internalAppendBigEndian(header, uint32_t(image.width));
+		_internalAppendBigEndian(header, uint32_t(image.height));
+		header.insert(header.end(), { 8, 6, 0, 0, 0 }); // 8 bits RGBA, no interlacing
+		_internalWritePngChunk(file, "IHDR", header);
+
+		// Each row starts with filter type 0
+		const size_t rowSize = size_t(image.width) * 4;
+		std::vector<uint8_t> raw;
+		raw.reserve((rowSize + 1) * image.height);
+		for (int y = 0; y < image.height; y++) {
+			raw.push_back(0);
+			raw.insert(raw.end(), image.pixels.begin() + y * rowSize, image.pixels.begin() + (y + 1) * rowSize);
+		}
+
+		std::vector<uint8_t> zlib = { 0x78, 0x01 };
+		uint32_t adlerA = 1, adlerB = 0;
+		for (uint8_t byte : raw) {
+			adlerA = (adlerA + byte) % 65521;
+			adlerB = (adlerB + adlerA) % 65521;
+		}
+		for (size_t offset = 0; offset < raw.size() || offset == 0; offset += 65535) {
+			const uint16_t blockSize = uint16_t(std::min<size_t>(65535, raw.size() - offset));
+			zlib.push_back(offset + blockSize >= raw.size() ? 1 : 0);
+			zlib.push_back(uint8_t(blockSize));
+			zlib.push_back(uint8_t(blockSize >> 8));
+			zlib.push_back(uint8_t(~blockSize & 0xFF));
+			zlib.push_back(uint8_t((~blockSize >> 8) & 0xFF));
+			zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + blockSize);
+		}
+		_internalAppendBigEndian(zlib, (adlerB << 16) | adlerA);
+		_internalWritePngChunk(file, "IDAT", zlib);
+		_internalWritePngChunk(file, "IEND", {});
+		return bool(file);
+	}
+
+	static bool _internalWritePpm(const Image& image, const std::string& path) {
+		std::ofstream file(path, std::ios::binary);
+		if (!file.is_open()) {
+			return false;
+		}
+		file << "P6\n" << image.width << " " << image.height << "\n255\n";
+		for (size_t i = 0; i < image.pixels.size(); i += 4) {
+			file.write((const char*)&image.pixels[i], 3);
+		}
+		return bool(file);
+	}
+
+	bool saveImage(const Image& image, const std::string& path) {
+		const std::string extension = fs::path(path).extension().string();
+		const bool success = extension == ".ppm" ? _internalWritePpm(image, path) : _internalWritePng(image, path);
+		if (!success) {
+			std::cerr << "Error: could not write image " << path << std::endl;
+		}
+		return success;
+	}
+
 } // namespace tinyrender